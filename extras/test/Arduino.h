@@ -0,0 +1,95 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_ARDUINO_HOST_
+#define _H_ARDUINO_HOST_
+
+/*
+ * The few parts of the Arduino API that the library uses, for the host tests.
+ * millis() runs on a simulated clock that advances by one millisecond each
+ * time it is read, so every wait in the library ends in a bounded number of
+ * iterations. A test talks to the library through a subclass of
+ * HardwareSerial that plays the part of the ESP-AT device.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+unsigned long millis();
+void delay(unsigned long ms);
+void yield();
+long random(long max);
+long random(long min, long max);
+
+class HardwareSerial {
+public:
+  virtual ~HardwareSerial() {}
+
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+  virtual size_t write(uint8_t) { return 1; }
+
+  size_t write(const uint8_t *buf, size_t len) {
+    for (size_t i = 0; i < len; i++)
+      write(buf[i]);
+    return len;
+  }
+  size_t write(const char *buf, size_t len) { return write((const uint8_t *)buf, len); }
+  size_t print(const char *str) { return write(str, strlen(str)); }
+  size_t println(const char *str) { return print(str) + print("\r\n"); }
+  int printf(const char *fmt, ...) {
+    va_list ap;
+
+    // The debug output of the library is only shown on request.
+    if (!getenv("TEST_VERBOSE"))
+      return 0;
+
+    va_start(ap, fmt);
+    int n = vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+  }
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial2;
+
+#define ESP_SERIAL_PORT   Serial2
+
+#endif
@@ -0,0 +1,164 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_FAKE_ESP_
+#define _H_FAKE_ESP_
+
+/*
+ * A fake ESP-AT device for the host tests. It answers +MQTTCONN, +MQTTPUBRAW
+ * and queries, replies +MQTTPUB:OK or FAIL to each raw message in the order
+ * the messages were sent and after a latency chosen per message, and lets a
+ * test inject URCs as if they came from the broker. A test can also give
+ * the reply to a command, to play a device that stops half way.
+ */
+
+#include <Arduino.h>
+#include <string.h>
+#include <string>
+#include <deque>
+#include <map>
+
+#define REPLY_LATENCY   20
+
+struct plan_t {
+  unsigned long latency;    /* Time from the data to the reply */
+  const char *replies;      /* One 'O' (OK) or 'F' (FAIL) per transmission */
+};
+
+class FakeEsp : public HardwareSerial {
+public:
+  std::map<std::string, plan_t> plans;
+  std::map<std::string, int> sent;     /* Transmissions per message */
+  std::map<std::string, std::string> answers; /* Replies to commands starting with the key */
+  unsigned long answerLatency = 0;      /* Time from a command to its given reply */
+  int commands = 0;
+
+  int available() {
+    release();
+    return rx.size();
+  }
+
+  int read() {
+    release();
+    if (rx.empty())
+      return -1;
+    int ch = (uint8_t)rx[0];
+    rx.erase(0, 1);
+    return ch;
+  }
+
+  /* Queues text from the device, as if a URC had arrived */
+  void urc(const std::string &text) {
+    rx += text;
+  }
+
+  size_t write(uint8_t ch) {
+    if (rawLeft) {
+      data += (char)ch;
+      if (!--rawLeft)
+        received();
+      return 1;
+    }
+    line += (char)ch;
+    if (ch == '\n')
+      command();
+    return 1;
+  }
+
+private:
+  struct reply_t {
+    unsigned long at;
+    std::string text;
+  };
+
+  std::string rx;
+  std::string line;
+  std::string data;
+  size_t rawLeft = 0;
+  std::deque<reply_t> replies;
+  unsigned long lastReply = 0;
+
+  void command() {
+    unsigned int len;
+
+    commands++;
+    for (auto &a : answers) {
+      if (line.find(a.first) == 0) {
+        reply(millis() + answerLatency, a.second);
+        line.clear();
+        return;
+      }
+    }
+    if (line.find("AT+MQTTCONN=") == 0) {
+      rx += "+MQTTCONNECTED:0,1,\"broker\",\"1883\",\"\",1\r\nOK\r\n";
+    } else if (sscanf(line.c_str(), "AT+MQTTPUBRAW=%*d,\"%*[^\"]\",%u", &len) == 1) {
+      rx += "OK\r\n>";
+      rawLeft = len;
+      data.clear();
+    } else if (line.find("?\r\n") != std::string::npos) {
+      // A query, like the SYSLOG probe of begin(), answered with a 1.
+      rx += line.substr(2, line.find('?') - 2) + ":1\r\nOK\r\n";
+    } else {
+      rx += "OK\r\n";
+    }
+    line.clear();
+  }
+
+  void received() {
+    plan_t p = { REPLY_LATENCY, "O" };
+    if (plans.count(data))
+      p = plans[data];
+    int n = sent[data]++;
+    char outcome = p.replies[n < (int)strlen(p.replies) ? n : strlen(p.replies) - 1];
+
+    reply(millis() + p.latency, outcome == 'O' ? "+MQTTPUB:OK\r\n" : "+MQTTPUB:FAIL\r\n");
+  }
+
+  void reply(unsigned long at, const std::string &text) {
+    // The replies come in the order they were given.
+    if (at < lastReply)
+      at = lastReply;
+    lastReply = at;
+    replies.push_back({ at, text });
+  }
+
+  void release() {
+    while (!replies.empty() && (long)(millis() - replies.front().at) >= 0) {
+      rx += replies.front().text;
+      replies.pop_front();
+    }
+  }
+};
+
+#endif
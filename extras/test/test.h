@@ -0,0 +1,56 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_MQTT_TEST_
+#define _H_MQTT_TEST_
+
+#include <stdio.h>
+
+/*
+ * Minimal check macros for the host tests. A failed check is reported with
+ * its location and the test continues, main() returns TEST_RESULT().
+ */
+static int testFailures = 0;
+
+#define CHECK(x) do { \
+    if (!(x)) { \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #x); \
+      testFailures++; \
+    } \
+  } while (0)
+
+#define TEST_RESULT() \
+  (printf("%s: %s\n", __FILE__, testFailures ? "FAILED" : "ok"), testFailures != 0)
+
+#endif
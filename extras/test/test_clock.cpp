@@ -0,0 +1,98 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+
+/*
+ * Host test of the drift estimate of MqttClock. The NTP time only has a
+ * resolution of one second, so a short measurement must not be used, and a
+ * long one must find the drift of the oscillator within a few ppm.
+ */
+
+#include <MqttClock.h>
+#include "test.h"
+
+#define NTP_START       1700000000123ULL  /* True time (ms) of the first sync */
+#define HOUR            3600000
+
+/* Syncs a clock about every hour for the given number of hours, millis()
+   running slow by ppm parts per million. Each sync lands somewhere else
+   within the second, like the replies of the ESP-AT device do. */
+static void run(MqttClock *clock, int32_t ppm, uint32_t hours) {
+  uint32_t seed = 12345;
+
+  for (uint64_t h = 0; h <= hours; h++) {
+    seed = seed * 1103515245 + 12345;
+    uint64_t t = h * HOUR + (seed >> 16) % 1000;
+    uint32_t now = (uint32_t)(t - (int64_t)t * ppm / 1000000);
+
+    clock->sync((uint32_t)((NTP_START + t) / 1000), now);
+  }
+}
+
+static void testShort() {
+  MqttClock clock;
+
+  // A second of rounding over a few hours is hundreds of ppm, not used.
+  run(&clock, 0, 5);
+  CHECK(clock.drift() == 0);
+  CHECK(clock.syncCount() == 6);
+}
+
+static void testDrift() {
+  MqttClock slow;
+  MqttClock fast;
+  MqttClock wild;
+
+  run(&slow, 50, 48);
+  CHECK(slow.drift() >= 40 && slow.drift() <= 60);
+  run(&fast, -120, 48);
+  CHECK(fast.drift() >= -130 && fast.drift() <= -110);
+
+  // No more than a real oscillator can be off is corrected.
+  run(&wild, 5000, 48);
+  CHECK(wild.drift() == MQTT_CLOCK_MAX_DRIFT);
+}
+
+static void testHorizon() {
+  MqttClock clock;
+
+  // Three weeks in, the estimate is still stable and within the window.
+  run(&clock, 30, 21 * 24);
+  CHECK(clock.drift() >= 25 && clock.drift() <= 35);
+}
+
+int main() {
+  testShort();
+  testDrift();
+  testHorizon();
+  return TEST_RESULT();
+}
@@ -0,0 +1,149 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Host test of the in-flight window of raw publishes. A fake ESP-AT device
+ * answers +MQTTPUBRAW and replies +MQTTPUB:OK or FAIL to each message, in
+ * the order the messages were sent and after a latency chosen per message.
+ * The test checks that every publish handle ends with the reply to its own
+ * message, also when the window is full, when a message is resent and when
+ * a reply arrives after its message has timed out.
+ */
+
+#include <Arduino.h>
+#include <EspATMQTT.h>
+#include "fake_esp.h"
+#include "test.h"
+
+static const mqtt_status_t FAILED = ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_FAILED_TO_PUBLISH_RAW;
+
+static void connect(EspATMQTT *mqtt) {
+  CHECK(mqtt->begin() == ESP_AT_SUB_OK);
+  CHECK(mqtt->connect(0, "broker") == ESP_AT_SUB_CMD_CONN_SYNCH);
+  CHECK(mqtt->isConnected(0));
+}
+
+/* Runs process() until the handle has completed, returns its status */
+static mqtt_status_t finish(EspATMQTT *mqtt, mqtt_pub_handle_t h) {
+  mqtt_status_t status = ESP_AT_SUB_OK;
+
+  for (int i = 0; i < 200000 && !mqtt->publishDone(h, &status); i++)
+    mqtt->process();
+  CHECK(mqtt->publishDone(h, &status));
+  mqtt->releasePublish(h);
+  return status;
+}
+
+static void testFullWindow() {
+  static uint8_t arena[1024];
+  FakeEsp esp;
+  EspATMQTT mqtt(&esp);
+  mqtt_pub_handle_t h[8];
+  char msg[8];
+
+  connect(&mqtt);
+  CHECK(mqtt.enableInflight(arena, sizeof(arena), 4, 3) == ESP_AT_SUB_OK);
+
+  esp.plans["m2"] = { REPLY_LATENCY, "FO" };    // Fails once, then resent
+  esp.plans["m5"] = { REPLY_LATENCY, "F" };     // QoS 0, never resent
+  esp.plans["m6"] = { REPLY_LATENCY, "FFFF" };  // Runs out of retries
+
+  // Twice the window, the publishes beyond the window wait for replies.
+  for (int i = 0; i < 8; i++) {
+    snprintf(msg, sizeof(msg), "m%d", i);
+    h[i] = mqtt.publishAsync(0, "test/inflight", msg, i == 5 ? 0 : 1);
+    CHECK(h[i] != MQTT_PUB_HANDLE_NONE);
+    CHECK(mqtt.inflightPublishes() <= 4);
+  }
+  for (int i = 0; i < 8; i++) {
+    mqtt_status_t status = finish(&mqtt, h[i]);
+    CHECK(status == ((i == 5 || i == 6) ? FAILED : (mqtt_status_t)ESP_AT_SUB_OK));
+  }
+  CHECK(esp.sent["m2"] == 2);
+  CHECK(esp.sent["m5"] == 1);
+  CHECK(esp.sent["m6"] == 4);
+  CHECK(mqtt.getPublishStats()->retryCount == 4);
+  CHECK(mqtt.inflightPublishes() == 0);
+}
+
+static void testLateReply() {
+  static uint8_t arena[1024];
+  FakeEsp esp;
+  EspATMQTT mqtt(&esp);
+
+  connect(&mqtt);
+  CHECK(mqtt.enableInflight(arena, sizeof(arena), 4, 0) == ESP_AT_SUB_OK);
+  mqtt.setPublishTimeout(1000);
+
+  // The OK to "slow" arrives after it has timed out, ahead of the FAIL to
+  // "next". It must not be taken as the reply to "next".
+  esp.plans["slow"] = { 1500, "O" };
+  esp.plans["next"] = { REPLY_LATENCY, "F" };
+
+  mqtt_pub_handle_t slow = mqtt.publishAsync(0, "test/inflight", "slow", 0);
+  CHECK(finish(&mqtt, slow) == ESP_AT_SUB_CMD_TIMEOUT);
+  mqtt_pub_handle_t next = mqtt.publishAsync(0, "test/inflight", "next", 0);
+  CHECK(finish(&mqtt, next) == FAILED);
+}
+
+static void testSmallArena() {
+  static uint8_t arena[40];
+  FakeEsp esp;
+  EspATMQTT mqtt(&esp);
+  char big[80];
+
+  connect(&mqtt);
+  CHECK(mqtt.enableInflight(arena, sizeof(arena), 4, 1) == ESP_AT_SUB_OK);
+
+  // Room for one retained message at a time, the second one waits.
+  mqtt_pub_handle_t a = mqtt.publishAsync(0, "t", "first message", 1);
+  mqtt_pub_handle_t b = mqtt.publishAsync(0, "t", "second message", 1);
+  CHECK(mqtt.publishDone(a));
+  CHECK(!mqtt.publishDone(b));
+  CHECK(finish(&mqtt, a) == ESP_AT_SUB_OK);
+  CHECK(finish(&mqtt, b) == ESP_AT_SUB_OK);
+
+  // A message that can never be tracked is not sent at all.
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+  int before = esp.commands;
+  mqtt_pub_handle_t c = mqtt.publishAsync(0, "t", big, 1);
+  CHECK(finish(&mqtt, c) == ESP_AT_SUB_CMD_WINDOW_FULL);
+  CHECK(esp.commands == before);
+}
+
+int main() {
+  testFullWindow();
+  testLateReply();
+  testSmallArena();
+  return TEST_RESULT();
+}
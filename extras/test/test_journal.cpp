@@ -0,0 +1,250 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Host test of MqttJournal on a MqttFileStorage: wrap-around of the sector
+ * ring, a message torn by a power cut in the middle of a write and a message
+ * with a bad CRC. A reboot is simulated by closing the storage and attaching
+ * a new journal to it.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <MqttJournal.h>
+#include <MqttStorage.h>
+#include "test.h"
+
+#define JOURNAL_FILE    "test_journal.bin"
+#define SECTOR_SIZE     256
+#define SECTORS         4
+
+static uint8_t work[2 * SECTOR_SIZE];
+
+static bool append(MqttJournal *j, int n) {
+  char msg[32];
+  mqtt_pub_record_t rec = { 0, 0, 0, 1, 0, 0 };
+
+  snprintf(msg, sizeof(msg), "message-%05d", n);
+  mqtt_buffer_t seg = { (const uint8_t *)msg, strlen(msg) };
+  return j->append(&rec, "test/journal", &seg, 1);
+}
+
+/* Returns the number of the oldest message, -1 if the journal is empty */
+static int head(MqttJournal *j) {
+  mqtt_pub_record_t rec;
+  const char *topic;
+  const uint8_t *data;
+
+  if (!j->peek(&rec, &topic, &data))
+    return -1;
+  CHECK(!strcmp(topic, "test/journal"));
+  CHECK(rec.dataLen == 13 && !memcmp(data, "message-", 8));
+  return atoi((const char *)data + 8);
+}
+
+static void reboot(MqttFileStorage *st, MqttJournal *j) {
+  j->sync();
+  st->end();
+  CHECK(st->begin());
+  *j = MqttJournal();
+  CHECK(j->begin(st, work, sizeof(work)));
+}
+
+/* Overwrites the bytes of a stored message, found by its text */
+static void patch(MqttFileStorage *st, int n, size_t from, uint8_t value, size_t len) {
+  static uint8_t image[SECTORS * SECTOR_SIZE];
+  char msg[32];
+
+  snprintf(msg, sizeof(msg), "message-%05d", n);
+  CHECK(st->read(0, image, sizeof(image)));
+  st->end();
+  for (size_t i = 0; i + strlen(msg) <= sizeof(image); i++) {
+    if (!memcmp(&image[i], msg, strlen(msg))) {
+      FILE *fp = fopen(JOURNAL_FILE, "r+b");
+      CHECK(fp != NULL);
+      fseek(fp, i + from, SEEK_SET);
+      while (len--)
+        fputc(value, fp);
+      fclose(fp);
+      break;
+    }
+  }
+  CHECK(st->begin());
+}
+
+static void testWrapAround() {
+  MqttFileStorage st(JOURNAL_FILE, SECTORS * SECTOR_SIZE, SECTOR_SIZE);
+  MqttJournal j;
+  int next = 0, expect = 0;
+
+  remove(JOURNAL_FILE);
+  CHECK(st.begin());
+  CHECK(j.begin(&st, work, sizeof(work)));
+
+  // Runs through the sector ring many times with a backlog of messages,
+  // rebooting now and then.
+  for (int i = 0; i < 6; i++)
+    CHECK(append(&j, next++));
+  for (int round = 0; round < 60; round++) {
+    for (int i = 0; i < 4; i++)
+      CHECK(append(&j, next++));
+    for (int i = 0; i < 4; i++) {
+      CHECK(head(&j) == expect);
+      CHECK(j.pop());
+      expect++;
+    }
+    if (round % 5 == 2)
+      reboot(&st, &j);
+    CHECK(j.pending() == (uint32_t)(next - expect));
+  }
+  while (head(&j) >= 0) {
+    CHECK(head(&j) == expect);
+    j.pop();
+    expect++;
+  }
+  CHECK(expect == next);
+  CHECK(j.dropped() == 0);
+
+  // A full journal drops the newest message by default.
+  while (append(&j, next))
+    next++;
+  CHECK(j.dropped() == 1);
+  CHECK(j.pending() == (uint32_t)(next - expect));
+  st.end();
+}
+
+static void testPowerCut() {
+  MqttFileStorage st(JOURNAL_FILE, SECTORS * SECTOR_SIZE, SECTOR_SIZE);
+  MqttJournal j;
+
+  remove(JOURNAL_FILE);
+  CHECK(st.begin());
+  CHECK(j.begin(&st, work, sizeof(work)));
+  for (int i = 0; i < 5; i++)
+    CHECK(append(&j, i));
+  j.sync();
+
+  // The power is lost while the last message is written, its tail is
+  // still erased.
+  patch(&st, 4, 6, 0xff, 7);
+  j = MqttJournal();
+  CHECK(j.begin(&st, work, sizeof(work)));
+  CHECK(j.pending() == 4);
+  CHECK(j.dropped() == 1);
+
+  // New messages are not written behind the torn one.
+  CHECK(append(&j, 5));
+  reboot(&st, &j);
+  CHECK(j.pending() == 5);
+  CHECK(j.dropped() == 0);
+  static const int survivors[] = { 0, 1, 2, 3, 5 };
+  for (size_t i = 0; i < sizeof(survivors) / sizeof(survivors[0]); i++) {
+    CHECK(head(&j) == survivors[i]);
+    j.pop();
+  }
+  CHECK(head(&j) == -1);
+  st.end();
+}
+
+static void testBadCrc() {
+  MqttFileStorage st(JOURNAL_FILE, SECTORS * SECTOR_SIZE, SECTOR_SIZE);
+  MqttJournal j;
+
+  remove(JOURNAL_FILE);
+  CHECK(st.begin());
+  CHECK(j.begin(&st, work, sizeof(work)));
+  for (int i = 0; i < 6; i++)
+    CHECK(append(&j, i));
+  j.sync();
+
+  // A bit flip in the middle of the sector. Recovery skips the message and
+  // keeps the ones after it, as peek() does at run time.
+  patch(&st, 2, 12, 'X', 1);
+  j = MqttJournal();
+  CHECK(j.begin(&st, work, sizeof(work)));
+  CHECK(j.pending() == 5);
+  CHECK(j.dropped() == 1);
+
+  // The damaged message stays retired after another reboot.
+  reboot(&st, &j);
+  CHECK(j.pending() == 5);
+  CHECK(j.dropped() == 0);
+  static const int survivors[] = { 0, 1, 3, 4, 5 };
+  for (size_t i = 0; i < sizeof(survivors) / sizeof(survivors[0]); i++) {
+    CHECK(head(&j) == survivors[i]);
+    j.pop();
+  }
+  CHECK(j.isEmpty());
+
+  // The same damage found at run time, in a sector that is no longer being
+  // written, is skipped by peek().
+  for (int i = 6; i < 11; i++)
+    CHECK(append(&j, i));
+  j.sync();
+  patch(&st, 7, 12, 'X', 1);
+  CHECK(head(&j) == 6);
+  j.pop();
+  CHECK(head(&j) == 8);
+  CHECK(j.dropped() == 1);
+  CHECK(j.pending() == 3);
+  reboot(&st, &j);
+  CHECK(j.pending() == 3);
+  CHECK(head(&j) == 8);
+  st.end();
+}
+
+static void testReplayCredit() {
+  MqttFileStorage st(JOURNAL_FILE, SECTORS * SECTOR_SIZE, SECTOR_SIZE);
+  MqttJournal j;
+
+  remove(JOURNAL_FILE);
+  CHECK(st.begin());
+  CHECK(j.begin(&st, work, sizeof(work)));
+  j.setReplayRate(1000);
+
+  // Credit is only withdrawn for messages that were sent.
+  CHECK(j.replayCredit(100, 100));
+  CHECK(j.replayCredit(100, 100));
+  j.replayed(100);
+  CHECK(!j.replayCredit(100, 100));
+  CHECK(j.replayCredit(100, 200));
+  st.end();
+}
+
+int main() {
+  testWrapAround();
+  testPowerCut();
+  testBadCrc();
+  testReplayCredit();
+  remove(JOURNAL_FILE);
+  return TEST_RESULT();
+}
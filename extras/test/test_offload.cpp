@@ -0,0 +1,189 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Host test of the offload mode. The command and event queues are raced
+ * between two threads, the way the application and the engine run on two
+ * cores, and MqttOffload is driven against the fake ESP-AT device to check
+ * the status codes of the application side and the events it gets back.
+ */
+
+#include <Arduino.h>
+#include <EspATMQTT.h>
+#include <MqttOffload.h>
+#include <thread>
+#include "fake_esp.h"
+#include "test.h"
+
+#define STRESS_MESSAGES   100000
+
+static void testQueueFull() {
+  static MqttOffloadQueue q;
+
+  CHECK(q.front() == NULL);
+  for (int i = 0; i < MQTT_OFFLOAD_SLOTS; i++) {
+    mqtt_offload_msg_t *m = q.reserve();
+    CHECK(m != NULL);
+    if (!m)
+      return;
+    m->tag = i;
+    q.commit();
+  }
+  CHECK(q.count() == MQTT_OFFLOAD_SLOTS);
+  CHECK(q.reserve() == NULL);
+  CHECK(q.drops() == 1);
+
+  for (int i = 0; i < MQTT_OFFLOAD_SLOTS; i++) {
+    CHECK(q.front() && q.front()->tag == (uint32_t)i);
+    q.pop();
+  }
+  CHECK(q.front() == NULL && q.count() == 0);
+}
+
+static void testQueueThreads() {
+  static MqttOffloadQueue q;
+  uint32_t got = 0, bad = 0;
+
+  // Each message is filled in place in its slot, so the consumer must
+  // never see a slot before the producer has committed all of it.
+  std::thread producer([] {
+    for (uint32_t i = 0; i < STRESS_MESSAGES; i++) {
+      mqtt_offload_msg_t *m;
+      while ((m = q.reserve()) == NULL)
+        std::this_thread::yield();
+      m->tag = i;
+      m->dataLen = i % MQTT_OFFLOAD_DATA_SIZE;
+      memset(m->data, (uint8_t)i, m->dataLen);
+      q.commit();
+    }
+  });
+
+  while (got < STRESS_MESSAGES) {
+    mqtt_offload_msg_t *m = q.front();
+    if (!m) {
+      std::this_thread::yield();
+      continue;
+    }
+    if (m->tag != got || m->dataLen != got % MQTT_OFFLOAD_DATA_SIZE)
+      bad++;
+    for (int i = 0; i < m->dataLen; i++) {
+      if (m->data[i] != (uint8_t)got) {
+        bad++;
+        break;
+      }
+    }
+    q.pop();
+    got++;
+  }
+  producer.join();
+
+  CHECK(bad == 0);
+  CHECK(q.count() == 0);
+}
+
+static void testPost() {
+  FakeEsp esp;
+  EspATMQTT mqtt(&esp);
+  MqttOffload off(&mqtt);
+  char topic[MQTT_OFFLOAD_TOPIC_SIZE + 1];
+  static uint8_t data[MQTT_OFFLOAD_DATA_SIZE + 1];
+
+  memset(topic, 't', sizeof(topic) - 1);
+  topic[sizeof(topic) - 1] = '\0';
+
+  // Errors carry ESP_AT_SUB_CMD_PROCESSING like the rest of the library.
+  CHECK(off.publish(MQTT_MAX_LINKS, "t", "x") ==
+        (ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_LINK_ID_VALUE_IS_WRONG));
+  CHECK(off.publish(0, topic, "x") ==
+        (ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_TOPIC_IS_OVERLENGTH));
+  CHECK(off.publish(0, "t", data, sizeof(data)) ==
+        (ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_DATA_IS_OVERLENGTH));
+  CHECK(MQTT_ERROR(off.subscribe(0, topic)) == AT_MQTT_TOPIC_IS_OVERLENGTH);
+
+  for (int i = 0; i < MQTT_OFFLOAD_SLOTS; i++)
+    CHECK(off.publish(0, "t", data, sizeof(data) - 1) == ESP_AT_SUB_CMD_QUEUED);
+  CHECK(off.publish(0, "t", "x") == ESP_AT_SUB_CMD_QUEUE_FULL);
+  CHECK(esp.commands == 0);
+}
+
+/* Runs the engine until an event is waiting, returns it */
+static const mqtt_offload_msg_t *nextEvent(MqttOffload *off) {
+  for (int i = 0; i < 1000 && !off->getEvent(); i++)
+    off->service();
+  return off->getEvent();
+}
+
+static void testService() {
+  FakeEsp esp;
+  EspATMQTT mqtt(&esp);
+  MqttOffload off(&mqtt);
+  const mqtt_offload_msg_t *ev;
+
+  CHECK(mqtt.begin() == ESP_AT_SUB_OK);
+  CHECK(mqtt.connect(0, "broker") == ESP_AT_SUB_CMD_CONN_SYNCH);
+
+  ev = nextEvent(&off);
+  CHECK(ev && ev->type == MQTT_OFFLOAD_STATE && ev->linkID == 0 &&
+        ev->status == MQTT_STATE_CONNECTED);
+  off.releaseEvent();
+
+  CHECK(off.publish(0, "test/offload", "hello", 1, 0, 42) == ESP_AT_SUB_CMD_QUEUED);
+  ev = nextEvent(&off);
+  CHECK(ev && ev->type == MQTT_OFFLOAD_RESULT && ev->tag == 42 &&
+        ev->status == ESP_AT_SUB_OK && !strcmp(ev->topic, "test/offload"));
+  off.releaseEvent();
+
+  CHECK(off.subscribe(0, "test/cmd", 1, 7) == ESP_AT_SUB_CMD_QUEUED);
+  ev = nextEvent(&off);
+  CHECK(ev && ev->type == MQTT_OFFLOAD_RESULT && ev->tag == 7 &&
+        ev->status == ESP_AT_SUB_OK);
+  off.releaseEvent();
+
+  esp.urc("+MQTTSUBRECV:0,\"test/cmd\",4,ping\r\n");
+  ev = nextEvent(&off);
+  CHECK(ev && ev->type == MQTT_OFFLOAD_MESSAGE && ev->dataLen == 4 &&
+        !memcmp(ev->data, "ping", 4) && !strcmp(ev->topic, "test/cmd"));
+  off.releaseEvent();
+
+  // A publish without a tag gives no event.
+  CHECK(off.publish(0, "test/offload", "quiet") == ESP_AT_SUB_CMD_QUEUED);
+  CHECK(nextEvent(&off) == NULL);
+  CHECK(off.droppedEvents() == 0);
+}
+
+int main() {
+  testQueueFull();
+  testQueueThreads();
+  testPost();
+  testService();
+  return TEST_RESULT();
+}
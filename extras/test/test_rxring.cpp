@@ -0,0 +1,140 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Host test of AtRxRing: filling the ring to the brim, overflow accounting,
+ * wrap-around of block puts and a producer thread racing the consumer, the
+ * way a UART interrupt or the second core fills it on the target.
+ */
+
+#include <string.h>
+#include <thread>
+#include <AtRxRing.h>
+#include "test.h"
+
+#define STRESS_BYTES    1000000
+
+static void testFull() {
+  static AtRxRing ring;
+  size_t cap = ring.capacity();
+
+  CHECK(ring.get() == -1);
+  for (size_t i = 0; i < cap; i++)
+    CHECK(ring.put((uint8_t)i));
+  CHECK(ring.available() == cap);
+  CHECK(!ring.put(0xaa));
+  CHECK(ring.overflows() == 1);
+  CHECK(ring.highWater() == cap);
+
+  for (size_t i = 0; i < cap; i++)
+    CHECK(ring.get() == (int)(uint8_t)i);
+  CHECK(ring.get() == -1);
+  CHECK(ring.available() == 0);
+
+  ring.resetStats();
+  CHECK(ring.overflows() == 0 && ring.highWater() == 0);
+}
+
+static void testBlockWrap() {
+  static AtRxRing ring;
+  static uint8_t block[AT_RX_RING_SIZE + 100];
+  size_t cap = ring.capacity();
+
+  for (size_t i = 0; i < sizeof(block); i++)
+    block[i] = (uint8_t)(i * 7);
+
+  // Leave the indexes in the middle so the next block wraps.
+  CHECK(ring.put(block, 100) == 100);
+  for (int i = 0; i < 60; i++)
+    ring.get();
+
+  // Only what fits is stored, the rest is counted as overflow.
+  CHECK(ring.put(block, sizeof(block)) == cap - 40);
+  CHECK(ring.overflows() == sizeof(block) - (cap - 40));
+  CHECK(ring.highWater() == cap);
+
+  for (int i = 60; i < 100; i++)
+    CHECK(ring.get() == block[i]);
+  for (size_t i = 0; i < cap - 40; i++)
+    CHECK(ring.get() == block[i]);
+  CHECK(ring.get() == -1);
+}
+
+static void testThreads() {
+  static AtRxRing ring;
+  uint32_t got = 0, bad = 0;
+
+  // The producer mixes single bytes and blocks and retries what did not
+  // fit, so every byte must come out once and in order.
+  std::thread producer([] {
+    uint8_t block[37];
+    uint32_t sent = 0;
+
+    while (sent < STRESS_BYTES) {
+      if (sent % 3) {
+        if (ring.put((uint8_t)(sent * 13)))
+          sent++;
+        else
+          std::this_thread::yield();
+      } else {
+        size_t len = STRESS_BYTES - sent < sizeof(block) ?
+                     STRESS_BYTES - sent : sizeof(block);
+        for (size_t i = 0; i < len; i++)
+          block[i] = (uint8_t)((sent + i) * 13);
+        sent += ring.put(block, len);
+      }
+    }
+  });
+
+  while (got < STRESS_BYTES) {
+    int ch = ring.get();
+    if (ch < 0) {
+      std::this_thread::yield();
+      continue;
+    }
+    if (ch != (uint8_t)(got * 13))
+      bad++;
+    got++;
+  }
+  producer.join();
+
+  CHECK(bad == 0);
+  CHECK(ring.get() == -1);
+  CHECK(ring.highWater() <= ring.capacity());
+}
+
+int main() {
+  testFull();
+  testBlockWrap();
+  testThreads();
+  return TEST_RESULT();
+}
@@ -0,0 +1,199 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Host test of the coroutine layer. Tasks wait on conditions the test
+ * controls, so the order in which the executor resumes them, the deadlines
+ * and the ownership of the coroutine frames can be checked exactly. A last
+ * flow runs connect and publish through MqttCoro against the fake ESP-AT
+ * device. Needs a compiler with C++20 coroutine support.
+ */
+
+#include <Arduino.h>
+#include <EspATMQTT.h>
+#include <MqttCoro.h>
+#include "fake_esp.h"
+#include "test.h"
+
+#ifdef MQTT_HAS_COROUTINES
+
+#define TIMED_OUT       99
+
+static uint32_t flags[MQTT_TASK_MAX_TASKS + 1];
+static uint32_t results[MQTT_TASK_MAX_TASKS + 1];
+static int steps[MQTT_TASK_MAX_TASKS + 1];
+static int frames;
+
+/* Counts the coroutine frames that are alive */
+struct Frame {
+  Frame() { frames++; }
+  ~Frame() { frames--; }
+};
+
+/* Completes when the flag of the task is set, or with TIMED_OUT */
+static bool flagSet(MqttWait *wait, bool expired) {
+  if (flags[wait->arg]) {
+    wait->status = flags[wait->arg];
+    return true;
+  }
+  if (expired) {
+    wait->status = TIMED_OUT;
+    return true;
+  }
+  return false;
+}
+
+static MqttTask flow(MqttExecutor *exec, uint32_t id, uint32_t timeout) {
+  Frame frame;
+
+  steps[id]++;
+  results[id] = co_await MqttWait(exec, flagSet, NULL, id, timeout, exec->now());
+  steps[id]++;
+  // A complete operation does not suspend the task.
+  results[id] += co_await MqttWait(1000);
+  steps[id]++;
+}
+
+static void reset() {
+  memset(flags, 0, sizeof(flags));
+  memset(results, 0, sizeof(results));
+  memset(steps, 0, sizeof(steps));
+}
+
+static void testResume() {
+  MqttExecutor exec;
+
+  reset();
+  exec.run(0);
+  for (uint32_t i = 0; i < 3; i++)
+    CHECK(exec.spawn(flow(&exec, i, 100)));
+  // Each task runs until it has to wait.
+  CHECK(exec.tasks() == 3);
+  CHECK(steps[0] == 1 && steps[1] == 1 && steps[2] == 1);
+
+  exec.run(10);
+  CHECK(exec.tasks() == 3 && steps[1] == 1);
+
+  flags[1] = 5;
+  exec.run(20);
+  CHECK(steps[0] == 1 && steps[1] == 3 && steps[2] == 1);
+  CHECK(results[1] == 1005);
+  CHECK(exec.tasks() == 2);
+  CHECK(frames == 2);
+
+  // The others are told that their deadline, at 100, has passed.
+  exec.run(99);
+  CHECK(exec.tasks() == 2);
+  exec.run(100);
+  CHECK(exec.tasks() == 0);
+  CHECK(results[0] == TIMED_OUT + 1000 && results[2] == TIMED_OUT + 1000);
+  CHECK(frames == 0);
+}
+
+static void testFull() {
+  reset();
+  {
+    MqttExecutor exec;
+
+    for (uint32_t i = 0; i < MQTT_TASK_MAX_TASKS; i++)
+      CHECK(exec.spawn(flow(&exec, i, 1000)));
+    CHECK(exec.tasks() == MQTT_TASK_MAX_TASKS);
+    CHECK(frames == MQTT_TASK_MAX_TASKS);
+
+    // No room, the task never runs and its frame is destroyed.
+    CHECK(!exec.spawn(flow(&exec, MQTT_TASK_MAX_TASKS, 1000)));
+    CHECK(steps[MQTT_TASK_MAX_TASKS] == 0);
+    CHECK(frames == MQTT_TASK_MAX_TASKS);
+
+    // A task that never has to wait is done when spawn() returns.
+    flags[0] = 1;
+    exec.run(1);
+    CHECK(exec.tasks() == MQTT_TASK_MAX_TASKS - 1);
+    flags[MQTT_TASK_MAX_TASKS] = 1;
+    CHECK(exec.spawn(flow(&exec, MQTT_TASK_MAX_TASKS, 1000)));
+    CHECK(steps[MQTT_TASK_MAX_TASKS] == 3);
+    CHECK(exec.tasks() == MQTT_TASK_MAX_TASKS - 1);
+  }
+  // The executor destroys the tasks that are still waiting.
+  CHECK(frames == 0);
+}
+
+static uint32_t connStatus, pubStatus;
+static bool flowDone;
+
+static MqttTask publishFlow(MqttCoro *coro) {
+  connStatus = co_await coro->connect(0, "broker");
+  pubStatus = co_await coro->publish(0, "test/coro", "hello", 1);
+  flowDone = true;
+}
+
+static void testCoro() {
+  static uint8_t arena[256];
+  FakeEsp esp;
+  EspATMQTT mqtt(&esp);
+  MqttCoro coro(&mqtt);
+
+  CHECK(mqtt.begin() == ESP_AT_SUB_OK);
+  CHECK(mqtt.enableInflight(arena, sizeof(arena), 2, 0) == ESP_AT_SUB_OK);
+
+  // Spawned long after start up, before the executor has ever run, the
+  // publish wait must still get its whole timeout.
+  delay(2 * MQTT_PUB_TIMEOUT);
+
+  connStatus = pubStatus = ESP_AT_SUB_CMD_ERROR;
+  CHECK(coro.spawn(publishFlow(&coro)));
+  // The task is parked until +MQTTPUB:OK comes after REPLY_LATENCY.
+  CHECK(!flowDone && coro.executor().tasks() == 1);
+
+  for (int i = 0; i < 10000 && coro.executor().tasks(); i++)
+    coro.process();
+  CHECK(flowDone);
+  CHECK(connStatus == ESP_AT_SUB_OK);
+  CHECK(pubStatus == ESP_AT_SUB_OK);
+  CHECK(esp.sent["hello"] == 1);
+}
+
+int main() {
+  testResume();
+  testFull();
+  testCoro();
+  return TEST_RESULT();
+}
+
+#else
+
+int main() {
+  printf("%s: skipped, no C++20 coroutine support\n", __FILE__);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Host test of the URC parser of EspATMQTT. Messages with binary data, URCs
+ * that do not fit in the buffer, URCs cut short by the ESP-AT device and
+ * URCs that arrive while a deadline is installed, also one that has passed,
+ * must neither overrun the buffer nor lose the messages that follow. A
+ * device that goes silent half way through a reply must not hold a wait
+ * past its timeout or deadline, nor can a device that is starting up hold
+ * begin() past its deadline. The duplicate filter must only drop a
+ * repeated payload within its max age.
+ */
+
+#include <Arduino.h>
+#include <EspATMQTT.h>
+#include <MqttDedup.h>
+#include <string>
+#include "fake_esp.h"
+#include "test.h"
+
+static int received;
+static std::string lastTopic;
+static std::string lastData;
+
+static void onMessage(void *ctx, uint32_t linkID, char *topic, size_t topicLen,
+                      char *data, size_t dataLen) {
+  (void)ctx;
+  (void)linkID;
+  received++;
+  lastTopic.assign(topic, topicLen);
+  lastData.assign(data, dataLen);
+}
+
+static void subscribe(EspATMQTT *mqtt) {
+  CHECK(mqtt->begin() == ESP_AT_SUB_OK);
+  CHECK(mqtt->connect(0, "broker") == ESP_AT_SUB_CMD_CONN_SYNCH);
+  CHECK(mqtt->subscribeTopic(mqttMessageHandler(onMessage, NULL), 0,
+                             "test/urc") == ESP_AT_SUB_OK);
+  received = 0;
+}
+
+/* Runs process() until nothing is left from the device */
+static void drain(FakeEsp *esp, EspATMQTT *mqtt) {
+  for (int i = 0; i < 10000 && esp->available(); i++)
+    mqtt->process();
+  mqtt->process();
+}
+
+static std::string subrecv(const std::string &data) {
+  return "+MQTTSUBRECV:0,\"test/urc\"," + std::to_string(data.size()) + "," + data;
+}
+
+static void testBinary() {
+  FakeEsp esp;
+  EspATMQTT mqtt(&esp);
+  std::string data("a\xff\xff,b\r\n\xff", 8);
+
+  subscribe(&mqtt);
+  esp.urc(subrecv(data));
+  drain(&esp, &mqtt);
+  CHECK(received == 1);
+  CHECK(lastTopic == "test/urc");
+  CHECK(lastData == data);
+}
+
+static void testTooLong() {
+  FakeEsp esp;
+  EspATMQTT mqtt(&esp);
+  std::string line = "+MQTTSOMETHING:" + std::string(3 * MQTT_BUFFER_SIZE, 'x') + "\r\n";
+  std::string big(2 * MQTT_BUFFER_SIZE, '+');
+
+  subscribe(&mqtt);
+  esp.urc(line);
+  esp.urc(subrecv(big));
+  esp.urc(subrecv("after"));
+  drain(&esp, &mqtt);
+  // Both are dropped, the message after them is not lost.
+  CHECK(received == 1);
+  CHECK(lastData == "after");
+}
+
+static void testCutShort() {
+  FakeEsp esp;
+  EspATMQTT mqtt(&esp);
+
+  subscribe(&mqtt);
+  esp.urc("+MQTTSUBRECV:0,\"test/urc\",10,abc");
+  drain(&esp, &mqtt);
+  CHECK(received == 0);
+  esp.urc("+MQTTSUBRECV:0,\"test/u");
+  drain(&esp, &mqtt);
+  CHECK(received == 0);
+  esp.urc(subrecv("whole"));
+  drain(&esp, &mqtt);
+  CHECK(received == 1 && lastData == "whole");
+}
+
+static void testDeadline() {
+  FakeEsp esp;
+  EspATMQTT mqtt(&esp);
+  AtDeadline none;
+  AtDeadline passed(0);
+
+  subscribe(&mqtt);
+
+  // A default constructed deadline does not stop anything.
+  CHECK(!none.expired());
+  mqtt.setDeadline(&none);
+  CHECK(mqtt.subscribeTopic(mqttMessageHandler(onMessage, NULL), 0,
+                            "test/other") == ESP_AT_SUB_OK);
+
+  // A passed deadline stops new commands, but a URC is still read whole.
+  mqtt.setDeadline(&passed);
+  CHECK(passed.expired());
+  CHECK(mqtt.subscribeTopic(mqttMessageHandler(onMessage, NULL), 0,
+                            "test/third") == ESP_AT_SUB_CMD_TIMEOUT);
+  esp.urc(subrecv("in time"));
+  drain(&esp, &mqtt);
+  CHECK(received == 1 && lastData == "in time");
+  CHECK(mqtt.setDeadline(NULL) == &passed);
+
+  // The overrun is kept in the phase that used up the time, not the next.
+  AtDeadline phases(100);
+  phases.enter(AT_PHASE_PROMPT);
+  delay(200);
+  CHECK(phases.limit(1000, AT_PHASE_STRING) == 0);
+  CHECK(phases.overrunPhase() == AT_PHASE_PROMPT);
+  phases.start(100);
+  phases.enter(AT_PHASE_RETRY);
+  delay(200);
+  phases.enter(AT_PHASE_COMMAND);
+  CHECK(phases.overrunPhase() == AT_PHASE_RETRY);
+}
+
+/* A device that sends one line and then goes silent must not hold a wait
+   for longer than its timeout or the deadline */
+static void testSilent() {
+  FakeEsp esp;
+  AT_Class at(&esp);
+  AtDeadline deadline;
+  uint32_t start;
+
+  esp.answers["AT+SILENT"] = "+SILENT:1\r\n";
+  esp.answerLatency = 200;
+  start = millis();
+  CHECK(at.sendCommand("+SILENT", "", NULL, NULL, 300) == ESP_AT_SUB_CMD_TIMEOUT);
+  CHECK(millis() - start < 350);
+
+  deadline.start(300);
+  at.setDeadline(&deadline);
+  start = millis();
+  CHECK(at.sendCommand("+SILENT", "", NULL) == ESP_AT_SUB_CMD_TIMEOUT);
+  CHECK(millis() - start < 350);
+  CHECK(deadline.overrunPhase() == AT_PHASE_COMMAND);
+
+  deadline.start(300);
+  start = millis();
+  esp.urc("boot\r\nmore boot\r\n");
+  CHECK(at.waitString("ready", 10000) == ESP_AT_SUB_CMD_TIMEOUT);
+  CHECK(millis() - start < 350);
+  CHECK(deadline.overrunPhase() == AT_PHASE_STRING);
+  at.setDeadline(NULL);
+
+  // A boot log longer than the buffer does not hide the banner.
+  for (int i = 0; i < 100; i++)
+    esp.urc("a long line of the boot log of the device\r\n");
+  esp.urc("ready\r\n");
+  CHECK(at.waitString("ready", 10000) == ESP_AT_SUB_OK);
+}
+
+/* begin() with a deadline ends in time with a device that prints a boot log
+   and noise without an end of line, and never answers */
+static void testBegin() {
+  FakeEsp esp;
+  EspATMQTT mqtt(&esp);
+  mqtt_begin_result_t res;
+  uint32_t start;
+
+  esp.urc("boot\r\nrst:0x1 (POWERON),boot:0x13\r\n");
+  esp.answers["AT+SYSLOG"] = "\xff\xfe noise";
+  esp.answerLatency = 2500;
+  start = millis();
+  CHECK(mqtt.begin(3000, &res) == ESP_AT_SUB_CMD_TIMEOUT);
+  CHECK(millis() - start < 3050);
+  CHECK(!res.readyBanner);
+  CHECK(mqtt.setDeadline(NULL) == NULL);
+
+  // Then it starts and answers.
+  esp.answers.clear();
+  esp.urc("\r\nready\r\n");
+  CHECK(mqtt.begin(3000, &res) == ESP_AT_SUB_OK);
+  CHECK(res.readyBanner);
+}
+
+static void testDedup() {
+  FakeEsp esp;
+  EspATMQTT mqtt(&esp);
+  MqttDedup dedup;
+
+  subscribe(&mqtt);
+
+  // Without a key a filter that never forgets would swallow every repeat.
+  dedup.setMaxAge(0);
+  CHECK(mqtt.enableDedup(&dedup) == ESP_AT_SUB_PARA_INVALID);
+  dedup.setMaxAge(MQTT_DEDUP_MAX_AGE);
+  CHECK(mqtt.enableDedup(&dedup) == ESP_AT_SUB_OK);
+
+  esp.urc(subrecv("open"));
+  esp.urc(subrecv("open"));
+  drain(&esp, &mqtt);
+  CHECK(received == 1 && dedup.duplicates() == 1);
+
+  // The same command sent again later is delivered.
+  delay(MQTT_DEDUP_MAX_AGE + 1);
+  esp.urc(subrecv("open"));
+  drain(&esp, &mqtt);
+  CHECK(received == 2 && dedup.duplicates() == 1);
+
+  dedup.setKey(MqttDedup::jsonSequence, (void *)"seq");
+  dedup.setMaxAge(0);
+  CHECK(mqtt.enableDedup(&dedup) == ESP_AT_SUB_OK);
+  esp.urc(subrecv("{\"seq\":1,\"cmd\":\"open\"}"));
+  esp.urc(subrecv("{\"seq\":2,\"cmd\":\"open\"}"));
+  esp.urc(subrecv("{\"seq\":1,\"cmd\":\"open\"}"));
+  drain(&esp, &mqtt);
+  CHECK(received == 4 && dedup.duplicates() == 2);
+}
+
+int main() {
+  testBinary();
+  testTooLong();
+  testCutShort();
+  testDeadline();
+  testSilent();
+  testBegin();
+  testDedup();
+  return TEST_RESULT();
+}
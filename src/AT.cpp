@@ -51,6 +51,11 @@ static const char *STR_BUSY       = "busy p...";
  ******************************************************************************/
 AT_Class::AT_Class(HardwareSerial* serial) {
    _serial = serial;
+   urcHandler = NULL;
+   urcCtx = NULL;
+   busyCount = 0;
+   rxRing = NULL;
+   deadline = NULL;
 }
 
 /*******************************************************************************
@@ -66,20 +71,30 @@ AT_Class::AT_Class(HardwareSerial* serial) {
  ******************************************************************************/
 size_t AT_Class::readLine(uint32_t timeout) {
   size_t cnt = 0;
-  char ch = 0;
+  int ch = 0;
   uint32_t to = millis();
 
+  // Not cut short by a deadline, the caller waits for the first byte of the
+  // line with #waitLine() and a line left half read would corrupt the next one,
+  // unless the deadline allows it.
+  if (deadline && deadline->getCutLines())
+    timeout = deadline->limit(timeout);
   do {
-    ch = read();
-    if (ch >= 0 && ch != '\r' && ch != '\n') {
+    ch = rxRead();
+    if (ch < 0) {
+      yield();
+    } else if (ch != '\r' && ch != '\n' && wx < (int)sizeof(buff) - 2) {
       buff[wx++] = ch;
       cnt++;
     }
-  } while (ch != '\n' && ch != -1 && (millis() - to < timeout));
+  } while (ch != '\n' && (millis() - to < timeout));
 
-  if (millis() - to >= timeout)
+  if (ch != '\n')
     return 0;
 
+  // Room for the separator even if the buffer was filled by earlier lines.
+  if (wx > (int)sizeof(buff) - 2)
+    wx = sizeof(buff) - 2;
   buff[wx++] = '|';
   buff[wx] = '\0';
   cnt += 2;
@@ -119,14 +134,25 @@ at_status_t AT_Class::waitReply(const char *asynch, uint32_t timeout) {
   at_status_t errno = ESP_AT_SUB_OK;
   bool asynchFound = false;
   bool err = false;
+  uint32_t to = millis();
 
   wx = 0;
   line = 0;
   do {
     tx = wx;
-    if (!readLine(timeout))
+    // Each line gets what is left of the timeout, not a fresh one.
+    if (!waitLine(to, timeout) || !readLine())
       return ESP_AT_SUB_CMD_TIMEOUT;
 
+    if (urcHandler && urcHandler(urcCtx, &buff[tx])) {
+      // Not a part of the reply, forget about it. Note that lines like
+      // "+MQTTPUB:OK" must be removed here or they would end the reply.
+      wx = tx;
+      buff[wx] = '\0';
+      line--;
+      continue;
+    }
+
     if (strstr(&buff[tx], STR_BUSY)) {
       // So the ESP-AT interpreter is still busy executing the previously
       // send command. This means we need to wait and retry
@@ -149,14 +175,13 @@ at_status_t AT_Class::waitReply(const char *asynch, uint32_t timeout) {
 
   if (asynch && !asynchFound) {
     // Asynchronous marker not found, need to wait for it.
-    uint32_t to = millis();
-    while (!_serial->available() && (millis() - to < timeout))
-      yield();
-    if (!_serial->available())
+    enterPhase(AT_PHASE_ASYNCH);
+    if (!waitLine(millis(), timeout))
       return ESP_AT_SUB_CMD_TIMEOUT;
     wx = 0;
     line = 0;
-    readLine();
+    if (!readLine())
+      return ESP_AT_SUB_CMD_TIMEOUT;
     dprintf("Read line %d \"%s\"\r\n", line, &buff[0]);
     wx++;
   }
@@ -214,8 +239,8 @@ at_status_t AT_Class::waitReply(const char *asynch, uint32_t timeout) {
  *          timeout has occured.
  * @param[in] - timeout
  *          The amount of time, in milliseconds, that the function will wait
- *          for a reply from the ESP-AT device. This value is also used when
- *          waiting for an asynchronous response.
+ *          for a reply from the ESP-AT device. What is left of it after the
+ *          reply is also used when waiting for an asynchronous response.
  *
  * @return - The status of the operation, See #status_code_e for more
  *           information.
@@ -226,21 +251,32 @@ at_status_t AT_Class::sendCommand(const char *cmd, const char *param,
                                     uint32_t timeout) {
   at_status_t res;
   uint32_t to = millis();
+  uint32_t used;
+
+  // Nothing is sent once the deadline has passed, the reply would only
+  // show up in the middle of the next command.
+  if (deadline && deadline->expired())
+    return ESP_AT_SUB_CMD_TIMEOUT;
+  timeout = budget(timeout, AT_PHASE_COMMAND);
 
   snprintf(cmdBuff, ESP_AT_CMDBUFF_LENGTH, "AT%s%s", cmd, param);
   do {
+    enterPhase(AT_PHASE_COMMAND);
     dprintf("S:\'%s\'\n", cmdBuff);
     _serial->println(cmdBuff);
 
-    while (!_serial->available() && (millis() - to < timeout))
+    while (!rxAvailable() && (millis() - to < timeout))
       yield();
-    if (!_serial->available())
+    if (!rxAvailable())
       return ESP_AT_SUB_CMD_TIMEOUT;
 
-    res = waitReply(asynch, timeout);
+    // The reply gets what is left of the timeout, not a fresh one.
+    used = millis() - to;
+    res = waitReply(asynch, used < timeout ? timeout - used : 0);
     if (res == ESP_AT_SUB_CMD_RETRY) {
+      busyCount++;
       dprintf("Retrying last command !\n", NULL);
-      delay(250); // Make sure we have a nice little delay before retrying
+      delay(budget(250, AT_PHASE_RETRY)); // Make sure we have a nice little delay before retrying
     }
   } while (res == ESP_AT_SUB_CMD_RETRY && (millis() - to < timeout));
   if ((millis() - to) >= timeout)
@@ -280,11 +316,12 @@ at_status_t AT_Class::waitPrompt(uint32_t timeout) {
   char ch;
   uint32_t to = millis();
 
-  while (!_serial->available() && ((millis() - to) < timeout));
-  if (!_serial->available())
+  timeout = budget(timeout, AT_PHASE_PROMPT);
+  while (!rxAvailable() && ((millis() - to) < timeout));
+  if (!rxAvailable())
     return ESP_AT_SUB_CMD_TIMEOUT;
 
-  ch = _serial->read();
+  ch = rxRead();
   if (ch != '>')
     return ESP_AT_SUB_CMD_ERROR;
 
@@ -305,25 +342,20 @@ at_status_t AT_Class::waitPrompt(uint32_t timeout) {
  *
  ******************************************************************************/
 at_status_t AT_Class::waitString(const char *str, uint32_t timeout) {
-  size_t tx = 0;
   uint32_t to = millis();
 
-  // First make sure there are characters in the buffer and that it did not
-  // take to long for them to arrive.
-  while (!_serial->available() && ((millis() - to) < timeout));
-  if (!_serial->available())
-    return ESP_AT_SUB_CMD_TIMEOUT;
-
-  wx = 0;
-  line = 0;
+  enterPhase(AT_PHASE_STRING);
   do {
-    tx = wx;
-    readLine();
-    dprintf("L:\'%s\'\n", &buff[tx]);
-  } while (!strstr(&buff[tx], str) && ((millis() - to) < timeout));
+    // Only the line at hand is kept, a long boot log would fill the buffer.
+    wx = 0;
+    line = 0;
+    // Make sure the next line starts to arrive within what is left of the
+    // timeout before it is read.
+    if (!waitLine(to, timeout) || !readLine())
+      return ESP_AT_SUB_CMD_TIMEOUT;
+    dprintf("L:\'%s\'\n", &buff[0]);
+  } while (!strstr(&buff[0], str));
 
-  if ((millis() - to) >= timeout)
-    return ESP_AT_SUB_CMD_TIMEOUT;
   return ESP_AT_SUB_OK;
 }
 
@@ -406,13 +438,27 @@ char *AT_Class::getBuff() {
  *
  ******************************************************************************/
 char AT_Class::read(uint32_t timeout) {
-  char ch;
-  uint32_t to = millis();
+  int ch = readByte(timeout);
 
-  do {
-    ch = _serial->read();
-  } while (ch == 255 && (millis() - to < timeout));
+  return ch < 0 ? (char)0xff : (char)ch;
+}
 
+/*******************************************************************************
+ *
+ * Reads a byte from the serial port, like #read(), but tells a timeout apart
+ * from a received 0xff. The wait is not cut short by a deadline as it is
+ * meant for the rest of a line that has already started to arrive.
+ *
+ * @return - The data byte received from the ESP-AT device, or -1 if none
+ *           arrived within the timeout.
+ *
+ ******************************************************************************/
+int AT_Class::readByte(uint32_t timeout) {
+  uint32_t to = millis();
+  int ch;
+
+  while ((ch = rxRead()) < 0 && (millis() - to < timeout))
+    yield();
   return ch;
 }
 
@@ -433,9 +479,201 @@ void AT_Class::write(char ch) {
  *
  ******************************************************************************/
 int AT_Class::available() {
+  return rxAvailable();
+}
+
+/*******************************************************************************
+ *
+ * Waits for one line to arrive from the ESP-AT device and offers it to the URC
+ * handler. Used by higher layers that need to collect URCs while no command
+ * is being executed.
+ *
+ * @param[in] - timeout
+ *          The maximum time, in milliseconds, to wait for the line.
+ *
+ * @return - ESP_AT_SUB_OK if a URC was handled, ESP_AT_SUB_CMD_TIMEOUT if no
+ *           line arrived and ESP_AT_SUB_CMD_ERROR if the line was not taken
+ *           care of by the URC handler.
+ *
+ ******************************************************************************/
+at_status_t AT_Class::pollUrc(uint32_t timeout) {
+  uint32_t to = millis();
+
+  timeout = budget(timeout, AT_PHASE_URC);
+
+  while (!rxAvailable() && (millis() - to < timeout))
+    yield();
+  if (!rxAvailable())
+    return ESP_AT_SUB_CMD_TIMEOUT;
+
+  wx = 0;
+  line = 0;
+  if (!readLine())
+    return ESP_AT_SUB_CMD_TIMEOUT;
+  dprintf("URC \"%s\"\n", &buff[0]);
+
+  if (urcHandler && urcHandler(urcCtx, &buff[0]))
+    return ESP_AT_SUB_OK;
+  return ESP_AT_SUB_CMD_ERROR;
+}
+
+/*******************************************************************************
+ *
+ * Installs a handler that is offered every line received while waiting for
+ * a command reply. See #at_urc_cb_t for more information.
+ *
+ * @param[in] - cb
+ *          The handler, or NULL to remove it.
+ * @param[in] - ctx
+ *          A pointer that is passed on to the handler.
+ *
+ ******************************************************************************/
+void AT_Class::setUrcHandler(at_urc_cb_t cb, void *ctx) {
+  urcHandler = cb;
+  urcCtx = ctx;
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of "busy p..." replies received from the ESP-AT device
+ * since the class was created. A higher layer can use the change of this
+ * counter to detect that it is sending commands too fast.
+ *
+ ******************************************************************************/
+uint32_t AT_Class::getBusyCount() {
+  return busyCount;
+}
+
+/*******************************************************************************
+ *
+ * Makes the AT parser take its input from a receive ring instead of polling
+ * the serial port. Whatever empties the UART, normally an interrupt handler
+ * calling AtRxRing::fill(), becomes the producer of the ring and this class
+ * the only consumer. Bytes that arrive while the application is busy are then
+ * kept in the ring, see #AtRxRing for more information.
+ *
+ * @param[in] - ring
+ *          The ring, or NULL to go back to polling the serial port.
+ *
+ ******************************************************************************/
+void AT_Class::setRxRing(AtRxRing *ring) {
+  rxRing = ring;
+}
+
+/*******************************************************************************
+ *
+ * Returns the receive ring in use, or NULL if the serial port is polled.
+ *
+ ******************************************************************************/
+AtRxRing *AT_Class::getRxRing() {
+  return rxRing;
+}
+
+/*******************************************************************************
+ *
+ * Installs a deadline that bounds every wait of this class, and of the
+ * EspATMQTT and MqttCertMgmt objects using it, until it is removed again.
+ * Each wait then ends at the deadline at the latest, instead of running its
+ * own full timeout, and returns ESP_AT_SUB_CMD_TIMEOUT. No new command is
+ * sent once the deadline has passed. See #AtDeadline for more information.
+ *
+ * @param[in] - deadline
+ *          The deadline, or NULL to go back to the timeouts of each call.
+ *
+ * @return - The deadline that was installed before, so that it can be put
+ *           back when a nested operation is done.
+ *
+ ******************************************************************************/
+AtDeadline *AT_Class::setDeadline(AtDeadline *deadline) {
+  AtDeadline *prev = this->deadline;
+
+  this->deadline = deadline;
+  return prev;
+}
+
+/*******************************************************************************
+ *
+ * Returns the installed deadline, or NULL if there is none.
+ *
+ ******************************************************************************/
+AtDeadline *AT_Class::getDeadline() {
+  return deadline;
+}
+
+/*******************************************************************************
+ *
+ * Cuts a timeout short at the installed deadline, if there is one, and
+ * enters the phase the caller is about to wait in.
+ *
+ ******************************************************************************/
+uint32_t AT_Class::budget(uint32_t timeout, at_phase_t phase) {
+  if (!deadline)
+    return timeout;
+  return deadline->limit(timeout, phase);
+}
+
+/*******************************************************************************
+ *
+ * Waits for the first byte of the next line with the time left of a wait,
+ * cut short at the installed deadline. Every line of a reply is waited for
+ * like this before #readLine() reads it to its end, so a wait for several
+ * lines is bounded by one timeout and not by one timeout per line.
+ *
+ * @param[in] - to
+ *          The time, from millis(), that the wait started.
+ * @param[in] - timeout
+ *          The time, in milliseconds, that the whole wait may take.
+ *
+ * @return - true if a byte is waiting, false if none arrived in time.
+ *
+ ******************************************************************************/
+bool AT_Class::waitLine(uint32_t to, uint32_t timeout) {
+  uint32_t used = millis() - to;
+  uint32_t start = millis();
+  uint32_t left;
+
+  left = budget(used < timeout ? timeout - used : 0);
+  while (!rxAvailable() && (millis() - start < left))
+    yield();
+  return rxAvailable() > 0;
+}
+
+/*******************************************************************************
+ *
+ * Tells the installed deadline, if there is one, that a new phase begins.
+ *
+ ******************************************************************************/
+void AT_Class::enterPhase(at_phase_t phase) {
+  if (deadline)
+    deadline->enter(phase);
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of received bytes waiting, in the receive ring if one
+ * is attached or else in the serial port.
+ *
+ ******************************************************************************/
+int AT_Class::rxAvailable() {
+  if (rxRing)
+    return (int)rxRing->available();
   return _serial->available();
 }
 
+/*******************************************************************************
+ *
+ * Takes one received byte from the receive ring if one is attached or else
+ * from the serial port.
+ *
+ * @return - The byte, or -1 if no byte is waiting.
+ *
+ ******************************************************************************/
+int AT_Class::rxRead() {
+  if (rxRing)
+    return rxRing->get();
+  return _serial->read();
+}
+
 /*******************************************************************************
  *
  * Sets the serial port to be used in this class.
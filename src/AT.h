@@ -34,6 +34,8 @@
 
 #include <inttypes.h>
 #include <Arduino.h>
+#include <AtRxRing.h>
+#include <AtDeadline.h>
 
 #ifndef _H_AT_COM_
 #define _H_AT_COM_
@@ -67,6 +69,14 @@ enum status_code_e {
                                                      a callback will be issued when the connection is made */
   ESP_AT_SUB_CMD_RETRY            = 0x01110000, /**< The ESP-AT device returned a busy reply */
   ESP_AT_SUB_CMD_INVALID_PKI_PART = 0x01120000, /**< The system found an invalid PKI partition */
+  ESP_AT_SUB_CMD_QUEUED           = 0x01130000, /**< The message was put in the publish queue and
+                                                     will be sent when the connection is up */
+  ESP_AT_SUB_CMD_QUEUE_FULL       = 0x01140000, /**< The message could not be sent and there was
+                                                     no room for it in the publish queue */
+  ESP_AT_SUB_CMD_RATE_LIMITED     = 0x01150000, /**< The message was held back by the rate limiter */
+  ESP_AT_SUB_CMD_NO_MEMORY        = 0x01160000, /**< A buffer could not be borrowed from the scratch arena */
+  ESP_AT_SUB_CMD_WINDOW_FULL      = 0x01170000, /**< There was no room to track the message in the in-flight
+                                                     window, it was not sent */
   ESP_AT_SUB_CMD_LAST_COMMAND
 };
 
@@ -79,6 +89,15 @@ enum status_code_e {
  */
 typedef uint32_t          at_status_t;
 
+/**
+ * @typedef at_urc_cb_t
+ * Callback used by the AT_Class to offer each received line to a higher layer
+ * before it is treated as part of a command reply. The callback returns true
+ * if the line was an unsolicited result code (URC) that it has taken care of,
+ * the line is then removed from the reply.
+ */
+typedef bool (*at_urc_cb_t)(void *ctx, const char *line);
+
 /*******************************************************************************
  * EspAT MQTT AT_Class definition
  *
@@ -103,14 +122,33 @@ public:
   at_status_t sendString(char *str, size_t len);
   at_status_t sendString(const char *str);
   char read(uint32_t timeout = 500);
+  int readByte(uint32_t timeout = 500);
   void write(char ch);
   int available();
+  at_status_t pollUrc(uint32_t timeout);
+  void setUrcHandler(at_urc_cb_t cb, void *ctx);
+  uint32_t getBusyCount();
+  void setRxRing(AtRxRing *ring);
+  AtRxRing *getRxRing();
+  AtDeadline *setDeadline(AtDeadline *deadline);
+  AtDeadline *getDeadline();
 
   char *getBuff();
   void setSerial(HardwareSerial* = &ESP_SERIAL_PORT);
   HardwareSerial* getSerial();
 private:
+  int rxAvailable();
+  int rxRead();
+  uint32_t budget(uint32_t timeout, at_phase_t phase = AT_PHASE_NONE);
+  void enterPhase(at_phase_t phase);
+  bool waitLine(uint32_t to, uint32_t timeout);
+
   HardwareSerial* _serial;
+  AtRxRing *rxRing;         /**< Optional ring filled from the UART interrupt, replaces polling of the serial port */
+  AtDeadline *deadline;     /**< Optional deadline that bounds every wait */
+  at_urc_cb_t urcHandler;   /**< Optional handler of URCs found in command replies */
+  void *urcCtx;             /**< Context passed to the URC handler */
+  uint32_t busyCount;       /**< Number of busy replies received from the ESP-AT device */
 
   char buff[1024];    /**< Serial input buffer */
   char cmdBuff[ESP_AT_CMDBUFF_LENGTH];  /**< Command buffer for stuff sent to the ESP-AT device */
@@ -0,0 +1,222 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <Arduino.h>
+#include <AtDeadline.h>
+
+/** @file */
+
+static const char *phaseNames[AT_PHASE_LAST] = {
+  "none", "command", "retry", "asynch", "prompt", "string", "urc", "window",
+  "credit", "publish"
+};
+
+/*******************************************************************************
+ *
+ * Creates a deadline without a budget, it never passes. Call #start() to give
+ * it a budget.
+ *
+ ******************************************************************************/
+AtDeadline::AtDeadline() {
+  cutLines = false;
+  start(AT_DEADLINE_NONE);
+}
+
+/*******************************************************************************
+ *
+ * Creates a deadline and starts its budget right away.
+ *
+ * @param[in] - budget
+ *      The time, in milliseconds, from now until the deadline.
+ *
+ ******************************************************************************/
+AtDeadline::AtDeadline(uint32_t budget) {
+  cutLines = false;
+  start(budget);
+}
+
+/*******************************************************************************
+ *
+ * Starts a new budget and clears the accounting of the phases.
+ *
+ * @param[in] - budget
+ *      The time, in milliseconds, from now until the deadline, or
+ *      AT_DEADLINE_NONE for a deadline that never passes.
+ *
+ ******************************************************************************/
+void AtDeadline::start(uint32_t budget) {
+  startedAt = millis();
+  this->budget = budget;
+  phaseStart = startedAt;
+  phase = AT_PHASE_NONE;
+  overrun = AT_PHASE_NONE;
+  for (int i = 0; i < AT_PHASE_LAST; i++)
+    spent[i] = 0;
+}
+
+/*******************************************************************************
+ *
+ * Returns the time, in milliseconds, left until the deadline, 0 if it has
+ * passed and AT_DEADLINE_NONE if it has no budget.
+ *
+ ******************************************************************************/
+uint32_t AtDeadline::remaining() {
+  uint32_t used = millis() - startedAt;
+
+  if (budget == AT_DEADLINE_NONE)
+    return AT_DEADLINE_NONE;
+
+  if (used >= budget) {
+    if (overrun == AT_PHASE_NONE)
+      overrun = phase;
+    return 0;
+  }
+  return budget - used;
+}
+
+/*******************************************************************************
+ *
+ * Returns true if the deadline has passed.
+ *
+ ******************************************************************************/
+bool AtDeadline::expired() {
+  return remaining() == 0;
+}
+
+/*******************************************************************************
+ *
+ * Returns the time, in milliseconds, since the budget was started.
+ *
+ ******************************************************************************/
+uint32_t AtDeadline::elapsed() {
+  return millis() - startedAt;
+}
+
+/*******************************************************************************
+ *
+ * Cuts a timeout short so that it ends no later than the deadline, and
+ * optionally enters a new phase.
+ *
+ * @param[in] - timeout
+ *      The timeout, in milliseconds, the caller would use without a deadline.
+ * @param[in] - phase
+ *      The phase the caller is about to wait in, AT_PHASE_NONE to stay in
+ *      the current phase.
+ *
+ * @return - The smaller of timeout and the time left.
+ *
+ ******************************************************************************/
+uint32_t AtDeadline::limit(uint32_t timeout, at_phase_t phase) {
+  // The overrun is latched in the current phase before the new one begins.
+  uint32_t left = remaining();
+
+  if (phase != AT_PHASE_NONE)
+    enter(phase);
+  return timeout < left ? timeout : left;
+}
+
+/*******************************************************************************
+ *
+ * Enters a new phase. The time since the previous phase was entered is
+ * accounted to the previous phase, and so is the overrun if the budget ran
+ * out in the meantime.
+ *
+ ******************************************************************************/
+void AtDeadline::enter(at_phase_t phase) {
+  uint32_t now = millis();
+
+  remaining();
+
+  spent[this->phase] += now - phaseStart;
+  phaseStart = now;
+  this->phase = phase;
+}
+
+/*******************************************************************************
+ *
+ * Lets the deadline cut short a line that has started to arrive. By default
+ * a line is read to its end, as the rest of a line left half read would be
+ * taken for the next one. Only allow it when nothing is left to get wrong,
+ * like while a device that is starting up prints its boot log.
+ *
+ * @param[in] - cut
+ *      true to cut lines short at the deadline.
+ *
+ ******************************************************************************/
+void AtDeadline::setCutLines(bool cut) {
+  cutLines = cut;
+}
+
+/*******************************************************************************
+ *
+ * Returns true if a line may be cut short at the deadline.
+ *
+ ******************************************************************************/
+bool AtDeadline::getCutLines() {
+  return cutLines;
+}
+
+/*******************************************************************************
+ *
+ * Returns the phase that was active when the budget ran out, or
+ * AT_PHASE_NONE if the deadline has not passed.
+ *
+ ******************************************************************************/
+at_phase_t AtDeadline::overrunPhase() {
+  remaining();
+  return overrun;
+}
+
+/*******************************************************************************
+ *
+ * Returns the time, in milliseconds, spent in a phase since the budget was
+ * started, including the time in the current phase so far.
+ *
+ ******************************************************************************/
+uint32_t AtDeadline::phaseTime(at_phase_t phase) {
+  if (phase >= AT_PHASE_LAST)
+    return 0;
+  if (phase == this->phase)
+    return spent[phase] + (millis() - phaseStart);
+  return spent[phase];
+}
+
+/*******************************************************************************
+ *
+ * Returns the name of a phase, for log messages.
+ *
+ ******************************************************************************/
+const char *AtDeadline::phaseName(at_phase_t phase) {
+  if (phase >= AT_PHASE_LAST)
+    return "unknown";
+  return phaseNames[phase];
+}
@@ -0,0 +1,111 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_AT_DEADLINE_
+#define _H_AT_DEADLINE_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define AT_DEADLINE_NONE          0xffffffff  /**< Budget of a deadline that never passes */
+
+/**
+ * The phases of an operation that can wait for the ESP-AT device. The time
+ * spent in each of them is accounted by #AtDeadline.
+ */
+enum at_phase_e {
+  AT_PHASE_NONE                   = 0, /**< Not waiting for anything */
+  AT_PHASE_COMMAND                = 1, /**< Waiting for the OK or ERROR reply of a command */
+  AT_PHASE_RETRY                  = 2, /**< Delay before resending a command the device was busy with */
+  AT_PHASE_ASYNCH                 = 3, /**< Waiting for an asynchronous reply after the OK */
+  AT_PHASE_PROMPT                 = 4, /**< Waiting for the '>' data prompt */
+  AT_PHASE_STRING                 = 5, /**< Waiting for a specific reply, like +MQTTPUB:OK */
+  AT_PHASE_URC                    = 6, /**< Waiting for an unsolicited result code */
+  AT_PHASE_WINDOW                 = 7, /**< Waiting for room in the in-flight window */
+  AT_PHASE_CREDIT                 = 8, /**< Waiting for the rate limiter */
+  AT_PHASE_PUBLISH                = 9, /**< Waiting for a publish handle to complete */
+  AT_PHASE_LAST
+};
+typedef enum at_phase_e at_phase_t;
+
+/*******************************************************************************
+ * AtDeadline class definition
+ *
+ * One absolute time budget for an operation and everything it calls. While a
+ * deadline is installed in the AT_Class (see AT_Class::setDeadline()) every
+ * wait in AT_Class and EspATMQTT is cut short at the deadline instead of
+ * running its own full timeout, so the operation can not block for longer
+ * than the budget, plus the time it takes to finish the current AT command
+ * line. A line that has started to arrive is always read to its end, so a
+ * reply or a URC is never left half read. The time spent in each
+ * #at_phase_e is accounted, and the phase that was active when the budget
+ * ran out is kept.
+ *
+ * A line is cut short at the deadline only if #setCutLines() allows it, for
+ * output that is of no use once the deadline has passed, like the boot log
+ * of a device that is starting up.
+ *
+ * A deadline that has passed makes every following command fail at once, so
+ * remove it, or put back the one that was installed before, as soon as the
+ * bounded operation has returned. A default constructed deadline has no
+ * budget, AT_DEADLINE_NONE, and never passes until #start() is called.
+ ******************************************************************************/
+class AtDeadline {
+public:
+  AtDeadline();
+  AtDeadline(uint32_t budget);
+
+  void start(uint32_t budget = AT_DEADLINE_NONE);
+  uint32_t remaining();
+  bool expired();
+  uint32_t elapsed();
+  uint32_t limit(uint32_t timeout, at_phase_t phase = AT_PHASE_NONE);
+  void enter(at_phase_t phase);
+  void setCutLines(bool cut);
+  bool getCutLines();
+
+  at_phase_t overrunPhase();
+  uint32_t phaseTime(at_phase_t phase);
+  static const char *phaseName(at_phase_t phase);
+private:
+  uint32_t startedAt;     /**< Time the budget was started */
+  uint32_t budget;        /**< Length of the budget in milliseconds */
+  uint32_t phaseStart;    /**< Time the current phase was entered */
+  at_phase_t phase;       /**< The current phase */
+  at_phase_t overrun;     /**< The phase active when the budget ran out */
+  bool cutLines;          /**< A line that has started may be cut short at the deadline */
+  uint32_t spent[AT_PHASE_LAST]; /**< Time spent in each phase */
+};
+
+#endif
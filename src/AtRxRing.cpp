@@ -0,0 +1,204 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <AtRxRing.h>
+#ifdef ARDUINO
+#include <Arduino.h>
+#endif
+
+/** @file */
+
+#define RING_MASK         (AT_RX_RING_SIZE - 1)
+#define LOAD(x)           __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v)       __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define PEEK(x)           __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/*******************************************************************************
+ *
+ * The constructor leaves the ring empty with all counters cleared.
+ *
+ ******************************************************************************/
+AtRxRing::AtRxRing() {
+  head = 0;
+  tail = 0;
+  high = 0;
+  overflowCount = 0;
+}
+
+/*******************************************************************************
+ *
+ * Adds one byte to the ring. Producer side, safe to call from an interrupt.
+ *
+ * @param[in] - ch
+ *      The byte received from the UART.
+ *
+ * @return - true if the byte was stored, false if the ring was full and the
+ *           byte was dropped and counted as an overflow.
+ *
+ ******************************************************************************/
+bool AtRxRing::put(uint8_t ch) {
+  size_t h = PEEK(head);
+  size_t used = h - LOAD(tail);
+
+  if (used >= AT_RX_RING_SIZE) {
+    STORE(overflowCount, PEEK(overflowCount) + 1);
+    return false;
+  }
+  ring[h & RING_MASK] = ch;
+  STORE(head, h + 1);
+  if (used + 1 > PEEK(high))
+    STORE(high, used + 1);
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Adds a block of bytes to the ring. Producer side, safe to call from an
+ * interrupt. Bytes that do not fit are dropped and counted as overflows.
+ *
+ * @param[in] - data
+ *      The bytes received from the UART.
+ * @param[in] - len
+ *      The number of bytes.
+ *
+ * @return - The number of bytes that was stored.
+ *
+ ******************************************************************************/
+size_t AtRxRing::put(const uint8_t *data, size_t len) {
+  size_t h = PEEK(head);
+  size_t used = h - LOAD(tail);
+  size_t room = AT_RX_RING_SIZE - used;
+  size_t cnt = len < room ? len : room;
+
+  for (size_t i = 0; i < cnt; i++)
+    ring[(h + i) & RING_MASK] = data[i];
+  STORE(head, h + cnt);
+  if (used + cnt > PEEK(high))
+    STORE(high, used + cnt);
+  if (cnt < len)
+    STORE(overflowCount, PEEK(overflowCount) + (uint32_t)(len - cnt));
+  return cnt;
+}
+
+#ifdef ARDUINO
+/*******************************************************************************
+ *
+ * Moves everything the serial port holds into the ring. Producer side, meant
+ * to be called from a UART or timer interrupt, serialEvent() or the loop of
+ * a second core. Bytes are taken from the port even when the ring is full so
+ * that an overflow is counted instead of being lost silently in the UART.
+ *
+ * @param[in] - port
+ *      The serial port connected to the ESP-AT device.
+ *
+ * @return - The number of bytes that was stored.
+ *
+ ******************************************************************************/
+size_t AtRxRing::fill(Stream *port) {
+  size_t cnt = 0;
+  int ch;
+
+  while ((ch = port->read()) >= 0) {
+    if (put((uint8_t)ch))
+      cnt++;
+  }
+  return cnt;
+}
+#endif
+
+/*******************************************************************************
+ *
+ * Takes the oldest byte from the ring. Consumer side.
+ *
+ * @return - The byte, or -1 if the ring is empty.
+ *
+ ******************************************************************************/
+int AtRxRing::get() {
+  size_t t = PEEK(tail);
+  uint8_t ch;
+
+  if (LOAD(head) == t)
+    return -1;
+  ch = ring[t & RING_MASK];
+  STORE(tail, t + 1);
+  return ch;
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of bytes waiting in the ring. Consumer side, the number
+ * can only grow until the consumer takes bytes out.
+ *
+ ******************************************************************************/
+size_t AtRxRing::available() {
+  return LOAD(head) - PEEK(tail);
+}
+
+/*******************************************************************************
+ *
+ * Clears the high water mark and the overflow counter. A byte put at the same
+ * time may still update the old values.
+ *
+ ******************************************************************************/
+void AtRxRing::resetStats() {
+  STORE(high, (size_t)0);
+  STORE(overflowCount, (uint32_t)0);
+}
+
+/*******************************************************************************
+ *
+ * Returns the size of the ring, AT_RX_RING_SIZE.
+ *
+ ******************************************************************************/
+size_t AtRxRing::capacity() {
+  return AT_RX_RING_SIZE;
+}
+
+/*******************************************************************************
+ *
+ * Returns the largest number of bytes that has been waiting in the ring at
+ * the same time. A value close to #capacity() means the ring should be made
+ * larger or the consumer should run more often.
+ *
+ ******************************************************************************/
+size_t AtRxRing::highWater() {
+  return LOAD(high);
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of bytes dropped because the ring was full.
+ *
+ ******************************************************************************/
+uint32_t AtRxRing::overflows() {
+  return LOAD(overflowCount);
+}
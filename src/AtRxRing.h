@@ -0,0 +1,92 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_AT_RX_RING_
+#define _H_AT_RX_RING_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define AT_RX_RING_SIZE           1024  /**< Size of the receive ring in bytes, must be a power of two */
+
+#if (AT_RX_RING_SIZE & (AT_RX_RING_SIZE - 1)) != 0
+#error "AT_RX_RING_SIZE must be a power of two"
+#endif
+
+#ifdef ARDUINO
+class Stream;
+#endif
+
+/*******************************************************************************
+ * AtRxRing class definition
+ *
+ * A lock free byte ring with exactly one producer and one consumer. The
+ * producer is the code that empties the UART, typically an interrupt handler,
+ * a timer callback or the second core, and the consumer is the AT_Class.
+ * Bytes that arrive while the application is busy in a long callback are
+ * kept in the ring instead of overflowing the small FIFO of the UART.
+ *
+ * The producer side (#put() and #fill()) and the consumer side (#get(),
+ * #available() and #resetStats()) may run concurrently without any locking
+ * as long as each side is only used from one context. The high water mark
+ * and the overflow counter tell if AT_RX_RING_SIZE is large enough.
+ ******************************************************************************/
+class AtRxRing {
+public:
+  AtRxRing();
+
+  // Producer side
+  bool put(uint8_t ch);
+  size_t put(const uint8_t *data, size_t len);
+#ifdef ARDUINO
+  size_t fill(Stream *port);
+#endif
+
+  // Consumer side
+  int get();
+  size_t available();
+  void resetStats();
+
+  size_t capacity();
+  size_t highWater();
+  uint32_t overflows();
+private:
+  uint8_t ring[AT_RX_RING_SIZE];  /**< The ring storage */
+  size_t head;            /**< Free running write index, only written by the producer */
+  size_t tail;            /**< Free running read index, only written by the consumer */
+  size_t high;            /**< Max number of bytes held at the same time */
+  uint32_t overflowCount; /**< Number of bytes dropped because the ring was full */
+};
+
+#endif
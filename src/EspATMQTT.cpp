@@ -38,6 +38,7 @@
 
 const char *MQTT_RESP_SUBRECV           = "+MQTTSUBRECV:";
 const char *MQTT_RESP_CONNECTED         = "+MQTTCONNECTED:";
+const char *MQTT_RESP_DISCONNECTED      = "+MQTTDISCONNECTED:";
 
 const char *MQTT_CMD_USERCFG            = "+MQTTUSERCFG";
 const char *MQTT_CMD_CLIENTID           = "+MQTTCLIENTID";
@@ -54,6 +55,10 @@ const char *MQTT_CMD_CLEAN              = "+MQTTCLEAN";
 
 const char *MQTT_STRING_MQTTPUB         = "+MQTTPUB:";
 const char *MQTT_STRING_CIPSNTPTIME     = "AT+CIPSNTPTIME?\r\n";
+const char *MQTT_STRING_READY           = "ready";
+
+static const mqtt_message_handler_t noMessageHandler = { NULL, NULL };
+static const mqtt_event_handler_t noEventHandler = { NULL, NULL };
 
 const char *AT_CMD_SYSLOG               = "+SYSLOG";
 const char *AT_CMD_CIPSNTPCFG           = "+CIPSNTPCFG";
@@ -61,6 +66,88 @@ const char *AT_CMD_CIPSNTPTIME          = "+CIPSNTPTIME";
 
 const char *AT_RESP_CIPSNTPTIME         = "+CIPSNTPTIME:";
 
+enum mqtt_inflight_state_e {
+  INFLIGHT_SENT = 0,
+  INFLIGHT_ACKED,
+  INFLIGHT_FAILED
+};
+
+#define INFLIGHT_SLOTS          (MQTT_INFLIGHT_MAX + 1)
+
+enum mqtt_pub_slot_state_e {
+  PUB_SLOT_FREE = 0,
+  PUB_SLOT_PENDING,
+  PUB_SLOT_DONE
+};
+
+#define PUB_HANDLE(ix, gen)     ((mqtt_pub_handle_t)(((gen) << 8) | (ix)))
+
+// The configuration commands that are remembered for a reconnect, in the
+// order they must be sent to the ESP-AT device.
+enum mqtt_cfg_e {
+  MQTT_CFG_USERCFG = 0,
+  MQTT_CFG_CLIENTID,
+  MQTT_CFG_USERNAME,
+  MQTT_CFG_PASSWORD,
+  MQTT_CFG_CONNCFG,
+  MQTT_CFG_ALPN,
+  MQTT_CFG_CONN,
+  MQTT_CFG_COUNT
+};
+
+static const char *cfgCommand(uint8_t cfg) {
+  switch (cfg) {
+    case MQTT_CFG_USERCFG:  return MQTT_CMD_USERCFG;
+    case MQTT_CFG_CLIENTID: return MQTT_CMD_CLIENTID;
+    case MQTT_CFG_USERNAME: return MQTT_CMD_USERNAME;
+    case MQTT_CFG_PASSWORD: return MQTT_CMD_PASSWORD;
+    case MQTT_CFG_CONNCFG:  return MQTT_CMD_CONNCFG;
+    case MQTT_CFG_ALPN:     return MQTT_CMD_ALPN;
+    default:                return MQTT_CMD_CONN;
+  }
+}
+
+/*******************************************************************************
+ *
+ * Formats the parameter part of a +MQTTPUB command into dst, escaping the
+ * characters that has a special meaning to the AT parser (',', '"' and '\\').
+ *
+ * @return - The length of the formatted parameters or 0 if the payload holds
+ *      characters that can not be sent with +MQTTPUB or if the result does
+ *      not fit in dstLen bytes.
+ *
+ ******************************************************************************/
+static size_t formatInlinePub(char *dst, size_t dstLen, uint32_t linkID,
+                              const char *topic, const uint8_t *data, size_t len,
+                              uint32_t qos, uint32_t retain) {
+  int n = snprintf(dst, dstLen, "=%d,\"%s\",\"", linkID, topic);
+  if (n < 0 || (size_t)n >= dstLen)
+    return 0;
+
+  size_t ix = n;
+  for (size_t i = 0; i < len; i++) {
+    uint8_t ch = data[i];
+    // Control characters (and CR/LF in particular) would terminate or
+    // corrupt the command line, those payloads must go as raw data.
+    if (ch < 0x20 || ch == 0x7f)
+      return 0;
+    if (ch == ',' || ch == '"' || ch == '\\') {
+      if (ix + 1 >= dstLen)
+        return 0;
+      dst[ix++] = '\\';
+    }
+    if (ix + 1 >= dstLen)
+      return 0;
+    dst[ix++] = ch;
+  }
+
+  n = snprintf(&dst[ix], dstLen - ix, "\",%d,%d", qos, retain);
+  if (n < 0 || (size_t)n >= dstLen - ix)
+    return 0;
+
+  return ix + n;
+}
+
 /*******************************************************************************
  *
  * The module constructor allows you to select what serial port that should be
@@ -71,6 +158,30 @@ const char *AT_RESP_CIPSNTPTIME         = "+CIPSNTPTIME:";
  ******************************************************************************/
 EspATMQTT::EspATMQTT(HardwareSerial* serial) {
   _at = new AT_Class(serial);
+  pubThreshold = MQTT_PUB_INLINE_THRESHOLD;
+  memset(&pubStats, 0, sizeof(pubStats));
+  pubJournal = NULL;
+  valueCache = NULL;
+  dedup = NULL;
+  laneSched = MQTT_SCHED_STRICT;
+  laneWeight = MQTT_LANE_WEIGHT;
+  memset(batches, 0, sizeof(batches));
+  inflightHead = 0;
+  inflightWindow = MQTT_INFLIGHT_MAX;
+  inflightRetries = MQTT_PUB_MAX_RETRIES;
+  inflightBusy = false;
+  inflightLate = 0;
+  pubTimeout = MQTT_PUB_TIMEOUT;
+  promptTimeout = MQTT_PUB_PROMPT_TIMEOUT;
+  memset(pubSlots, 0, sizeof(pubSlots));
+  pubHandle = MQTT_PUB_HANDLE_NONE;
+  state_cb = NULL;
+  autoReconnect = false;
+  backoffMin = MQTT_RECONNECT_MIN_BACKOFF;
+  backoffMax = MQTT_RECONNECT_MAX_BACKOFF;
+  cfgDiffing = false;
+  cfgUsed = 0;
+  _at->setUrcHandler(urcHandler, this);
 }
 
 /*******************************************************************************
@@ -83,49 +194,171 @@ EspATMQTT::EspATMQTT(HardwareSerial* serial) {
  ******************************************************************************/
 EspATMQTT::EspATMQTT(AT_Class* at) {
   _at = at;
+  pubThreshold = MQTT_PUB_INLINE_THRESHOLD;
+  memset(&pubStats, 0, sizeof(pubStats));
+  pubJournal = NULL;
+  valueCache = NULL;
+  dedup = NULL;
+  laneSched = MQTT_SCHED_STRICT;
+  laneWeight = MQTT_LANE_WEIGHT;
+  memset(batches, 0, sizeof(batches));
+  inflightHead = 0;
+  inflightWindow = MQTT_INFLIGHT_MAX;
+  inflightRetries = MQTT_PUB_MAX_RETRIES;
+  inflightBusy = false;
+  inflightLate = 0;
+  pubTimeout = MQTT_PUB_TIMEOUT;
+  promptTimeout = MQTT_PUB_PROMPT_TIMEOUT;
+  memset(pubSlots, 0, sizeof(pubSlots));
+  pubHandle = MQTT_PUB_HANDLE_NONE;
+  state_cb = NULL;
+  autoReconnect = false;
+  backoffMin = MQTT_RECONNECT_MIN_BACKOFF;
+  backoffMax = MQTT_RECONNECT_MAX_BACKOFF;
+  cfgDiffing = false;
+  cfgUsed = 0;
+  _at->setUrcHandler(urcHandler, this);
 }
 
 /*******************************************************************************
  *
  * The begin method initializes the system before usage. It must be called
- * before running any other methods of this library.
+ * before running any other methods of this library. It waits for as long as
+ * it takes for the ESP-AT device to answer, see the deadline version of
+ * #begin() for more information.
  *
  * @return - The status of the operation, See #mqtt_error_e and
  *      #status_code_e for more information.
  *
  ******************************************************************************/
 mqtt_status_t EspATMQTT::begin() {
+  return begin(0, NULL);
+}
+
+// Returns the time left until the begin() deadline, a deadline of 0 means
+// that there is no deadline.
+static uint32_t beginTimeLeft(uint32_t start, uint32_t deadline,
+                              uint32_t max) {
+  uint32_t elapsed = millis() - start;
+
+  if (!deadline)
+    return max;
+  if (elapsed >= deadline)
+    return 0;
+  return (deadline - elapsed < max) ? deadline - elapsed : max;
+}
+
+/*******************************************************************************
+ *
+ * The begin method initializes the system before usage. It must be called
+ * before running any other methods of this library.
+ *
+ * A device that has just been powered up prints "ready" when it can take
+ * commands and one that is already running answers right away. The method
+ * looks for the banner while probing the device with the SYSLOG query, which
+ * is also the first step of the set up, every MQTT_BEGIN_PROBE_TIME
+ * milliseconds. SYSLOG is then only set if it is not enabled already.
+ *
+ * @param[in] - deadline
+ *      The max time in milliseconds that begin() may take, 0 waits for as
+ *      long as it takes. It is installed as an #AtDeadline for the whole of
+ *      begin(), so that each line a booting device prints, or noise without
+ *      an end of line, is bounded too.
+ *
+ * @param[out] - result
+ *      If not NULL, filled in with the outcome and the time each part took.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information. ESP_AT_SUB_CMD_TIMEOUT is
+ *      returned if the device did not answer before the deadline.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::begin(uint32_t deadline, mqtt_begin_result_t *result) {
+  mqtt_begin_result_t res;
+  uint32_t start = millis();
+  uint32_t left;
   char *strResult;
+  AtDeadline *outer = _at->getDeadline();
+  AtDeadline bound;
+
+  // Every wait of the AT layer ends at the deadline, or at one already
+  // installed by the caller if it is sooner. Nothing has been set up yet, so
+  // a line of the boot log, or noise, may be cut short too.
+  if (deadline) {
+    left = outer ? outer->remaining() : AT_DEADLINE_NONE;
+    if (left < deadline)
+      deadline = left ? left : 1;   // 0 would wait for as long as it takes
+    bound.start(deadline);
+    bound.setCutLines(true);
+    _at->setDeadline(&bound);
+  }
 
-  topicSubscriptions = 0;
-  connected = false;
-  connected_cb = NULL;
-  ntpTimeValid = false;
+  memset(&res, 0, sizeof(res));
+  subscription_cb = NULL;
+  subscriptionHandler = noMessageHandler;
+  validDateTime_cb = NULL;
+  dateTimeHandler = noEventHandler;
+  subCount = 0;
+  subTopicsUsed = 0;
+  ntpEnabled = false;
+  tzOffset = 0;
+  wallClock.reset();
   connType = AT_CONN_UNCONNECTED;
+  for (uint32_t i = 0; i < MQTT_MAX_LINKS; i++) {
+    links[i].state = MQTT_STATE_DISCONNECTED;
+    links[i].connected_cb = NULL;
+    links[i].connected = noEventHandler;
+    links[i].reconnectAttempts = 0;
+    links[i].cfgReplay = false;
+    links[i].cfgQueried = false;
+    links[i].subRestore = false;
+  }
+
   // First we need to make sure that SYSLOG has been enabled to get all the
-  // error codes.
-  while (_at->sendCommand(AT_CMD_SYSLOG, "?", &strResult) != ESP_AT_SUB_OK)
-    delay(100);
-
-  // Check
-  dprintf("Syslog String = %s\n", strResult);
-  int result = strtol(strResult, NULL, 10);
-  dprintf("Syslog int = %d\n", result);
-  if (!result) {
-    // And set if not already set
-    _at->sendCommand(AT_CMD_SYSLOG, "=1", NULL);
-  }
-
-  // Make sure it got set
-  _at->sendCommand(AT_CMD_SYSLOG, "?", &strResult);
-  dprintf("Syslog String = %s\n", strResult);
-  result = strtol(strResult, NULL, 10);
-  dprintf("Syslog int = %d\n", result);
-  if (!result) {
-    dprintf("Could not update SYSLOG, please check your system.", NULL);
-    return ESP_AT_SUB_CMD_ERROR;
+  // error codes. The query doubles as the probe for the device.
+  res.status = ESP_AT_SUB_CMD_TIMEOUT;
+  while ((left = beginTimeLeft(start, deadline, MQTT_BEGIN_PROBE_TIME))) {
+    // Output from a starting device, look for the banner
+    if (_at->available() && !res.readyBanner &&
+        _at->waitString(MQTT_STRING_READY, left) == ESP_AT_SUB_OK) {
+      dprintf("ESP-AT device is ready after %u ms\n", millis() - start);
+      res.readyBanner = true;
+      left = beginTimeLeft(start, deadline, MQTT_BEGIN_PROBE_TIME);
+      if (!left)
+        break;
+    }
+    res.probes++;
+    res.status = _at->sendCommand(AT_CMD_SYSLOG, "?", &strResult, NULL, left);
+    if (res.status == ESP_AT_SUB_OK)
+      break;
+    // A quick error reply would otherwise make this a busy loop
+    if (res.status != ESP_AT_SUB_CMD_TIMEOUT)
+      delay(beginTimeLeft(start, deadline, MQTT_BEGIN_PROBE_TIME / 2));
   }
-  return ESP_AT_SUB_OK;
+  res.readyTime = millis() - start;
+
+  if (res.status == ESP_AT_SUB_OK) {
+    dprintf("Syslog String = %s\n", strResult);
+    if (!strtol(strResult, NULL, 10)) {
+      // And set if not already set, the OK tells that it got set.
+      left = beginTimeLeft(start, deadline, 10000);
+      res.syslogSet = true;
+      res.status = ESP_AT_SUB_CMD_TIMEOUT;
+      if (left)
+        res.status = _at->sendCommand(AT_CMD_SYSLOG, "=1", NULL, NULL, left);
+      if (res.status != ESP_AT_SUB_OK)
+        dprintf("Could not update SYSLOG, please check your system.", NULL);
+    }
+  }
+  res.totalTime = millis() - start;
+  dprintf("begin() done in %u ms with %u probes, status %08x\n",
+          res.totalTime, res.probes, res.status);
+  if (deadline)
+    _at->setDeadline(outer);
+
+  if (result)
+    *result = res;
+  return res.status;
 }
 
 /*******************************************************************************
@@ -182,7 +415,7 @@ mqtt_status_t EspATMQTT::userConfig(uint32_t linkID, mqtt_scheme_t scheme,
  snprintf(buff, MQTT_BUFFER_SIZE, "=%d,%d,\"%s\",\"%s\",\"%s\",%d,%d,\"%s\"", linkID,
          (uint32_t)scheme, clientID, userName, password, certKeyID, caID, path);
 
- return _at->sendCommand(MQTT_CMD_USERCFG, buff, NULL);
+ return sendConfig(linkID, MQTT_CFG_USERCFG);
 }
 
 /*******************************************************************************
@@ -239,7 +472,7 @@ mqtt_status_t EspATMQTT::userConfig(uint32_t linkID, mqtt_scheme_t scheme,
  snprintf(buff, MQTT_BUFFER_SIZE, "=%d,%d,\"%s\",\"%s\",\"%s\",%d,%d,\"%s\"", linkID,
          (uint32_t)scheme, clientID, userName, password, certKeyID, caID, path);
 
- return _at->sendCommand(MQTT_CMD_USERCFG, buff, NULL);
+ return sendConfig(linkID, MQTT_CFG_USERCFG);
 }
 
 /*******************************************************************************
@@ -295,7 +528,7 @@ mqtt_status_t EspATMQTT::userConfig(uint32_t linkID, mqtt_scheme_t scheme,
  snprintf(buff, MQTT_BUFFER_SIZE, "=%d,%d,\"%s\",\"%s\",\"%s\",%d,%d,\"%s\"", linkID,
          (uint32_t)scheme, clientID, userName, password, certKeyID, caID, path);
 
- return _at->sendCommand(MQTT_CMD_USERCFG, buff, NULL);
+ return sendConfig(linkID, MQTT_CFG_USERCFG);
 }
 
 /*******************************************************************************
@@ -322,7 +555,7 @@ mqtt_status_t EspATMQTT::userConfig(uint32_t linkID, mqtt_scheme_t scheme,
 mqtt_status_t EspATMQTT::setClientID(uint32_t linkID, const char *clientID) {
 
   snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\"", linkID, clientID);
-  return _at->sendCommand(MQTT_CMD_CLIENTID, buff, NULL);
+  return sendConfig(linkID, MQTT_CFG_CLIENTID);
 }
 
 /*******************************************************************************
@@ -349,7 +582,7 @@ mqtt_status_t EspATMQTT::setClientID(uint32_t linkID, const char *clientID) {
 mqtt_status_t EspATMQTT::setClientID(uint32_t linkID, char *clientID) {
 
   snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\"", linkID, clientID);
-  return _at->sendCommand(MQTT_CMD_CLIENTID, buff, NULL);
+  return sendConfig(linkID, MQTT_CFG_CLIENTID);
 }
 
 /*******************************************************************************
@@ -377,7 +610,7 @@ mqtt_status_t EspATMQTT::setClientID(uint32_t linkID, char *clientID) {
 mqtt_status_t EspATMQTT::setUsername(uint32_t linkID, const char *username) {
 
   snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\"", linkID, username);
-  return _at->sendCommand(MQTT_CMD_USERNAME, buff, NULL);
+  return sendConfig(linkID, MQTT_CFG_USERNAME);
 }
 
 /*******************************************************************************
@@ -405,7 +638,7 @@ mqtt_status_t EspATMQTT::setUsername(uint32_t linkID, const char *username) {
 mqtt_status_t EspATMQTT::setUsername(uint32_t linkID, char *username) {
 
   snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\"", linkID, username);
-  return _at->sendCommand(MQTT_CMD_USERNAME, buff, NULL);
+  return sendConfig(linkID, MQTT_CFG_USERNAME);
 }
 
 /*******************************************************************************
@@ -433,7 +666,7 @@ mqtt_status_t EspATMQTT::setUsername(uint32_t linkID, char *username) {
 mqtt_status_t EspATMQTT::setPassword(uint32_t linkID, const char *password) {
 
   snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\"", linkID, password);
-  return _at->sendCommand(MQTT_CMD_PASSWORD, buff, NULL);
+  return sendConfig(linkID, MQTT_CFG_PASSWORD);
 }
 
 /*******************************************************************************
@@ -461,7 +694,7 @@ mqtt_status_t EspATMQTT::setPassword(uint32_t linkID, const char *password) {
 mqtt_status_t EspATMQTT::setPassword(uint32_t linkID, char *password) {
 
   snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\"", linkID, password);
-  return _at->sendCommand(MQTT_CMD_PASSWORD, buff, NULL);
+  return sendConfig(linkID, MQTT_CFG_PASSWORD);
 }
 
 /*******************************************************************************
@@ -525,7 +758,7 @@ mqtt_status_t EspATMQTT::connectionConfig(uint32_t linkID, uint32_t keepalive,
 
   snprintf(buff, MQTT_BUFFER_SIZE, "=%d,%d,%d,\"%s\",\"%s\",%d,%d", linkID,
            keepalive, disable_clean_session, lwt_topic, lwt_message, lwt_qos, lwt_retain);
-  return _at->sendCommand(MQTT_CMD_CONNCFG, buff, NULL);
+  return sendConfig(linkID, MQTT_CFG_CONNCFG);
 }
 
 /*******************************************************************************
@@ -582,7 +815,7 @@ mqtt_status_t EspATMQTT::setALPN(uint32_t linkID, const char *alpn1,
                      linkID, alpn1, alpn2, alpn3, alpn4, alpn5);
       break;
   }
-  return _at->sendCommand(MQTT_CMD_ALPN, buff, NULL);
+  return sendConfig(linkID, MQTT_CFG_ALPN);
 }
 
 /*******************************************************************************
@@ -652,25 +885,53 @@ mqtt_status_t EspATMQTT::connect(uint32_t linkID, const char *host,
   mqtt_status_t ret;
   char *result;
 
+  if (linkID >= MQTT_MAX_LINKS)
+    return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_LINK_ID_VALUE_IS_WRONG;
+
   snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\",%d,%d", linkID, host, port, reconnect);
+  // Remembered even if this attempt fails so the supervisor can retry it.
+  rememberConfig(linkID, MQTT_CFG_CONN, buff);
+  links[linkID].connectStart = millis();
   ret = _at->sendCommand(MQTT_CMD_CONN, buff, &result, MQTT_RESP_CONNECTED, timeout);
   if (ret == ESP_AT_SUB_OK) {
     dprintf("Connection result: %s\n", result);
     if (strstr(result, MQTT_RESP_CONNECTED)) {
-      connected = true;
+      setState(linkID, MQTT_STATE_CONNECTED);
       ret = ESP_AT_SUB_CMD_CONN_SYNCH;
     } else {
-      connected_cb = cb;
+      links[linkID].connected_cb = cb;
+      links[linkID].connected = noEventHandler;
+      setState(linkID, MQTT_STATE_CONNECTING);
       ret = ESP_AT_SUB_CMD_CONN_ASYNCH;
     }
   } else if (ret == ESP_AT_SUB_CMD_TIMEOUT) {
-    connected_cb = cb;
+    links[linkID].connected_cb = cb;
+    links[linkID].connected = noEventHandler;
+    setState(linkID, MQTT_STATE_CONNECTING);
     ret = ESP_AT_SUB_CMD_CONN_ASYNCH;
   }
 
   return ret;
 }
 
+/*******************************************************************************
+ *
+ * Connects to the specified server/broker, see the #connect() method above.
+ * The handler is called by #process() with its context, for instance an
+ * object, when an asynchronous connection is made.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::connect(uint32_t linkID, const char *host,
+                                 uint32_t port, uint32_t reconnect,
+                                 uint32_t timeout, mqtt_event_handler_t handler) {
+  mqtt_status_t ret = connect(linkID, host, port, reconnect, timeout,
+                              (connected_cb_t)NULL);
+
+  if (ret == ESP_AT_SUB_CMD_CONN_ASYNCH)
+    links[linkID].connected = handler;
+  return ret;
+}
+
 /*******************************************************************************
  *
  * Publish a string to a specified topic.
@@ -716,11 +977,9 @@ mqtt_status_t EspATMQTT::connect(uint32_t linkID, const char *host,
  ******************************************************************************/
 mqtt_status_t EspATMQTT::pubString(uint32_t linkID, const char *topic,
                          const char *data, uint32_t qos, uint32_t retain) {
-  if (connected) {
-    snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\",\"%s\",%d,%d", linkID, topic, data, qos, retain);
-    return _at->sendCommand(MQTT_CMD_PUB, buff, NULL);
-  }
-  return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
+  mqtt_buffer_t seg = { (const uint8_t *)data, strlen(data) };
+
+  return submitPublish(MQTT_PUB_TYPE_INLINE, linkID, topic, &seg, 1, qos, retain);
 }
 
 /*******************************************************************************
@@ -768,11 +1027,9 @@ mqtt_status_t EspATMQTT::pubString(uint32_t linkID, const char *topic,
  ******************************************************************************/
 mqtt_status_t EspATMQTT::pubString(uint32_t linkID, const char *topic, char *data,
                          uint32_t qos, uint32_t retain) {
-  if (connected) {
-    snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\",\"%s\",%d,%d", linkID, topic, data, qos, retain);
-    return _at->sendCommand(MQTT_CMD_PUB, buff, NULL);
-  }
-  return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
+  mqtt_buffer_t seg = { (const uint8_t *)data, strlen(data) };
+
+  return submitPublish(MQTT_PUB_TYPE_INLINE, linkID, topic, &seg, 1, qos, retain);
 }
 
 /*******************************************************************************
@@ -821,27 +1078,7 @@ mqtt_status_t EspATMQTT::pubString(uint32_t linkID, const char *topic, char *dat
  ******************************************************************************/
 mqtt_status_t EspATMQTT::pubRaw(uint32_t linkID, const char *topic, const char *data,
                          uint32_t qos, uint32_t retain) {
-  mqtt_status_t status;
-
-  if (connected) {
-    size_t len = strlen(data);
-
-    snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\",%d,%d,%d", linkID, topic, len, qos, retain);
-    status = _at->sendCommand(MQTT_CMD_PUBRAW, buff, NULL);
-    if (status != ESP_AT_SUB_OK) {
-      return status;
-    }
-    _at->waitPrompt(100);
-    _at->sendString(data, len);
-    _at->waitString(MQTT_STRING_MQTTPUB, 100);
-
-    char *lBuff = _at->getBuff();
-    if (strstr(lBuff, "FAIL")) {
-      return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_FAILED_TO_PUBLISH_RAW;
-    }
-    return ESP_AT_SUB_OK;
-  }
-  return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
+  return pubRaw(linkID, topic, (const uint8_t *)data, strlen(data), qos, retain);
 }
 
 /*******************************************************************************
@@ -890,32 +1127,14 @@ mqtt_status_t EspATMQTT::pubRaw(uint32_t linkID, const char *topic, const char *
  ******************************************************************************/
 mqtt_status_t EspATMQTT::pubRaw(uint32_t linkID, const char *topic, char *data,
                          uint32_t qos, uint32_t retain) {
-  mqtt_status_t status;
-
-  if (connected) {
-    size_t len = strlen(data);
-
-    snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\",%d,%d,%d", linkID, topic, len, qos, retain);
-    status = _at->sendCommand(MQTT_CMD_PUBRAW, buff, NULL);
-    if (status != ESP_AT_SUB_OK) {
-      return status;
-    }
-    _at->waitPrompt(100);
-    _at->sendString(data, len);
-    _at->waitString(MQTT_STRING_MQTTPUB, 100);
-
-    char *lBuff = _at->getBuff();
-    if (strstr(lBuff, "FAIL")) {
-      return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_FAILED_TO_PUBLISH_RAW;
-    }
-    return ESP_AT_SUB_OK;
-  }
-  return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
+  return pubRaw(linkID, topic, (const uint8_t *)data, strlen(data), qos, retain);
 }
 
 /*******************************************************************************
  *
- * Subscribe to messages from a specific topic.
+ * Publish binary data of a known length to a specified topic.
+ * As the length is given by the caller the data may contain any byte value,
+ * including '\0', and no scan of the data is needed before sending it.
  *
  * @param[in] - linkID
  *      The link ID used for this connection. Only linkID 0 is currently
@@ -923,7 +1142,13 @@ mqtt_status_t EspATMQTT::pubRaw(uint32_t linkID, const char *topic, char *data,
  *      make it easy to migrate if this changes in the future.
  *
  * @param[in] - topic
- *      The topic for which we are listening to.
+ *      The topic where the message shold be published.
+ *
+ * @param[in] - data
+ *      Pointer to the data that should be published to the specified topic.
+ *
+ * @param[in] - len
+ *      The number of bytes to publish.
  *
  * @param[in] - qos
  *      The Quality of Service value that should be used for this message.<br>
@@ -944,24 +1169,30 @@ mqtt_status_t EspATMQTT::pubRaw(uint32_t linkID, const char *topic, char *data,
  *            the intended recipients. QoS 2 is the safest and slowest quality
  *            of service level.
  *
+ * @param[in] - retain
+ *      A retained message is a normal MQTT message with the retained flag set
+ *      to true (= 1). The broker stores the last retained message and the
+ *      corresponding QoS for that topic. See #mqtt_retain_e for more details.
+ *
  * @return - The status of the operation, See #mqtt_error_e and
  *      #status_code_e for more information.
  *
  ******************************************************************************/
-mqtt_status_t EspATMQTT::subscribeTopic(subscription_cb_t cb, uint32_t linkID,
-              const char * topic, uint32_t qos) {
-  if (connected) {
-    snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\",%d", linkID, topic, qos);
-    subscription_cb = cb;
-    topicSubscriptions++;
-    return _at->sendCommand(MQTT_CMD_SUB, buff, NULL);
-  }
-  return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
+mqtt_status_t EspATMQTT::pubRaw(uint32_t linkID, const char *topic,
+                         const uint8_t *data, size_t len, uint32_t qos,
+                         uint32_t retain) {
+  mqtt_buffer_t seg = { data, len };
+
+  return submitPublish(MQTT_PUB_TYPE_RAW, linkID, topic, &seg, 1, qos, retain);
 }
 
 /*******************************************************************************
  *
- * Subscribe to messages from a specific topic.
+ * Publish a message that is scattered over several buffers to a specified
+ * topic. The buffers are sent back to back after the publish prompt so the
+ * broker receives them as one single message. This makes it possible to
+ * publish pre framed records, for instance a header, a body and a trailer,
+ * without having to assemble them in a separate buffer first.
  *
  * @param[in] - linkID
  *      The link ID used for this connection. Only linkID 0 is currently
@@ -969,230 +1200,2739 @@ mqtt_status_t EspATMQTT::subscribeTopic(subscription_cb_t cb, uint32_t linkID,
  *      make it easy to migrate if this changes in the future.
  *
  * @param[in] - topic
- *      The topic for which we are listening to.
+ *      The topic where the message shold be published.
+ *
+ * @param[in] - bufs
+ *      An array of buffer descriptors, see #mqtt_buffer_t. Segments with a
+ *      length of zero are allowed and simply skipped.
+ *
+ * @param[in] - count
+ *      The number of entries in the bufs array.
  *
  * @param[in] - qos
  *      The Quality of Service value that should be used for this message.<br>
- *      The following values are recognized:<br>
- *      - 0 - At most once:<br>The minimal QoS level is zero. This service level
- *            guarantees a best-effort delivery. There is no guarantee of
- *            delivery. The recipient does not acknowledge receipt of the
- *            message and the message is not stored and re-transmitted by the
- *            sender. QoS level 0 is often called “fire and forget” and provides
- *            the same guarantee as the underlying TCP protocol.
- *      - 1 - At least once:<br>QoS level 1 guarantees that a message is
- *            delivered at least one time to the receiver. The sender stores the
- *            message until it gets a PUBACK packet from the receiver that
- *            acknowledges receipt of the message. It is possible for a message
- *            to be sent or delivered multiple times.
- *      - 2 - Exactly once:<br>QoS 2 is the highest level of service in MQTT.
- *            This level guarantees that each message is received only once by
- *            the intended recipients. QoS 2 is the safest and slowest quality
- *            of service level.
+ *      See #pubRaw() for a description of the different levels.
+ *
+ * @param[in] - retain
+ *      A retained message is a normal MQTT message with the retained flag set
+ *      to true (= 1). See #mqtt_retain_e for more details.
  *
  * @return - The status of the operation, See #mqtt_error_e and
  *      #status_code_e for more information.
  *
  ******************************************************************************/
-mqtt_status_t EspATMQTT::subscribeTopic(subscription_cb_t cb, uint32_t linkID,
-              char * topic, uint32_t qos) {
-  if (connected) {
-    snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\",%d", linkID, topic, qos);
-    subscription_cb = cb;
-    topicSubscriptions++;
-    return _at->sendCommand(MQTT_CMD_SUB, buff, NULL);
-  }
-  return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
+mqtt_status_t EspATMQTT::pubRaw(uint32_t linkID, const char *topic,
+                         const mqtt_buffer_t *bufs, size_t count,
+                         uint32_t qos, uint32_t retain) {
+  return submitPublish(MQTT_PUB_TYPE_RAW, linkID, topic, bufs, count, qos, retain);
 }
 
 /*******************************************************************************
  *
- * Unsubscribe from messages with a specific topic.
+ * Publish binary data of a known length to a specified topic. This is the same
+ * as the length explicit #pubRaw() method but with a name that makes the
+ * intent clear at the call site.
  *
  * @param[in] - linkID
- *      The link ID used for this connection. Only linkID 0 is currently
- *      supported by the ESP-AT stack.<br>Using the library DEFAULT_LINK_ID will
- *      make it easy to migrate if this changes in the future.
+ *      The link ID used for this connection.
  *
  * @param[in] - topic
- *      The topic that should be unsubscribed from.
+ *      The topic where the message shold be published.
+ *
+ * @param[in] - data
+ *      Pointer to the data that should be published to the specified topic.
+ *
+ * @param[in] - len
+ *      The number of bytes to publish.
+ *
+ * @param[in] - qos
+ *      The Quality of Service value that should be used for this message.
+ *
+ * @param[in] - retain
+ *      The retain flag of the message, see #mqtt_retain_e for more details.
  *
  * @return - The status of the operation, See #mqtt_error_e and
  *      #status_code_e for more information.
  *
  ******************************************************************************/
-mqtt_status_t EspATMQTT::unSubscribeTopic(uint32_t linkID, const char * topic) {
-  if (connected) {
-    snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\"", linkID, topic);
-    if (topicSubscriptions) {
-      topicSubscriptions--;
-      if (!topicSubscriptions)
-        subscription_cb = NULL;
-    }
-    return _at->sendCommand(MQTT_CMD_UNSUB, buff, NULL);
-  }
-  return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
+mqtt_status_t EspATMQTT::pubBinary(uint32_t linkID, const char *topic,
+                         const uint8_t *data, size_t len, uint32_t qos,
+                         uint32_t retain) {
+  return pubRaw(linkID, topic, data, len, qos, retain);
 }
 
 /*******************************************************************************
  *
- * Unsubscribe from messages with a specific topic.
+ * Internal entry point for all the publish methods. If the journal or the
+ * publish queue is enabled and the client is disconnected, or there are older
+ * messages still waiting, the message is put at the end of the journal (or
+ * the queue if there is no journal) to keep the order of the messages.
+ * Otherwise it is sent immediately.
  *
- * @param[in] - linkID
- *      The link ID used for this connection. Only linkID 0 is currently
- *      supported by the ESP-AT stack.<br>Using the library DEFAULT_LINK_ID will
- *      make it easy to migrate if this changes in the future.
+ * Urgent messages are never put behind bulk messages. They are sent at once
+ * if the link is up, otherwise they wait in the urgent lane if there is one.
  *
- * @param[in] - topic
- *      The topic that should be unsubscribed from.
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::submitPublish(uint8_t type, uint32_t linkID,
+                         const char *topic, const mqtt_buffer_t *bufs,
+                         size_t count, uint32_t qos, uint32_t retain,
+                         mqtt_priority_t priority) {
+  mqtt_pub_record_t rec;
+
+  if (linkID >= MQTT_MAX_LINKS)
+    return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_LINK_ID_VALUE_IS_WRONG;
+
+  MqttPubQueue *queue = &links[linkID].queue;
+  bool up = isConnected(linkID);
+  bool urgent = (priority == MQTT_PRIORITY_URGENT);
+
+  rec.linkID = linkID;
+  rec.qos = qos;
+  rec.retain = retain;
+  rec.type = type;
+
+  if (urgent && urgentLane.isEnabled()) {
+    queue = &urgentLane;
+    if (!up || !urgentLane.isEmpty()) {
+      if (!urgentLane.push(&rec, topic, bufs, count))
+        return ESP_AT_SUB_CMD_QUEUE_FULL;
+      flushUrgent(UINT32_MAX);
+      return ESP_AT_SUB_CMD_QUEUED;
+    }
+  } else if (!urgent || !up) {
+    if (pubJournal && (!up || !queue->isEmpty() || !pubJournal->isEmpty())) {
+      if (!pubJournal->append(&rec, topic, bufs, count))
+        return ESP_AT_SUB_CMD_QUEUE_FULL;
+      return ESP_AT_SUB_CMD_QUEUED;
+    }
+
+    if (queue->isEnabled() && (!up || !queue->isEmpty())) {
+      if (!queue->push(&rec, topic, bufs, count))
+        return ESP_AT_SUB_CMD_QUEUE_FULL;
+      flushQueue(linkID);
+      return ESP_AT_SUB_CMD_QUEUED;
+    }
+  }
+
+  mqtt_status_t status = sendPublish(type, linkID, topic, bufs, count, qos, retain);
+  if (status == ESP_AT_SUB_CMD_RATE_LIMITED) {
+    size_t len = 0;
+
+    for (size_t i = 0; i < count; i++)
+      len += bufs[i].len;
+    if (queue->isEnabled()) {
+      if (!queue->push(&rec, topic, bufs, count))
+        return ESP_AT_SUB_CMD_QUEUE_FULL;
+      return ESP_AT_SUB_CMD_QUEUED;
+    }
+    status = waitPublishCredit(len);
+    if (status == ESP_AT_SUB_OK)
+      status = sendPublish(type, linkID, topic, bufs, count, qos, retain);
+  }
+  checkLinkStatus(linkID, status);
+  return status;
+}
+
+/*******************************************************************************
  *
- * @return - The status of the operation, See #mqtt_error_e and
- *      #status_code_e for more information.
+ * Sends a message to the ESP-AT device if the link is up and the rate limiter
+ * has credit for it. The outcome is reported back to the rate limiter so it
+ * can adapt to how busy the ESP-AT device is.
  *
  ******************************************************************************/
-mqtt_status_t EspATMQTT::unSubscribeTopic(uint32_t linkID, char * topic) {
-  if (connected) {
-    snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\"", linkID, topic);
-    if (topicSubscriptions) {
-      topicSubscriptions--;
-      if (!topicSubscriptions)
-        subscription_cb = NULL;
-    }
-    return _at->sendCommand(MQTT_CMD_UNSUB, buff, NULL);
+mqtt_status_t EspATMQTT::sendPublish(uint8_t type, uint32_t linkID,
+                         const char *topic, const mqtt_buffer_t *bufs,
+                         size_t count, uint32_t qos, uint32_t retain) {
+  mqtt_status_t status;
+  uint32_t busy;
+  size_t len = 0;
+
+  if (!isConnected(linkID))
+    return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
+
+  // Subscriptions are restored before anything is published on a new
+  // connection.
+  if (links[linkID].subRestore) {
+    restoreSubscriptions(linkID);
+    if (!isConnected(linkID))
+      return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
   }
-  return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
+
+  for (size_t i = 0; i < count; i++)
+    len += bufs[i].len;
+
+  if (rateLimiter.isEnabled() && !rateLimiter.consume(len, millis()))
+    return ESP_AT_SUB_CMD_RATE_LIMITED;
+
+  busy = _at->getBusyCount();
+  status = transmitPublish(type, linkID, topic, bufs, count, len, qos, retain);
+  rateLimiter.feedback(busy != _at->getBusyCount() ||
+                       status == ESP_AT_SUB_CMD_TIMEOUT, millis());
+  return status;
 }
 
 /*******************************************************************************
  *
- * Close (all) conection/s with the specified link ID.
+ * Sends a message to the ESP-AT device using the transport given by type,
+ * see #mqtt_pub_type_e.
  *
- * @param[in] - linkID
- *      The link ID used for this connection. Only linkID 0 is currently
- *      supported by the ESP-AT stack.<br>Using the library DEFAULT_LINK_ID will
- *      make it easy to migrate if this changes in the future.
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::transmitPublish(uint8_t type, uint32_t linkID,
+                         const char *topic, const mqtt_buffer_t *bufs,
+                         size_t count, size_t len, uint32_t qos,
+                         uint32_t retain) {
+  mqtt_status_t status;
+
+  if (type == MQTT_PUB_TYPE_INLINE) {
+    // Inline messages always come from pubString() as one single segment.
+    snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\",\"%.*s\",%d,%d", linkID, topic,
+             (int)len, (const char *)bufs[0].data, qos, retain);
+    return _at->sendCommand(MQTT_CMD_PUB, buff, NULL);
+  }
+
+  if (type == MQTT_PUB_TYPE_AUTO) {
+    // The AT_Class prepends "AT" and the command to the parameters in a buffer
+    // of ESP_AT_CMDBUFF_LENGTH bytes, so that is the real limit of +MQTTPUB.
+    size_t maxParam = ESP_AT_CMDBUFF_LENGTH - 2 - strlen(MQTT_CMD_PUB);
+    if (maxParam > MQTT_BUFFER_SIZE)
+      maxParam = MQTT_BUFFER_SIZE;
+
+    if (count == 1 && len && len <= pubThreshold &&
+        formatInlinePub(buff, maxParam, linkID, topic, bufs[0].data, len,
+                        qos, retain)) {
+      status = _at->sendCommand(MQTT_CMD_PUB, buff, NULL);
+      if (status == ESP_AT_SUB_OK) {
+        pubStats.inlineCount++;
+        pubStats.inlineBytes += len;
+      }
+      return status;
+    }
+  }
+
+  if (inflight.isEnabled()) {
+    status = waitInflightWindow(topic, qos ? len : 0);
+    if (status != ESP_AT_SUB_OK)
+      return status;
+  }
+
+  status = pubRawSegments(linkID, topic, bufs, count, len, qos, retain);
+  if (type == MQTT_PUB_TYPE_AUTO && status == ESP_AT_SUB_OK) {
+    pubStats.rawCount++;
+    pubStats.rawBytes += len;
+  }
+  return status;
+}
+
+/*******************************************************************************
  *
- * @return - The status of the operation, See #mqtt_error_e and
- *      #status_code_e for more information.
+ * Sends the messages waiting in the publish queue of a link back to back for
+ * as long as the link is up. A message that could not be sent because of a
+ * timeout or a lost connection is left in the queue for the next attempt,
+ * any other error means that the message itself was rejected and it is
+ * removed from the queue.
  *
  ******************************************************************************/
-mqtt_status_t EspATMQTT::close(uint32_t linkID) {
-  if (connected) {
-    snprintf(buff, MQTT_BUFFER_SIZE, "=%d", linkID);
-    return _at->sendCommand(MQTT_CMD_CLEAN, buff, NULL);
+void EspATMQTT::flushQueue(uint32_t linkID) {
+  MqttPubQueue *queue = &links[linkID].queue;
+  mqtt_pub_record_t rec;
+  const char *topic;
+  const uint8_t *data;
+  mqtt_status_t status;
+
+  while (isConnected(linkID)) {
+    // Urgent messages get their turn between the bulk messages.
+    flushUrgent(laneSched == MQTT_SCHED_STRICT ? UINT32_MAX : laneWeight);
+    if (!queue->peek(&rec, &topic, &data))
+      break;
+
+    mqtt_buffer_t seg = { data, rec.dataLen };
+
+    status = sendPublish(rec.type, linkID, topic, &seg, 1, rec.qos,
+                         rec.retain);
+    checkLinkStatus(linkID, status);
+    if (status == ESP_AT_SUB_CMD_TIMEOUT ||
+        status == ESP_AT_SUB_CMD_RATE_LIMITED ||
+        MQTT_ERROR(status) == AT_MQTT_IN_DISCONNECTED_STATE) {
+      break;
+    }
+    if (status != ESP_AT_SUB_OK)
+      dprintf("Dropping queued message, error %08x\n", status);
+    queue->pop();
   }
-  return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
 }
 
 /*******************************************************************************
  *
- * Enables the internal NTP Time client. Up to 3 different time servers can
- * be specified to support quick multi regional time resolution. If no external
- * time servers are specified on of the following time servers will be used
- * instead:<br>
- *   - “cn.ntp.org.cn”
- *   - “ntp.sjtu.edu.cn”
- *   - “us.pool.ntp.org”
+ * Sends up to max messages from the urgent lane. The lane is sent in order,
+ * so it stops at a message for a link that is down.
  *
- * When using a secure connection mechanism (TLS) the NTP client can be used
- * to acquire the current date and time which is required by the TLS protocol.
- * When the time has been acquired from a time server a call back is
- * generated and the connection to the mqtt server can be made.
+ ******************************************************************************/
+void EspATMQTT::flushUrgent(uint32_t max) {
+  mqtt_pub_record_t rec;
+  const char *topic;
+  const uint8_t *data;
+  mqtt_status_t status;
+
+  while (max-- && urgentLane.peek(&rec, &topic, &data)) {
+    if (rec.linkID >= MQTT_MAX_LINKS || !isConnected(rec.linkID))
+      break;
+
+    mqtt_buffer_t seg = { data, rec.dataLen };
+    status = sendPublish(rec.type, rec.linkID, topic, &seg, 1, rec.qos,
+                         rec.retain);
+    checkLinkStatus(rec.linkID, status);
+    if (status == ESP_AT_SUB_CMD_TIMEOUT ||
+        status == ESP_AT_SUB_CMD_RATE_LIMITED ||
+        MQTT_ERROR(status) == AT_MQTT_IN_DISCONNECTED_STATE) {
+      break;
+    }
+    if (status != ESP_AT_SUB_OK)
+      dprintf("Dropping urgent message, error %08x\n", status);
+    urgentLane.pop();
+  }
+}
+
+/*******************************************************************************
  *
- * @param[in] - enable
- *      Enable or disable the NTP client. A "0" in this parameter will disable
- *      the client completely and a "1" is required if the NTP client should
- *      be enabled.
+ * Replays the pending messages of the journal for as long as their link is up
+ * and the replay rate of the journal allows it. Messages that could not be
+ * sent because of a timeout or a lost connection are kept in the journal.
+ * The journal is shared by all links and is replayed in order, so a message
+ * for a link that is down holds back the messages behind it.
  *
- * @param[in] - cb
+ ******************************************************************************/
+void EspATMQTT::replayJournal() {
+  mqtt_pub_record_t rec;
+  const char *topic;
+  const uint8_t *data;
+  mqtt_status_t status;
+
+  while (true) {
+    flushUrgent(laneSched == MQTT_SCHED_STRICT ? UINT32_MAX : laneWeight);
+    if (!pubJournal->peek(&rec, &topic, &data))
+      break;
+    if (rec.linkID >= MQTT_MAX_LINKS) {
+      dprintf("Dropping journaled message for link %d\n", rec.linkID);
+      pubJournal->pop();
+      continue;
+    }
+    // The queue of the link holds older messages than the journal.
+    if (!isConnected(rec.linkID) || !links[rec.linkID].queue.isEmpty())
+      break;
+    if (!pubJournal->replayCredit(rec.dataLen, millis()))
+      break;
+
+    mqtt_buffer_t seg = { data, rec.dataLen };
+    status = sendPublish(rec.type, rec.linkID, topic, &seg, 1, rec.qos,
+                         rec.retain);
+    checkLinkStatus(rec.linkID, status);
+    if (status == ESP_AT_SUB_CMD_TIMEOUT ||
+        status == ESP_AT_SUB_CMD_RATE_LIMITED ||
+        MQTT_ERROR(status) == AT_MQTT_IN_DISCONNECTED_STATE) {
+      break;
+    }
+    if (status == ESP_AT_SUB_OK)
+      pubJournal->replayed(rec.dataLen);
+    else
+      dprintf("Dropping journaled message, error %08x\n", status);
+    pubJournal->pop();
+  }
+}
+
+/*******************************************************************************
+ *
+ * Registers a raw publish that has been sent in the in-flight window. QoS 1
+ * and 2 messages are retained in the window memory so they can be resent if
+ * they fail, QoS 0 messages only need a place in the window so that the
+ * +MQTTPUB:OK/FAIL replies can be matched to the right message.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::trackInflight(uint32_t linkID, const char *topic,
+                         const mqtt_buffer_t *bufs, size_t count,
+                         uint32_t qos, uint32_t retain, uint8_t retries) {
+  mqtt_pub_record_t rec;
+
+  rec.linkID = linkID;
+  rec.qos = qos;
+  rec.retain = retain;
+  rec.type = MQTT_PUB_TYPE_RAW;
+  // pubRawSegments() made sure there is room before the message was sent, an
+  // untracked message would have its reply credited to the wrong message.
+  if (inflight.count() >= INFLIGHT_SLOTS ||
+      !inflight.push(&rec, topic, bufs, qos ? count : 0)) {
+    dprintf("In-flight window full, publish not tracked\n", NULL);
+    return ESP_AT_SUB_CMD_WINDOW_FULL;
+  }
+
+  mqtt_inflight_t *m = &inflightMeta[(inflightHead + inflight.count() - 1) % INFLIGHT_SLOTS];
+  m->sentAt = millis();
+  m->state = INFLIGHT_SENT;
+  m->retries = retries;
+  // The reply to this message completes the handle of publishAsync().
+  m->handle = pubHandle;
+  pubHandle = MQTT_PUB_HANDLE_NONE;
+
+  return ESP_AT_SUB_OK;
+}
+
+/*******************************************************************************
+ *
+ * Waits until there is room in the in-flight window, and in its memory area,
+ * for one more message. Replies to earlier messages are collected while
+ * waiting. A message that does not fit even in an empty window is rejected
+ * at once.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::waitInflightWindow(const char *topic, size_t dataLen) {
+  uint32_t to = millis();
+  uint32_t timeout = budget(pubTimeout, AT_PHASE_WINDOW);
+
+  serviceInflight();
+  while (inflight.count() >= inflightWindow || !inflight.fits(topic, dataLen)) {
+    if (inflight.isEmpty())
+      return ESP_AT_SUB_CMD_WINDOW_FULL;
+    if (millis() - to >= timeout)
+      return ESP_AT_SUB_CMD_TIMEOUT;
+    processUrc();
+    serviceInflight();
+    yield();
+  }
+  return ESP_AT_SUB_OK;
+}
+
+/*******************************************************************************
+ *
+ * Retires the messages at the head of the in-flight window that have been
+ * acknowledged or have failed. A failed, or timed out, QoS 1/2 message is
+ * resent from the retained copy until it has used up all its retries. The
+ * resent message is placed last in the window as its reply will arrive
+ * after the replies of the messages already sent.
+ *
+ ******************************************************************************/
+void EspATMQTT::serviceInflight() {
+  mqtt_pub_record_t rec;
+  const char *topic;
+  const uint8_t *data;
+
+  if (inflightBusy)
+    return;
+  inflightBusy = true;
+
+  while (inflight.peek(&rec, &topic, &data)) {
+    mqtt_inflight_t *m = &inflightMeta[inflightHead];
+
+    mqtt_status_t failure = ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_FAILED_TO_PUBLISH_RAW;
+
+    if (m->state == INFLIGHT_SENT) {
+      if (millis() - m->sentAt < pubTimeout)
+        break;
+      dprintf("Publish on '%s' timed out\n", topic);
+      m->state = INFLIGHT_FAILED;
+      failure = ESP_AT_SUB_CMD_TIMEOUT;
+      // The reply may still come, ahead of the replies to later messages.
+      if (isConnected(rec.linkID))
+        inflightLate++;
+    }
+
+    if (m->state == INFLIGHT_ACKED) {
+      pubStats.ackCount++;
+    } else if (rec.qos && m->retries < inflightRetries && isConnected(rec.linkID)) {
+      mqtt_buffer_t seg = { data, rec.dataLen };
+      uint8_t retries = m->retries + 1;
+      mqtt_pub_handle_t outer = pubHandle;
+      mqtt_status_t status;
+
+      // The handle follows the message to its new place in the window.
+      pubHandle = m->handle;
+      pubStats.retryCount++;
+      status = pubRawSegments(rec.linkID, topic, &seg, 1, rec.dataLen, rec.qos,
+                              rec.retain, retries);
+      if (status != ESP_AT_SUB_OK)
+        pubStats.failCount++;
+      if (pubHandle != MQTT_PUB_HANDLE_NONE)
+        completePublish(pubHandle, status);
+      pubHandle = outer;
+    } else {
+      pubStats.failCount++;
+      completePublish(m->handle, failure);
+    }
+    inflight.pop();
+    inflightHead = (inflightHead + 1) % INFLIGHT_SLOTS;
+  }
+
+  inflightBusy = false;
+}
+
+/*******************************************************************************
+ *
+ * Handles a +MQTTPUB:OK/FAIL reply. The ESP-AT device sends the replies in the
+ * same order as the messages were sent, so the reply belongs to the oldest
+ * message in the window that is still waiting for one. Replies owed to
+ * messages that have already timed out come first and are dropped.
+ *
+ ******************************************************************************/
+void EspATMQTT::pubAck(bool ok) {
+  if (inflightLate) {
+    dprintf("Late publish reply dropped\n", NULL);
+    inflightLate--;
+    return;
+  }
+  for (size_t i = 0; i < inflight.count(); i++) {
+    mqtt_inflight_t *m = &inflightMeta[(inflightHead + i) % INFLIGHT_SLOTS];
+    if (m->state == INFLIGHT_SENT) {
+      m->state = ok ? INFLIGHT_ACKED : INFLIGHT_FAILED;
+      // A failed message may still be resent, its handle is completed when
+      // the message leaves the window.
+      if (ok) {
+        completePublish(m->handle, ESP_AT_SUB_OK);
+        m->handle = MQTT_PUB_HANDLE_NONE;
+      }
+      return;
+    }
+  }
+  dprintf("Unexpected publish reply\n", NULL);
+}
+
+/*******************************************************************************
+ *
+ * URC handler installed in the AT_Class, see #at_urc_cb_t.
+ *
+ ******************************************************************************/
+bool EspATMQTT::urcHandler(void *ctx, const char *line) {
+  return ((EspATMQTT *)ctx)->handleUrcLine(line);
+}
+
+/*******************************************************************************
+ *
+ * Takes care of the URCs that can show up in the middle of a command reply.
+ *
+ * @return - true if the line was handled.
+ *
+ ******************************************************************************/
+bool EspATMQTT::handleUrcLine(const char *line) {
+  if (!strncmp(line, MQTT_RESP_DISCONNECTED, strlen(MQTT_RESP_DISCONNECTED))) {
+    uint32_t linkID = strtol(line + strlen(MQTT_RESP_DISCONNECTED), NULL, 10);
+
+    dprintf("Received URC: %s\n", line);
+    if (linkID < MQTT_MAX_LINKS)
+      connectionLost(linkID);
+    return true;
+  }
+  if ((!inflight.isEmpty() || inflightLate) &&
+      !strncmp(line, MQTT_STRING_MQTTPUB, strlen(MQTT_STRING_MQTTPUB))) {
+    pubAck(strstr(line, "OK") != NULL);
+    return true;
+  }
+  return false;
+}
+
+/*******************************************************************************
+ *
+ * Internal worker for all the raw publish methods. Sends the +MQTTPUBRAW
+ * command with the total length, waits for the prompt and then writes each
+ * segment straight from the callers buffers to the serial port.
+ * If in-flight tracking is enabled the method returns as soon as the data
+ * has been sent and the +MQTTPUB:OK/FAIL is handled later, otherwise it
+ * waits for the result.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::pubRawSegments(uint32_t linkID, const char *topic,
+                         const mqtt_buffer_t *bufs, size_t count, size_t len,
+                         uint32_t qos, uint32_t retain, uint8_t retries) {
+  mqtt_status_t status;
+
+  // Never send a message the in-flight window can not follow.
+  if (inflight.isEnabled() && (inflight.count() >= INFLIGHT_SLOTS ||
+                               !inflight.fits(topic, qos ? len : 0)))
+    return ESP_AT_SUB_CMD_WINDOW_FULL;
+
+  snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\",%u,%d,%d", linkID, topic,
+           (unsigned int)len, qos, retain);
+  status = _at->sendCommand(MQTT_CMD_PUBRAW, buff, NULL);
+  if (status != ESP_AT_SUB_OK) {
+    return status;
+  }
+  status = _at->waitPrompt(promptTimeout);
+  if (status != ESP_AT_SUB_OK) {
+    return status;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (bufs[i].len)
+      _at->sendString((const char *)bufs[i].data, bufs[i].len);
+  }
+
+  if (inflight.isEnabled())
+    return trackInflight(linkID, topic, bufs, count, qos, retain, retries);
+
+  status = _at->waitString(MQTT_STRING_MQTTPUB, pubTimeout);
+  if (status != ESP_AT_SUB_OK) {
+    return status;
+  }
+
+  char *lBuff = _at->getBuff();
+  if (strstr(lBuff, "FAIL")) {
+    return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_FAILED_TO_PUBLISH_RAW;
+  }
+  return ESP_AT_SUB_OK;
+}
+
+/*******************************************************************************
+ *
+ * Publish a string to a specified topic using the cheapest transport.
+ * See the length explicit #publish() method for a description of how the
+ * transport is selected.
+ *
+ * @param[in] - linkID
+ *      The link ID used for this connection. Only linkID 0 is currently
+ *      supported by the ESP-AT stack.<br>Using the library DEFAULT_LINK_ID will
+ *      make it easy to migrate if this changes in the future.
+ *
+ * @param[in] - topic
+ *      The topic where the message shold be published.
+ *
+ * @param[in] - data
+ *      The '\0' terminated message that should be published. It should not
+ *      be escaped by the caller.
+ *
+ * @param[in] - qos
+ *      The Quality of Service value that should be used for this message.<br>
+ *      See #pubString() for a description of the different levels.
+ *
+ * @param[in] - retain
+ *      A retained message is a normal MQTT message with the retained flag set
+ *      to true (= 1). See #mqtt_retain_e for more details.
+ *
+ * @param[in] - priority
+ *      MQTT_PRIORITY_URGENT messages are sent ahead of queued bulk messages,
+ *      see #mqtt_priority_e and #enableUrgentLane().
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.<br>
+ *      <b>Note:</b> when a publish queue, journal or urgent lane is enabled
+ *      a message that is held back returns ESP_AT_SUB_CMD_QUEUED, which is
+ *      not ESP_AT_SUB_OK. Use MQTT_PUB_ACCEPTED() to test for both.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::publish(uint32_t linkID, const char *topic,
+                         const char *data, uint32_t qos, uint32_t retain,
+                         mqtt_priority_t priority) {
+  return publish(linkID, topic, (const uint8_t *)data, strlen(data), qos,
+                 retain, priority);
+}
+
+/*******************************************************************************
+ *
+ * Publish data to a specified topic using the cheapest transport.
+ * Small payloads that only hold printable characters are escaped and sent
+ * inline with +MQTTPUB, which only needs one round trip to the ESP-AT device.
+ * Payloads larger than the threshold (see #setPublishThreshold()), payloads
+ * holding binary data and payloads that would not fit in one AT command line
+ * are sent with +MQTTPUBRAW instead. The chosen transport is recorded in the
+ * statistics returned by #getPublishStats().
+ *
+ * @param[in] - linkID
+ *      The link ID used for this connection. Only linkID 0 is currently
+ *      supported by the ESP-AT stack.<br>Using the library DEFAULT_LINK_ID will
+ *      make it easy to migrate if this changes in the future.
+ *
+ * @param[in] - topic
+ *      The topic where the message shold be published.
+ *
+ * @param[in] - data
+ *      Pointer to the message that should be published. It should not be
+ *      escaped by the caller.
+ *
+ * @param[in] - len
+ *      The number of bytes to publish.
+ *
+ * @param[in] - qos
+ *      The Quality of Service value that should be used for this message.<br>
+ *      See #pubString() for a description of the different levels.
+ *
+ * @param[in] - retain
+ *      A retained message is a normal MQTT message with the retained flag set
+ *      to true (= 1). See #mqtt_retain_e for more details.
+ *
+ * @param[in] - priority
+ *      MQTT_PRIORITY_URGENT messages are sent ahead of queued bulk messages,
+ *      see #mqtt_priority_e and #enableUrgentLane().
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.<br>
+ *      <b>Note:</b> when a publish queue, journal or urgent lane is enabled
+ *      a message that is held back returns ESP_AT_SUB_CMD_QUEUED, which is
+ *      not ESP_AT_SUB_OK. Use MQTT_PUB_ACCEPTED() to test for both.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::publish(uint32_t linkID, const char *topic,
+                         const uint8_t *data, size_t len, uint32_t qos,
+                         uint32_t retain, mqtt_priority_t priority) {
+  mqtt_buffer_t seg = { data, len };
+
+  return submitPublish(MQTT_PUB_TYPE_AUTO, linkID, topic, &seg, 1, qos, retain,
+                       priority);
+}
+
+/*******************************************************************************
+ *
+ * Enables the publish queue. When the queue is enabled, messages published
+ * while the client is disconnected are stored in the queue instead of being
+ * rejected. The queue is sent, in order, by the #process() method as soon as
+ * the connection is up again. The publish methods return
+ * ESP_AT_SUB_CMD_QUEUED for messages that were put in the queue. This is
+ * not ESP_AT_SUB_OK, so a sketch that compares the status of a publish with
+ * ESP_AT_SUB_OK should use MQTT_PUB_ACCEPTED() once the queue is enabled.
+ *
+ * @param[in] - arena
+ *      A caller provided memory area that holds the queued messages. It must
+ *      stay valid for as long as the queue is enabled. No heap memory is used.
+ *      Passing NULL disables the queue and discards all queued messages.
+ *
+ * @param[in] - size
+ *      The size of the memory area in bytes.
+ *
+ * @param[in] - policy
+ *      What to do when the queue is full, see #mqtt_queue_policy_e.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::enablePublishQueue(uint8_t *arena, size_t size,
+                                            mqtt_queue_policy_t policy) {
+  return enablePublishQueue(DEFAULT_LINK_ID, arena, size, policy);
+}
+
+/*******************************************************************************
+ *
+ * Enables the publish queue of a specific link. Each link has its own queue
+ * so a link that is down does not hold back the messages of the other links.
+ *
+ * @param[in] - linkID
+ *      The link that the queue is used for.
+ *
+ * @param[in] - arena
+ *      A caller provided memory area that holds the queued messages. It must
+ *      stay valid for as long as the queue is enabled. No heap memory is used.
+ *      Passing NULL disables the queue and discards all queued messages.
+ *
+ * @param[in] - size
+ *      The size of the memory area in bytes.
+ *
+ * @param[in] - policy
+ *      What to do when the queue is full, see #mqtt_queue_policy_e.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::enablePublishQueue(uint32_t linkID, uint8_t *arena,
+                                            size_t size,
+                                            mqtt_queue_policy_t policy) {
+  if (linkID >= MQTT_MAX_LINKS)
+    return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_LINK_ID_VALUE_IS_WRONG;
+
+  links[linkID].queue.begin(arena, size, policy);
+  if (arena && !links[linkID].queue.isEnabled())
+    return ESP_AT_SUB_PARA_INVALID;
+  return ESP_AT_SUB_OK;
+}
+
+/*******************************************************************************
+ *
+ * Attaches a persistent journal for messages published while the client is
+ * disconnected. Messages in the journal survive a reboot of the system and
+ * are replayed, in order, by the #process() method once the connection is up,
+ * at the replay rate set with MqttJournal::setReplayRate(). When a journal is
+ * attached it takes precedence over the publish queue for new messages.
+ *
+ * @param[in] - journal
+ *      A journal that has been started with MqttJournal::begin(), or NULL to
+ *      detach the journal.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::enableJournal(MqttJournal *journal) {
+  if (journal && !journal->isEnabled())
+    return ESP_AT_SUB_PARA_INVALID;
+  pubJournal = journal;
+  return ESP_AT_SUB_OK;
+}
+
+/*******************************************************************************
+ *
+ * Attaches a last value cache. Every message received is stored in the
+ * cache before it is handed to its callback, so the latest value of a topic
+ * can be read at any time with MqttValueCache::read(), also from another
+ * core, without copying it in the callback.
+ *
+ * @param[in] - cache
+ *      A cache that has been started with MqttValueCache::begin(), or NULL to
+ *      detach the cache.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::enableValueCache(MqttValueCache *cache) {
+  if (cache && !cache->slots())
+    return ESP_AT_SUB_PARA_INVALID;
+  valueCache = cache;
+  return ESP_AT_SUB_OK;
+}
+
+/*******************************************************************************
+ *
+ * Attaches a duplicate filter to the received messages. A message that the
+ * filter has seen recently, like a QoS 1 message the broker sends again after
+ * a reconnect, is dropped before it reaches the value cache or a callback.
+ * See #MqttDedup for how messages are compared.
+ *
+ * A filter without a key function compares whole payloads, so a message
+ * that is genuinely sent again with the same payload within the max age of
+ * the filter is dropped too. Such a filter must have a max age, otherwise
+ * a repeated command would be lost for as long as it stays in the window.
+ * Give the filter a key function if the messages carry a sequence number.
+ *
+ * @param[in] - dedup
+ *      The filter, or NULL to deliver every message.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information. ESP_AT_SUB_PARA_INVALID if the
+ *      filter has neither a key function nor a max age.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::enableDedup(MqttDedup *dedup) {
+  if (dedup && !dedup->hasKey() && !dedup->getMaxAge())
+    return ESP_AT_SUB_PARA_INVALID;
+  this->dedup = dedup;
+  return ESP_AT_SUB_OK;
+}
+
+/*******************************************************************************
+ *
+ * Enables the urgent lane. Urgent messages, see #publish(), that can not be
+ * sent at once are kept here instead of behind the bulk messages in the
+ * publish queue and journal. Queued urgent messages are sent before queued
+ * bulk messages, at the boundary between two commands, as set with
+ * #setLaneScheduling(). A message that is already being sent is never
+ * interrupted.
+ *
+ * @param[in] - arena
+ *      A caller provided memory area that holds the urgent messages. Passing
+ *      NULL disables the lane.
+ *
+ * @param[in] - size
+ *      The size of the memory area in bytes.
+ *
+ * @param[in] - policy
+ *      What to do when the lane is full, see #mqtt_queue_policy_e.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::enableUrgentLane(uint8_t *arena, size_t size,
+                                          mqtt_queue_policy_t policy) {
+  urgentLane.begin(arena, size, policy);
+  if (arena && !urgentLane.isEnabled())
+    return ESP_AT_SUB_PARA_INVALID;
+  return ESP_AT_SUB_OK;
+}
+
+/*******************************************************************************
+ *
+ * Selects how queued urgent and bulk messages share the link. With strict
+ * priority every queued urgent message is sent before the next bulk message.
+ * With weighted scheduling up to weight urgent messages are sent between two
+ * bulk messages so a steady stream of urgent messages can not starve the bulk
+ * traffic completely.
+ *
+ * @param[in] - mode
+ *      MQTT_SCHED_STRICT or MQTT_SCHED_WEIGHTED, see #mqtt_sched_e.
+ *
+ * @param[in] - weight
+ *      The number of urgent messages per bulk message in weighted mode.
+ *
+ ******************************************************************************/
+void EspATMQTT::setLaneScheduling(mqtt_sched_t mode, uint32_t weight) {
+  laneSched = mode;
+  laneWeight = weight ? weight : 1;
+}
+
+/*******************************************************************************
+ *
+ * Enables in-flight tracking of raw publishes. Without tracking, each raw
+ * publish waits for the +MQTTPUB:OK/FAIL reply before returning. With
+ * tracking the publish returns as soon as the data is sent and the reply is
+ * collected later, so more messages can be sent while earlier ones are still
+ * pending. QoS 1 and 2 messages are retained in the window and resent if the
+ * reply is FAIL or does not arrive within the publish timeout.
+ *
+ * Note that the ESP-AT device does not number its replies, they are matched
+ * to the messages in the order they were sent. A reply that arrives after
+ * its message has timed out is recognised as late and dropped, unless the
+ * link was lost in between. A message is only sent when there is room to
+ * track it, otherwise the publish waits for room or, if the message is too
+ * large for the memory area, fails with ESP_AT_SUB_CMD_WINDOW_FULL.
+ *
+ * @param[in] - arena
+ *      A caller provided memory area that holds the retained messages. It must
+ *      stay valid for as long as tracking is enabled. Passing NULL disables
+ *      the tracking.
+ *
+ * @param[in] - size
+ *      The size of the memory area in bytes. It should hold the number of
+ *      messages in the window plus one, a failed message is copied to the
+ *      end of the window before its old place is freed.
+ *
+ * @param[in] - window
+ *      The max number of messages waiting for a reply. When the window is
+ *      full the next publish waits for room. Max MQTT_INFLIGHT_MAX.
+ *
+ * @param[in] - retries
+ *      The number of times a failed QoS 1/2 message is resent.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::enableInflight(uint8_t *arena, size_t size,
+                                        uint32_t window, uint32_t retries) {
+  if (window < 1 || window > MQTT_INFLIGHT_MAX)
+    return ESP_AT_SUB_PARA_INVALID;
+
+  inflight.begin(arena, size, MQTT_QUEUE_DROP_NEWEST);
+  inflightHead = 0;
+  inflightWindow = window;
+  inflightRetries = retries;
+  inflightLate = 0;
+  if (arena && !inflight.isEnabled())
+    return ESP_AT_SUB_PARA_INVALID;
+  return ESP_AT_SUB_OK;
+}
+
+/*******************************************************************************
+ *
+ * Enables a coalescing batch for a topic. Records added with #batch() are
+ * collected in the buffer and published together as one message with
+ * +MQTTPUBRAW when the buffer is full or the oldest record has waited
+ * maxLatency milliseconds, which saves a full publish round trip and the
+ * topic bytes for every record but the first.
+ *
+ * @param[in] - linkID
+ *      The link the batch is published on.
+ *
+ * @param[in] - topic
+ *      The topic of the batch. The string is not copied and must stay valid
+ *      for as long as the batch is enabled.
+ *
+ * @param[in] - buffer
+ *      A caller provided buffer where the records are collected, it sets the
+ *      max size of a published batch. Passing NULL publishes what is left in
+ *      the batch and disables it.
+ *
+ * @param[in] - size
+ *      The size of the buffer in bytes.
+ *
+ * @param[in] - format
+ *      How the records are framed, see #mqtt_batch_format_e. JSON arrays
+ *      expect each record to be a valid JSON value.
+ *
+ * @param[in] - maxLatency
+ *      The max time in milliseconds a record waits before the batch is
+ *      published. The batches are checked by #process().
+ *
+ * @param[in] - qos
+ *      The Quality of Service used when the batch is published.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::enableBatch(uint32_t linkID, const char *topic,
+                                     uint8_t *buffer, size_t size,
+                                     mqtt_batch_format_t format,
+                                     uint32_t maxLatency, uint32_t qos) {
+  if (linkID >= MQTT_MAX_LINKS)
+    return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_LINK_ID_VALUE_IS_WRONG;
+
+  mqtt_batch_t *b = findBatch(linkID, topic);
+
+  if (b) {
+    mqtt_status_t status = sendBatch(b);
+    if (status != ESP_AT_SUB_OK && status != ESP_AT_SUB_CMD_QUEUED)
+      return status;
+    if (!buffer) {
+      b->topic = NULL;
+      return ESP_AT_SUB_OK;
+    }
+  } else {
+    if (!buffer)
+      return ESP_AT_SUB_OK;
+    for (uint32_t i = 0; i < MQTT_MAX_BATCHES && !b; i++) {
+      if (!batches[i].topic)
+        b = &batches[i];
+    }
+    if (!b)
+      return ESP_AT_SUB_CMD_QUEUE_FULL;
+  }
+
+  if (size < 3 || size > 0xffff || qos > 2)
+    return ESP_AT_SUB_PARA_INVALID;
+
+  b->topic = topic;
+  b->buffer = buffer;
+  b->size = size;
+  b->fill = 0;
+  b->records = 0;
+  b->maxLatency = maxLatency;
+  b->linkID = linkID;
+  b->qos = qos;
+  b->format = format;
+  return ESP_AT_SUB_OK;
+}
+
+/*******************************************************************************
+ *
+ * Adds a '\0' terminated record to the batch of a topic.
+ * See the length explicit #batch() method for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::batch(uint32_t linkID, const char *topic,
+                               const char *data) {
+  return batch(linkID, topic, (const uint8_t *)data, strlen(data));
+}
+
+/*******************************************************************************
+ *
+ * Adds a record to the batch of a topic. If the record does not fit, the
+ * batch is published first. A record too large for the buffer on its own is
+ * published as a batch of one. Topics without a batch are published
+ * directly with #publish().
+ *
+ * @param[in] - linkID
+ *      The link the record is published on.
+ *
+ * @param[in] - topic
+ *      The topic of the record.
+ *
+ * @param[in] - data
+ *      The record data.
+ *
+ * @param[in] - len
+ *      The number of bytes in the record.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information. ESP_AT_SUB_CMD_QUEUED means
+ *      that the record is waiting in the batch. A length prefixed record
+ *      longer than 65535 bytes gives ESP_AT_SUB_PARA_INVALID.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::batch(uint32_t linkID, const char *topic,
+                               const uint8_t *data, size_t len) {
+  mqtt_batch_t *b = findBatch(linkID, topic);
+  mqtt_status_t status;
+  size_t need;
+
+  if (!b)
+    return publish(linkID, topic, data, len);
+
+  // The length prefix is two bytes.
+  if (b->format != MQTT_BATCH_JSON_ARRAY && len > 0xffff)
+    return ESP_AT_SUB_PARA_INVALID;
+
+  // A JSON record needs a ',' or '[' before it and room for the closing
+  // ']', a length prefixed record needs its two length bytes.
+  need = len + 2;
+  if (b->fill + need > b->size) {
+    status = sendBatch(b);
+    if (status != ESP_AT_SUB_OK && status != ESP_AT_SUB_CMD_QUEUED)
+      return status;
+  }
+
+  if (need > b->size) {
+    mqtt_buffer_t segs[3];
+    uint8_t head[2];
+    uint8_t tail = ']';
+    size_t count = 0;
+
+    if (b->format == MQTT_BATCH_JSON_ARRAY) {
+      head[0] = '[';
+      segs[count++] = { head, 1 };
+      segs[count++] = { data, len };
+      segs[count++] = { &tail, 1 };
+    } else {
+      head[0] = len >> 8;
+      head[1] = len & 0xff;
+      segs[count++] = { head, 2 };
+      segs[count++] = { data, len };
+    }
+    pubStats.batchCount++;
+    pubStats.batchRecords++;
+    return pubRaw(linkID, topic, segs, count, b->qos);
+  }
+
+  if (!b->records)
+    b->firstAt = millis();
+  if (b->format == MQTT_BATCH_JSON_ARRAY) {
+    b->buffer[b->fill++] = b->records ? ',' : '[';
+  } else {
+    b->buffer[b->fill++] = len >> 8;
+    b->buffer[b->fill++] = len & 0xff;
+  }
+  memcpy(&b->buffer[b->fill], data, len);
+  b->fill += len;
+  b->records++;
+
+  // No room for another record, send it right away.
+  if (b->fill + 3 > b->size)
+    return sendBatch(b);
+  return ESP_AT_SUB_CMD_QUEUED;
+}
+
+/*******************************************************************************
+ *
+ * Publishes the records waiting in the batch of a topic.
+ *
+ * @param[in] - linkID
+ *      The link of the batch.
+ *
+ * @param[in] - topic
+ *      The topic of the batch.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::flushBatch(uint32_t linkID, const char *topic) {
+  mqtt_batch_t *b = findBatch(linkID, topic);
+
+  if (!b)
+    return ESP_AT_SUB_PARA_INVALID;
+  return sendBatch(b);
+}
+
+/*******************************************************************************
+ *
+ * Publishes the records waiting in all batches, for instance before going
+ * to sleep.
+ *
+ ******************************************************************************/
+void EspATMQTT::flushBatches() {
+  for (uint32_t i = 0; i < MQTT_MAX_BATCHES; i++) {
+    if (batches[i].topic)
+      sendBatch(&batches[i]);
+  }
+}
+
+mqtt_batch_t *EspATMQTT::findBatch(uint32_t linkID, const char *topic) {
+  for (uint32_t i = 0; i < MQTT_MAX_BATCHES; i++) {
+    if (batches[i].topic && batches[i].linkID == linkID &&
+        !strcmp(batches[i].topic, topic))
+      return &batches[i];
+  }
+  return NULL;
+}
+
+/*******************************************************************************
+ *
+ * Publishes a batch with +MQTTPUBRAW. The batch is emptied even if the
+ * publish fails, a failed batch is dropped like a failed single message
+ * would be. Queued and journaled batches are copied so the buffer can be
+ * reused at once.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::sendBatch(mqtt_batch_t *b) {
+  mqtt_status_t status;
+
+  if (!b->records)
+    return ESP_AT_SUB_OK;
+  if (b->format == MQTT_BATCH_JSON_ARRAY)
+    b->buffer[b->fill++] = ']';
+
+  pubStats.batchCount++;
+  pubStats.batchRecords += b->records;
+  status = pubRaw(b->linkID, b->topic, b->buffer, b->fill, b->qos);
+  if (status != ESP_AT_SUB_OK && status != ESP_AT_SUB_CMD_QUEUED)
+    dprintf("Failed to publish batch on '%s', error %08x\n", b->topic, status);
+  b->fill = 0;
+  b->records = 0;
+  return status;
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of raw publishes waiting for a reply.
+ *
+ * @return - The number of messages in the in-flight window.
+ *
+ ******************************************************************************/
+size_t EspATMQTT::inflightPublishes() {
+  return inflight.count();
+}
+
+/*******************************************************************************
+ *
+ * Publish a '\0' terminated string without waiting for the result, see the
+ * binary version of #publishAsync().
+ *
+ ******************************************************************************/
+mqtt_pub_handle_t EspATMQTT::publishAsync(uint32_t linkID, const char *topic,
+                         const char *data, uint32_t qos, uint32_t retain) {
+  return publishAsync(linkID, topic, (const uint8_t *)data, strlen(data), qos,
+                      retain);
+}
+
+/*******************************************************************************
+ *
+ * Publish data with +MQTTPUBRAW and return a handle that tells when the
+ * ESP-AT device has replied with +MQTTPUB:OK or FAIL. With an in-flight
+ * window (see #enableInflight()) the method returns as soon as the data has
+ * been sent and the handle completes when the reply arrives, or when the
+ * message has failed after all its retries. Without one the reply is
+ * waited for here and the handle is already complete.
+ *
+ * The message is sent right away, it is never put in the publish queue or
+ * the journal. If it can not be sent, for instance because the link is down,
+ * the handle completes at once with the error.
+ *
+ * The result is read with #publishDone() or #waitPublish(), or delivered to
+ * a callback set with #onPublishDone(). A handle without a callback must be
+ * given back with #releasePublish().
+ *
+ * @param[in] - linkID
+ *      The link ID used for this connection.
+ *
+ * @param[in] - topic
+ *      The topic where the message shold be published.
+ *
+ * @param[in] - data
+ *      Pointer to the message that should be published.
+ *
+ * @param[in] - len
+ *      The number of bytes to publish.
+ *
+ * @param[in] - qos
+ *      The Quality of Service value that should be used for this message.
+ *
+ * @param[in] - retain
+ *      The retain flag of the message, see #mqtt_retain_e.
+ *
+ * @return - The handle of the publish, or MQTT_PUB_HANDLE_NONE if all
+ *      MQTT_PUB_HANDLES handles are in use. The message is then not sent.
+ *
+ ******************************************************************************/
+mqtt_pub_handle_t EspATMQTT::publishAsync(uint32_t linkID, const char *topic,
+                         const uint8_t *data, size_t len, uint32_t qos,
+                         uint32_t retain) {
+  mqtt_buffer_t seg = { data, len };
+  mqtt_pub_handle_t handle;
+  mqtt_pub_slot_t *slot = NULL;
+  mqtt_status_t status;
+  uint32_t ix;
+
+  for (ix = 0; ix < MQTT_PUB_HANDLES; ix++) {
+    if (pubSlots[ix].state == PUB_SLOT_FREE) {
+      slot = &pubSlots[ix];
+      break;
+    }
+  }
+  if (!slot)
+    return MQTT_PUB_HANDLE_NONE;
+
+  if (++slot->gen == 0)
+    slot->gen = 1;
+  slot->state = PUB_SLOT_PENDING;
+  slot->fn = NULL;
+  slot->ctx = NULL;
+  slot->sentAt = millis();
+  handle = PUB_HANDLE(ix, slot->gen);
+
+  if (linkID >= MQTT_MAX_LINKS) {
+    completePublish(handle, ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_LINK_ID_VALUE_IS_WRONG);
+    return handle;
+  }
+
+  pubHandle = handle;
+  status = sendPublish(MQTT_PUB_TYPE_RAW, linkID, topic, &seg, 1, qos, retain);
+  checkLinkStatus(linkID, status);
+  // Still set if the message did not end up in the in-flight window.
+  if (pubHandle != MQTT_PUB_HANDLE_NONE) {
+    pubHandle = MQTT_PUB_HANDLE_NONE;
+    completePublish(handle, status);
+  }
+
+  return handle;
+}
+
+/*******************************************************************************
+ *
+ * Installs one deadline for everything the following calls wait for, see
+ * AT_Class::setDeadline(). A publish, for instance, then returns by the
+ * deadline even though it waits for the prompt, the +MQTTPUB:OK and maybe
+ * room in the in-flight window, each with its own timeout. When a call
+ * returns ESP_AT_SUB_CMD_TIMEOUT, AtDeadline::overrunPhase() tells where
+ * the time went.
+ *
+ * @param[in] - deadline
+ *      The deadline, or NULL to remove it.
+ *
+ * @return - The deadline that was installed before.
+ *
+ ******************************************************************************/
+AtDeadline *EspATMQTT::setDeadline(AtDeadline *deadline) {
+  return _at->setDeadline(deadline);
+}
+
+/*******************************************************************************
+ *
+ * Cuts a timeout short at the installed deadline and enters a new phase.
+ *
+ ******************************************************************************/
+uint32_t EspATMQTT::budget(uint32_t timeout, at_phase_t phase) {
+  AtDeadline *deadline = _at->getDeadline();
+
+  if (!deadline)
+    return timeout;
+  return deadline->limit(timeout, phase);
+}
+
+/*******************************************************************************
+ *
+ * Returns the slot of a handle, or NULL if the handle has been released.
+ *
+ ******************************************************************************/
+mqtt_pub_slot_t *EspATMQTT::findPubSlot(mqtt_pub_handle_t handle) {
+  uint32_t ix = handle & 0xff;
+
+  if (handle == MQTT_PUB_HANDLE_NONE || ix >= MQTT_PUB_HANDLES)
+    return NULL;
+  if (pubSlots[ix].state == PUB_SLOT_FREE || pubSlots[ix].gen != (handle >> 8))
+    return NULL;
+  return &pubSlots[ix];
+}
+
+/*******************************************************************************
+ *
+ * Records the outcome of a publish. A callback is not called from here, as
+ * this may happen in the middle of an AT command, but from #process().
+ *
+ ******************************************************************************/
+void EspATMQTT::completePublish(mqtt_pub_handle_t handle, mqtt_status_t status) {
+  mqtt_pub_slot_t *slot = findPubSlot(handle);
+
+  if (!slot || slot->state != PUB_SLOT_PENDING)
+    return;
+  slot->status = status;
+  slot->latency = millis() - slot->sentAt;
+  slot->state = PUB_SLOT_DONE;
+}
+
+/*******************************************************************************
+ *
+ * Calls the callbacks of the completed publishes and releases their handles.
+ *
+ ******************************************************************************/
+void EspATMQTT::notifyPublishes() {
+  for (uint32_t ix = 0; ix < MQTT_PUB_HANDLES; ix++) {
+    mqtt_pub_slot_t *slot = &pubSlots[ix];
+
+    if (slot->state == PUB_SLOT_DONE && slot->fn) {
+      mqtt_pub_done_fn_t fn = slot->fn;
+
+      slot->state = PUB_SLOT_FREE;
+      fn(slot->ctx, PUB_HANDLE(ix, slot->gen), slot->status, slot->latency);
+    }
+  }
+}
+
+/*******************************************************************************
+ *
+ * Checks if a publish started with #publishAsync() has completed.
+ *
+ * @param[in] - handle
+ *      The handle of the publish.
+ *
+ * @param[out] - status
+ *      If not NULL, set to the status of the publish once it has completed.
+ *
+ * @param[out] - latency
+ *      If not NULL, set to the time in milliseconds from the moment the
+ *      message was sent until it completed.
+ *
+ * @return - true if the publish has completed. A handle that has been
+ *      released is reported as completed with ESP_AT_SUB_CMD_ERROR.
+ *
+ ******************************************************************************/
+bool EspATMQTT::publishDone(mqtt_pub_handle_t handle, mqtt_status_t *status,
+                            uint32_t *latency) {
+  mqtt_pub_slot_t *slot = findPubSlot(handle);
+
+  if (!slot) {
+    if (status)
+      *status = ESP_AT_SUB_CMD_ERROR;
+    return true;
+  }
+  if (slot->state != PUB_SLOT_DONE)
+    return false;
+  if (status)
+    *status = slot->status;
+  if (latency)
+    *latency = slot->latency;
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Waits for a publish started with #publishAsync() to complete. Replies to
+ * other messages are collected while waiting. The handle is still valid
+ * afterwards and must be released with #releasePublish().
+ *
+ * @param[in] - handle
+ *      The handle of the publish.
+ *
+ * @param[in] - timeout
+ *      The maximum time, in milliseconds, to wait.
+ *
+ * @param[out] - latency
+ *      If not NULL, set to the latency of the publish, see #publishDone().
+ *
+ * @return - The status of the publish, or ESP_AT_SUB_CMD_TIMEOUT if it did
+ *      not complete in time. See #mqtt_error_e and #status_code_e for more
+ *      information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::waitPublish(mqtt_pub_handle_t handle,
+                                     uint32_t timeout, uint32_t *latency) {
+  mqtt_status_t status;
+  uint32_t to = millis();
+
+  timeout = budget(timeout, AT_PHASE_PUBLISH);
+  while (!publishDone(handle, &status, latency)) {
+    if (millis() - to >= timeout)
+      return ESP_AT_SUB_CMD_TIMEOUT;
+    processUrc();
+    serviceInflight();
+    yield();
+  }
+  return status;
+}
+
+/*******************************************************************************
+ *
+ * Sets a callback that is called by #process() when a publish started with
+ * #publishAsync() has completed. The handle is released after the callback,
+ * it must not be used again. If the publish has already completed the
+ * callback is called by the next #process().
+ *
+ * @param[in] - handle
+ *      The handle of the publish.
+ *
+ * @param[in] - fn
+ *      The callback, see #mqtt_pub_done_fn_t.
+ *
+ * @param[in] - ctx
+ *      A pointer that is passed on to the callback.
+ *
+ * @return - false if the handle has already been released.
+ *
+ ******************************************************************************/
+bool EspATMQTT::onPublishDone(mqtt_pub_handle_t handle, mqtt_pub_done_fn_t fn,
+                              void *ctx) {
+  mqtt_pub_slot_t *slot = findPubSlot(handle);
+
+  if (!slot)
+    return false;
+  slot->ctx = ctx;
+  slot->fn = fn;
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Gives a handle back to the pool. A publish that has not completed is still
+ * sent and retried, but its outcome is no longer recorded.
+ *
+ * @param[in] - handle
+ *      The handle of the publish.
+ *
+ ******************************************************************************/
+void EspATMQTT::releasePublish(mqtt_pub_handle_t handle) {
+  mqtt_pub_slot_t *slot = findPubSlot(handle);
+
+  if (slot)
+    slot->state = PUB_SLOT_FREE;
+}
+
+/*******************************************************************************
+ *
+ * Sets the time allowed for the +MQTTPUB:OK/FAIL reply of a raw publish.
+ *
+ * @param[in] - timeout
+ *      The timeout in milliseconds. The default is MQTT_PUB_TIMEOUT.
+ *
+ ******************************************************************************/
+void EspATMQTT::setPublishTimeout(uint32_t timeout) {
+  pubTimeout = timeout;
+}
+
+/*******************************************************************************
+ *
+ * Sets the time allowed for the '>' prompt that the ESP-AT device sends when
+ * it is ready for the data of a raw publish.
+ *
+ * @param[in] - timeout
+ *      The timeout in milliseconds. The default is MQTT_PUB_PROMPT_TIMEOUT.
+ *
+ ******************************************************************************/
+void EspATMQTT::setPromptTimeout(uint32_t timeout) {
+  promptTimeout = timeout;
+}
+
+/*******************************************************************************
+ *
+ * Limits the rate of outbound messages with a pair of token buckets, one for
+ * messages and one for payload bytes. A message that exceeds the rate is put
+ * in the publish queue of its link, if there is one, and sent by #process()
+ * when there is credit for it. Without a queue the publish waits for credit,
+ * at most the publish timeout. Use #publishCredit() to check for credit
+ * without waiting.
+ *
+ * @param[in] - msgsPerSecond
+ *      The max number of messages per second, 0 for no limit.
+ *
+ * @param[in] - bytesPerSecond
+ *      The max number of payload bytes per second, 0 for no limit.
+ *
+ * @param[in] - autoTune
+ *      If true the rate is lowered when the ESP-AT device replies busy or a
+ *      publish times out, and raised back towards the configured rate as
+ *      messages go through without problems.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::setRateLimit(uint32_t msgsPerSecond,
+                                      uint32_t bytesPerSecond, bool autoTune) {
+  rateLimiter.begin(msgsPerSecond, bytesPerSecond);
+  rateLimiter.setAutoTune(autoTune);
+  return ESP_AT_SUB_OK;
+}
+
+/*******************************************************************************
+ *
+ * Checks, without waiting, if a message can be published right now without
+ * being held back by the rate limiter.
+ *
+ * @param[in] - len
+ *      The payload length of the message.
+ *
+ * @return - true if there is credit for the message.
+ *
+ ******************************************************************************/
+bool EspATMQTT::publishCredit(size_t len) {
+  return !rateLimiter.isEnabled() || rateLimiter.available(len, millis());
+}
+
+/*******************************************************************************
+ *
+ * Returns the time until the rate limiter has credit for a message.
+ *
+ * @param[in] - len
+ *      The payload length of the message.
+ *
+ * @return - The time in milliseconds, 0 if the message can be sent now.
+ *
+ ******************************************************************************/
+uint32_t EspATMQTT::publishWaitTime(size_t len) {
+  if (!rateLimiter.isEnabled())
+    return 0;
+  return rateLimiter.waitTime(len, millis());
+}
+
+/*******************************************************************************
+ *
+ * Waits until the rate limiter has credit for a message, at most the publish
+ * timeout. URCs are handled while waiting.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::waitPublishCredit(size_t len) {
+  uint32_t to = millis();
+  uint32_t timeout = budget(pubTimeout, AT_PHASE_CREDIT);
+
+  while (!rateLimiter.available(len, millis())) {
+    if (millis() - to >= timeout)
+      return ESP_AT_SUB_CMD_TIMEOUT;
+    processUrc();
+    yield();
+  }
+  return ESP_AT_SUB_OK;
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of messages waiting in the publish queues and the
+ * journal.
+ *
+ * @return - The number of queued messages.
+ *
+ ******************************************************************************/
+size_t EspATMQTT::queuedPublishes() {
+  size_t count = urgentLane.count() + (pubJournal ? pubJournal->pending() : 0);
+
+  for (uint32_t i = 0; i < MQTT_MAX_LINKS; i++)
+    count += links[i].queue.count();
+  return count;
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of messages that have been dropped by the publish queues
+ * and the journal because there was no room for them.
+ *
+ * @return - The number of dropped messages.
+ *
+ ******************************************************************************/
+uint32_t EspATMQTT::droppedPublishes() {
+  uint32_t drops = urgentLane.dropped() + (pubJournal ? pubJournal->dropped() : 0);
+
+  for (uint32_t i = 0; i < MQTT_MAX_LINKS; i++)
+    drops += links[i].queue.dropped();
+  return drops;
+}
+
+/*******************************************************************************
+ *
+ * Sets the largest payload, in bytes, that #publish() will send inline with
+ * +MQTTPUB. Larger payloads are sent with +MQTTPUBRAW. Setting the threshold
+ * to 0 makes #publish() always use +MQTTPUBRAW.
+ *
+ * @param[in] - threshold
+ *      The new threshold. The default is MQTT_PUB_INLINE_THRESHOLD.
+ *
+ ******************************************************************************/
+void EspATMQTT::setPublishThreshold(size_t threshold) {
+  pubThreshold = threshold;
+}
+
+/*******************************************************************************
+ *
+ * Returns the transport statistics gathered by the #publish() method.
+ *
+ * @return - A pointer to the statistics, see #mqtt_pub_stats_t.
+ *
+ ******************************************************************************/
+const mqtt_pub_stats_t *EspATMQTT::getPublishStats() {
+  return &pubStats;
+}
+
+/*******************************************************************************
+ *
+ * Subscribe to messages from a specific topic.
+ *
+ * @param[in] - linkID
+ *      The link ID used for this connection. Only linkID 0 is currently
+ *      supported by the ESP-AT stack.<br>Using the library DEFAULT_LINK_ID will
+ *      make it easy to migrate if this changes in the future.
+ *
+ * @param[in] - topic
+ *      The topic for which we are listening to.
+ *
+ * @param[in] - qos
+ *      The Quality of Service value that should be used for this message.<br>
+ *      The following values are recognized:<br>
+ *      - 0 - At most once:<br>The minimal QoS level is zero. This service level
+ *            guarantees a best-effort delivery. There is no guarantee of
+ *            delivery. The recipient does not acknowledge receipt of the
+ *            message and the message is not stored and re-transmitted by the
+ *            sender. QoS level 0 is often called “fire and forget” and provides
+ *            the same guarantee as the underlying TCP protocol.
+ *      - 1 - At least once:<br>QoS level 1 guarantees that a message is
+ *            delivered at least one time to the receiver. The sender stores the
+ *            message until it gets a PUBACK packet from the receiver that
+ *            acknowledges receipt of the message. It is possible for a message
+ *            to be sent or delivered multiple times.
+ *      - 2 - Exactly once:<br>QoS 2 is the highest level of service in MQTT.
+ *            This level guarantees that each message is received only once by
+ *            the intended recipients. QoS 2 is the safest and slowest quality
+ *            of service level.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::subscribeTopic(subscription_cb_t cb, uint32_t linkID,
+              const char * topic, uint32_t qos) {
+  if (isConnected(linkID)) {
+    mqtt_status_t status;
+
+    snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\",%d", linkID, topic, qos);
+    status = _at->sendCommand(MQTT_CMD_SUB, buff, NULL);
+    checkLinkStatus(linkID, status);
+    if (status == ESP_AT_SUB_OK) {
+      subscription_cb = cb;
+      subscriptionHandler = noMessageHandler;
+      if (!addSubscription(cb, noMessageHandler, linkID, topic, qos))
+        dprintf("Subscription table full, '%s' will not be restored\n", topic);
+    }
+    return status;
+  }
+  return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
+}
+
+/*******************************************************************************
+ *
+ * Subscribe to messages from a specific topic.
+ *
+ * @param[in] - linkID
+ *      The link ID used for this connection. Only linkID 0 is currently
+ *      supported by the ESP-AT stack.<br>Using the library DEFAULT_LINK_ID will
+ *      make it easy to migrate if this changes in the future.
+ *
+ * @param[in] - topic
+ *      The topic for which we are listening to.
+ *
+ * @param[in] - qos
+ *      The Quality of Service value that should be used for this message.<br>
+ *      The following values are recognized:<br>
+ *      - 0 - At most once:<br>The minimal QoS level is zero. This service level
+ *            guarantees a best-effort delivery. There is no guarantee of
+ *            delivery. The recipient does not acknowledge receipt of the
+ *            message and the message is not stored and re-transmitted by the
+ *            sender. QoS level 0 is often called “fire and forget” and provides
+ *            the same guarantee as the underlying TCP protocol.
+ *      - 1 - At least once:<br>QoS level 1 guarantees that a message is
+ *            delivered at least one time to the receiver. The sender stores the
+ *            message until it gets a PUBACK packet from the receiver that
+ *            acknowledges receipt of the message. It is possible for a message
+ *            to be sent or delivered multiple times.
+ *      - 2 - Exactly once:<br>QoS 2 is the highest level of service in MQTT.
+ *            This level guarantees that each message is received only once by
+ *            the intended recipients. QoS 2 is the safest and slowest quality
+ *            of service level.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::subscribeTopic(subscription_cb_t cb, uint32_t linkID,
+              char * topic, uint32_t qos) {
+  if (isConnected(linkID)) {
+    mqtt_status_t status;
+
+    snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\",%d", linkID, topic, qos);
+    status = _at->sendCommand(MQTT_CMD_SUB, buff, NULL);
+    checkLinkStatus(linkID, status);
+    if (status == ESP_AT_SUB_OK) {
+      subscription_cb = cb;
+      subscriptionHandler = noMessageHandler;
+      if (!addSubscription(cb, noMessageHandler, linkID, topic, qos))
+        dprintf("Subscription table full, '%s' will not be restored\n", topic);
+    }
+    return status;
+  }
+  return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
+}
+
+/*******************************************************************************
+ *
+ * Subscribe to messages from a specific topic with a context carrying
+ * handler, see the #subscribeTopic() methods above for the parameters. The
+ * handler gets its context, the link and the lengths of the topic and the
+ * data with every message. Create it with #mqttMessageHandler(), which can
+ * also bind a member function of an object.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::subscribeTopic(mqtt_message_handler_t handler,
+              uint32_t linkID, const char *topic, uint32_t qos) {
+  if (isConnected(linkID)) {
+    mqtt_status_t status;
+
+    snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\",%d", linkID, topic, qos);
+    status = _at->sendCommand(MQTT_CMD_SUB, buff, NULL);
+    checkLinkStatus(linkID, status);
+    if (status == ESP_AT_SUB_OK) {
+      subscription_cb = NULL;
+      subscriptionHandler = handler;
+      if (!addSubscription(NULL, handler, linkID, topic, qos))
+        dprintf("Subscription table full, '%s' will not be restored\n", topic);
+    }
+    return status;
+  }
+  return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
+}
+
+/*******************************************************************************
+ *
+ * Unsubscribe from messages with a specific topic.
+ *
+ * @param[in] - linkID
+ *      The link ID used for this connection. Only linkID 0 is currently
+ *      supported by the ESP-AT stack.<br>Using the library DEFAULT_LINK_ID will
+ *      make it easy to migrate if this changes in the future.
+ *
+ * @param[in] - topic
+ *      The topic that should be unsubscribed from.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::unSubscribeTopic(uint32_t linkID, const char * topic) {
+  if (isConnected(linkID)) {
+    snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\"", linkID, topic);
+    mqtt_status_t status = _at->sendCommand(MQTT_CMD_UNSUB, buff, NULL);
+    checkLinkStatus(linkID, status);
+    if (status != ESP_AT_SUB_OK)
+      return status;
+    // Only forget the topic once the broker has dropped it, otherwise a
+    // failed unsubscribe would leave it subscribed but no longer restored.
+    int ix = findSubscription(linkID, topic);
+    if (ix >= 0) {
+      removeSubscription(ix);
+      if (!subCount) {
+        subscription_cb = NULL;
+        subscriptionHandler = noMessageHandler;
+      }
+    }
+    return status;
+  }
+  return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
+}
+
+/*******************************************************************************
+ *
+ * Unsubscribe from messages with a specific topic.
+ *
+ * @param[in] - linkID
+ *      The link ID used for this connection. Only linkID 0 is currently
+ *      supported by the ESP-AT stack.<br>Using the library DEFAULT_LINK_ID will
+ *      make it easy to migrate if this changes in the future.
+ *
+ * @param[in] - topic
+ *      The topic that should be unsubscribed from.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::unSubscribeTopic(uint32_t linkID, char * topic) {
+  if (isConnected(linkID)) {
+    snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\"", linkID, topic);
+    mqtt_status_t status = _at->sendCommand(MQTT_CMD_UNSUB, buff, NULL);
+    checkLinkStatus(linkID, status);
+    if (status != ESP_AT_SUB_OK)
+      return status;
+    // Only forget the topic once the broker has dropped it, otherwise a
+    // failed unsubscribe would leave it subscribed but no longer restored.
+    int ix = findSubscription(linkID, topic);
+    if (ix >= 0) {
+      removeSubscription(ix);
+      if (!subCount) {
+        subscription_cb = NULL;
+        subscriptionHandler = noMessageHandler;
+      }
+    }
+    return status;
+  }
+  return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of subscriptions in the subscription table. These are
+ * the subscriptions that are restored automatically after a reconnect.
+ *
+ * @return - The number of active subscriptions.
+ *
+ ******************************************************************************/
+size_t EspATMQTT::subscriptions() {
+  return subCount;
+}
+
+/*******************************************************************************
+ *
+ * Matches a topic against an MQTT topic filter, supporting the '+' and '#'
+ * wildcards.
+ *
+ ******************************************************************************/
+static bool topicMatches(const char *filter, const char *topic) {
+  while (*filter) {
+    if (*filter == '#')
+      return true;
+    if (*filter == '+') {
+      while (*topic && *topic != '/')
+        topic++;
+      filter++;
+      continue;
+    }
+    if (*filter != *topic) {
+      // "a/#" also matches the parent level "a".
+      return !*topic && filter[0] == '/' && filter[1] == '#' && !filter[2];
+    }
+    filter++;
+    topic++;
+  }
+  return !*topic;
+}
+
+int EspATMQTT::findSubscription(uint32_t linkID, const char *topic) {
+  for (uint32_t i = 0; i < subCount; i++) {
+    if (subs[i].linkID == linkID && !strcmp(&subTopics[subs[i].filter], topic))
+      return i;
+  }
+  return -1;
+}
+
+/*******************************************************************************
+ *
+ * Adds a subscription to the table, or updates the handler and QoS of an
+ * existing one with the same topic filter.
+ *
+ ******************************************************************************/
+bool EspATMQTT::addSubscription(subscription_cb_t cb,
+                                mqtt_message_handler_t handler, uint32_t linkID,
+                                const char *topic, uint32_t qos) {
+  int ix = findSubscription(linkID, topic);
+  size_t len = strlen(topic) + 1;
+
+  if (ix < 0) {
+    if (subCount >= MQTT_MAX_SUBSCRIPTIONS ||
+        subTopicsUsed + len > MQTT_SUB_TOPIC_POOL)
+      return false;
+    ix = subCount++;
+    subs[ix].filter = subTopicsUsed;
+    memcpy(&subTopics[subTopicsUsed], topic, len);
+    subTopicsUsed += len;
+  }
+  subs[ix].cb = cb;
+  subs[ix].handler = handler;
+  subs[ix].linkID = linkID;
+  subs[ix].qos = qos;
+  return true;
+}
+
+void EspATMQTT::removeSubscription(int ix) {
+  uint16_t start = subs[ix].filter;
+  size_t len = strlen(&subTopics[start]) + 1;
+
+  memmove(&subTopics[start], &subTopics[start + len], subTopicsUsed - start - len);
+  subTopicsUsed -= len;
+  memmove(&subs[ix], &subs[ix + 1], (subCount - ix - 1) * sizeof(subs[0]));
+  subCount--;
+  for (uint32_t i = 0; i < subCount; i++) {
+    if (subs[i].filter > start)
+      subs[i].filter -= len;
+  }
+}
+
+/*******************************************************************************
+ *
+ * Subscribes to all the topics in the subscription table again. Called once
+ * the connection is re-established, before any queued messages are sent, so
+ * that replies to those messages are not missed.
+ *
+ * The ESP-AT device handles one command at a time, so the subscriptions are
+ * sent back to back without returning to the application in between.
+ *
+ ******************************************************************************/
+void EspATMQTT::restoreSubscriptions(uint32_t linkID) {
+  mqtt_status_t status;
+
+  links[linkID].subRestore = false;
+  for (uint32_t i = 0; i < subCount; i++) {
+    if (subs[i].linkID != linkID)
+      continue;
+    snprintf(buff, MQTT_BUFFER_SIZE, "=%d,\"%s\",%d", linkID,
+             &subTopics[subs[i].filter], subs[i].qos);
+    status = _at->sendCommand(MQTT_CMD_SUB, buff, NULL);
+    checkLinkStatus(linkID, status);
+    if (!isConnected(linkID)) {
+      links[linkID].subRestore = true;
+      return;
+    }
+    if (status != ESP_AT_SUB_OK)
+      dprintf("Failed to restore subscription '%s', error %08x\n",
+              &subTopics[subs[i].filter], status);
+  }
+}
+
+/*******************************************************************************
+ *
+ * Delivers a message received on a link to its handler. The first matching
+ * subscription of that link wins, messages that match no subscription go to
+ * the handler of the latest subscription.
+ *
+ ******************************************************************************/
+bool EspATMQTT::deliverMessage(uint32_t linkID, char *topic, size_t topicLen,
+                               char *data, size_t dataLen) {
+  subscription_cb_t cb = subscription_cb;
+  mqtt_message_handler_t handler = subscriptionHandler;
+
+  // A copy of a message that has already been delivered is dropped here,
+  // before it can reach the cache or a handler.
+  if (dedup && dedup->isDuplicate(topic, topicLen, data, dataLen, millis())) {
+    dprintf("Dropping duplicate message on '%s'\n", topic);
+    return true;
+  }
+  if (valueCache)
+    valueCache->update(topic, topicLen, data, dataLen);
+  for (uint32_t i = 0; i < subCount; i++) {
+    if ((subs[i].cb || subs[i].handler.fn) && subs[i].linkID == linkID &&
+        topicMatches(&subTopics[subs[i].filter], topic)) {
+      cb = subs[i].cb;
+      handler = subs[i].handler;
+      break;
+    }
+  }
+  if (handler.fn)
+    handler.fn(handler.ctx, linkID, topic, topicLen, data, dataLen);
+  else if (cb)
+    cb(topic, data);
+  else
+    return false;
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Close (all) conection/s with the specified link ID.
+ *
+ * @param[in] - linkID
+ *      The link ID used for this connection. Only linkID 0 is currently
+ *      supported by the ESP-AT stack.<br>Using the library DEFAULT_LINK_ID will
+ *      make it easy to migrate if this changes in the future.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::close(uint32_t linkID) {
+  if (linkID < MQTT_MAX_LINKS && links[linkID].state != MQTT_STATE_DISCONNECTED) {
+    // Closing on purpose, so the supervisor must not reconnect and the
+    // subscriptions belong to the old session.
+    setState(linkID, MQTT_STATE_DISCONNECTED);
+    for (int i = subCount - 1; i >= 0; i--) {
+      if (subs[i].linkID == linkID)
+        removeSubscription(i);
+    }
+    links[linkID].subRestore = false;
+    snprintf(buff, MQTT_BUFFER_SIZE, "=%d", linkID);
+    return _at->sendCommand(MQTT_CMD_CLEAN, buff, NULL);
+  }
+  return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_IN_DISCONNECTED_STATE;
+}
+
+/*******************************************************************************
+ *
+ * Enables the internal NTP Time client. Up to 3 different time servers can
+ * be specified to support quick multi regional time resolution. If no external
+ * time servers are specified on of the following time servers will be used
+ * instead:<br>
+ *   - “cn.ntp.org.cn”
+ *   - “ntp.sjtu.edu.cn”
+ *   - “us.pool.ntp.org”
+ *
+ * When using a secure connection mechanism (TLS) the NTP client can be used
+ * to acquire the current date and time which is required by the TLS protocol.
+ * When the time has been acquired from a time server a call back is
+ * generated and the connection to the mqtt server can be made.
+ *
+ * @param[in] - enable
+ *      Enable or disable the NTP client. A "0" in this parameter will disable
+ *      the client completely and a "1" is required if the NTP client should
+ *      be enabled.
+ *
+ * @param[in] - cb
  *      A pointer to a callback method that is called when a valid date and time
  *      has been acquired from an NTP server. If this is NULL, no call back
  *      will be made and the caller has to examine the time to determine when
  *      a valid date/time has been acquired.
  *
- * @param[in] - timezone
- *      This parameter support the following two formats:<br>
- *      - Value range -12 to 14. It marks most of the time zones by offset from
- *        Coordinated Universal Time (UTC) in whole hours (UTC–12:00 to
- *        UTC+14:00).<br>
- *      - The second format is UTC offset. The UTC offset specifies the time
- *        value you must add to the UTC time to get a local time value. It has
- *        a syntax like [+|-][hh]mm. This is negative if the local time zone is
- *        on the west of the Prime Meridian and positive if it is on the east.
- *        The hour(hh) must be between -12 and 14, and the minute(mm) between 0
- *        and 59. For example, if you want to set the timezone to New Zealand
- *        (Chatham Islands) which is in UTC+12:45, you should set the parameter
- *        to 1245. Please refer to UTC offset wiki
- *        (https://en.wikipedia.org/wiki/Time_zone#List_of_UTC_offsets) for more
- *        information.
+ * @param[in] - timezone
+ *      This parameter support the following two formats:<br>
+ *      - Value range -12 to 14. It marks most of the time zones by offset from
+ *        Coordinated Universal Time (UTC) in whole hours (UTC–12:00 to
+ *        UTC+14:00).<br>
+ *      - The second format is UTC offset. The UTC offset specifies the time
+ *        value you must add to the UTC time to get a local time value. It has
+ *        a syntax like [+|-][hh]mm. This is negative if the local time zone is
+ *        on the west of the Prime Meridian and positive if it is on the east.
+ *        The hour(hh) must be between -12 and 14, and the minute(mm) between 0
+ *        and 59. For example, if you want to set the timezone to New Zealand
+ *        (Chatham Islands) which is in UTC+12:45, you should set the parameter
+ *        to 1245. Please refer to UTC offset wiki
+ *        (https://en.wikipedia.org/wiki/Time_zone#List_of_UTC_offsets) for more
+ *        information.
+ *
+ * @param[in] - ts1 - ts3
+ *        Time server URL's, for instance "time.google.com" or "0.pool.ntp.org"
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::enableNTPTime(bool enable, validDateTime_cb_t cb,
+                                       uint32_t timezone, const char *ts1,
+                                       const char *ts2, const char *ts3) {
+  dateTimeHandler = noEventHandler;
+  if (!enable) {
+    snprintf(buff, MQTT_BUFFER_SIZE, "=0,0");
+    validDateTime_cb = NULL;
+    ntpEnabled = false;
+  } else {
+    validDateTime_cb = cb;
+    ntpEnabled = true;
+    int noTs = 3;
+
+    // The ESP-AT device reports local time, keep the offset so that the
+    // wall clock can run in UTC.
+    int32_t tz = (int32_t)timezone;
+    int32_t abs = tz < 0 ? -tz : tz;
+    if (abs <= 14)
+      abs *= 3600;
+    else
+      abs = (abs / 100) * 3600 + (abs % 100) * 60;
+    tzOffset = tz < 0 ? -abs : abs;
+
+    if (!ts3) noTs--;
+    if (!ts2) noTs--;
+    if (!ts1) noTs--;
+
+    switch (noTs) {
+      case 0:
+        snprintf(buff, MQTT_BUFFER_SIZE, "=1,%d", timezone);
+        break;
+      case 1:
+        snprintf(buff, MQTT_BUFFER_SIZE, "=1,%d,\"%s\"", timezone, ts1);
+        break;
+      case 2:
+        snprintf(buff, MQTT_BUFFER_SIZE, "=1,%d,\"%s\",\"%s\"", timezone, ts1, ts2);
+        break;
+      case 3:
+        snprintf(buff, MQTT_BUFFER_SIZE, "=1,%d,\"%s\",\"%s\",\"%s\"",
+                 timezone, ts1, ts2, ts3);
+        break;
+    }
+  }
+  return _at->sendCommand(AT_CMD_CIPSNTPCFG, buff, NULL);
+}
+
+/*******************************************************************************
+ *
+ * Enables the internal NTP Time client with a context carrying handler, see
+ * the #enableNTPTime() method above for the parameters. The handler is
+ * called with its context when a valid date and time has been acquired.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::enableNTPTime(bool enable, mqtt_event_handler_t handler,
+                                       uint32_t timezone, const char *ts1,
+                                       const char *ts2, const char *ts3) {
+  mqtt_status_t status = enableNTPTime(enable, (validDateTime_cb_t)NULL,
+                                       timezone, ts1, ts2, ts3);
+
+  if (enable)
+    dateTimeHandler = handler;
+  return status;
+}
+
+/*******************************************************************************
+ *
+ * Get the current time from the ESP-AT internal NTP Client
+ *
+ * @param[out] - time
+ *      The current time as reported by the ESP-AT internal NTP client. If the
+ *      NTP client has not been enabled an error will be returned.
+ *      The time is reported back as a character string (An Example:
+ *      "Tue Oct 19 17:47:56 2021") and the caller need to decode it.
+ *
+ * @return - The status of the operation, See #mqtt_error_e and
+ *      #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::getNTPTime(char **time) {
+  return _at->sendCommand(AT_CMD_CIPSNTPTIME, "?", time);
+}
+
+/*******************************************************************************
+ *
+ * Returns true when the local wall clock has been set from the NTP time.
+ *
+ ******************************************************************************/
+bool EspATMQTT::timeValid() {
+  return wallClock.isValid();
+}
+
+/*******************************************************************************
+ *
+ * Returns the current time from the local wall clock. The clock is set once
+ * from the ESP-AT NTP client and then runs from millis(), so unlike
+ * #getNTPTime() no command is sent to the ESP-AT device.
+ *
+ * @return - The time in seconds since 1970-01-01 00:00:00 UTC, 0 if no valid
+ *      time has been received yet.
+ *
+ ******************************************************************************/
+uint32_t EspATMQTT::getEpoch() {
+  return wallClock.epoch(millis());
+}
+
+/*******************************************************************************
+ *
+ * Returns the current time from the local wall clock with millisecond
+ * resolution, cheap enough to stamp every record.
+ *
+ * @return - The time in milliseconds since 1970-01-01 00:00:00 UTC, 0 if no
+ *      valid time has been received yet.
+ *
+ ******************************************************************************/
+uint64_t EspATMQTT::getTimeMs() {
+  return wallClock.epochMs(millis());
+}
+
+/*******************************************************************************
+ *
+ * Returns the current time from the local wall clock split into seconds and
+ * milliseconds.
+ *
+ * @param[out] - epoch
+ *      The time in seconds since 1970-01-01 00:00:00 UTC.
+ *
+ * @param[out] - ms
+ *      The milliseconds into the current second, may be NULL.
+ *
+ * @return - true if the time is valid.
+ *
+ ******************************************************************************/
+bool EspATMQTT::getTime(uint32_t *epoch, uint16_t *ms) {
+  uint64_t now = wallClock.epochMs(millis());
+
+  *epoch = (uint32_t)(now / 1000);
+  if (ms)
+    *ms = now % 1000;
+  return wallClock.isValid();
+}
+
+/*******************************************************************************
+ *
+ * Writes the current time from the local wall clock as ISO-8601 text in UTC,
+ * like "2022-07-05T07:31:56.123Z", to a caller provided buffer.
+ *
+ * @param[out] - buffer
+ *      The buffer the '\0' terminated text is written to.
+ *
+ * @param[in] - size
+ *      The size of the buffer, MQTT_ISO_TIME_SIZE is always enough.
+ *
+ * @param[in] - withMs
+ *      true to include the milliseconds.
+ *
+ * @return - The length of the text, 0 if the time is not valid yet or the
+ *      buffer is too small.
+ *
+ ******************************************************************************/
+size_t EspATMQTT::formatTime(char *buffer, size_t size, bool withMs) {
+  if (!wallClock.isValid())
+    return 0;
+  return MqttClock::formatIso(wallClock.epochMs(millis()), buffer, size, withMs);
+}
+
+/*******************************************************************************
+ *
+ * Sets how often the local wall clock is synced with the ESP-AT NTP client
+ * after the first valid time has been received. The time is read in the
+ * background by #process().
  *
- * @param[in] - ts1 - ts3
- *        Time server URL's, for instance "time.google.com" or "0.pool.ntp.org"
+ * @param[in] - interval
+ *      The time between two syncs in milliseconds, 0 syncs only once.
+ *      The default is MQTT_CLOCK_SYNC_INTERVAL.
+ *
+ ******************************************************************************/
+void EspATMQTT::setTimeSyncInterval(uint32_t interval) {
+  wallClock.setSyncInterval(interval);
+}
+
+/*******************************************************************************
+ *
+ * Returns the estimated drift of the local clock in parts per million,
+ * measured between syncs and corrected for when reading the time.
+ *
+ ******************************************************************************/
+int32_t EspATMQTT::getClockDrift() {
+  return wallClock.drift();
+}
+
+/*******************************************************************************
+ *
+ * Checks to see if the mqtt client is connected and returns true if it is.
+ *
+ * @param[in] - linkID
+ *      The link to check, DEFAULT_LINK_ID if not specified.
+ *
+ * @return - true or false depending on the current connection status.
+ *
+ ******************************************************************************/
+bool EspATMQTT::isConnected(uint32_t linkID) {
+  return linkID < MQTT_MAX_LINKS && links[linkID].state == MQTT_STATE_CONNECTED;
+}
+
+/*******************************************************************************
+ *
+ * Enables the connection supervisor. When the connection to the broker is
+ * lost, either reported by the ESP-AT device with +MQTTDISCONNECTED or
+ * detected from the error code of a command, the supervisor reconnects with
+ * the parameters of the last #connect(). The attempts are spread out with an
+ * exponential backoff with jitter, starting at minBackoff and never waiting
+ * longer than maxBackoff.
+ *
+ * The settings from #userConfig(), #setClientID(), #setUsername(),
+ * #setPassword(), #connectionConfig() and #setALPN() are remembered and sent
+ * again only if the ESP-AT device reports that the link is no longer
+ * configured, for instance after it has been reset.
+ *
+ * The reconnect attempts are made from the #process() method, which waits
+ * for the reply to an attempt for up to MQTT_RECONNECT_TIMEOUT milliseconds,
+ * or until an installed deadline, see #setDeadline().
+ *
+ * @param[in] - enable
+ *      true to enable the supervisor, false to disable it.
+ *
+ * @param[in] - minBackoff
+ *      The delay in milliseconds before the first reconnect attempt.
+ *
+ * @param[in] - maxBackoff
+ *      The max delay in milliseconds between two reconnect attempts.
  *
  * @return - The status of the operation, See #mqtt_error_e and
  *      #status_code_e for more information.
  *
  ******************************************************************************/
-mqtt_status_t EspATMQTT::enableNTPTime(bool enable, validDateTime_cb_t cb,
-                                       uint32_t timezone, const char *ts1,
-                                       const char *ts2, const char *ts3) {
-  if (!enable) {
-    snprintf(buff, MQTT_BUFFER_SIZE, "=0,0");
-    validDateTime_cb = NULL;
-  } else {
-    validDateTime_cb = cb;
-    int noTs = 3;
+mqtt_status_t EspATMQTT::enableAutoReconnect(bool enable, uint32_t minBackoff,
+                                             uint32_t maxBackoff) {
+  if (enable && (!minBackoff || maxBackoff < minBackoff))
+    return ESP_AT_SUB_PARA_INVALID;
 
-    if (!ts3) noTs--;
-    if (!ts2) noTs--;
-    if (!ts1) noTs--;
+  autoReconnect = enable;
+  backoffMin = minBackoff;
+  backoffMax = maxBackoff;
+  for (uint32_t i = 0; i < MQTT_MAX_LINKS; i++) {
+    links[i].reconnectAttempts = 0;
+    if (!enable && links[i].state == MQTT_STATE_BACKOFF)
+      setState(i, MQTT_STATE_DISCONNECTED);
+  }
+  return ESP_AT_SUB_OK;
+}
 
-    switch (noTs) {
-      case 0:
-        snprintf(buff, MQTT_BUFFER_SIZE, "=1,%d", timezone);
-        break;
-      case 1:
-        snprintf(buff, MQTT_BUFFER_SIZE, "=1,%d,\"%s\"", timezone, ts1);
-        break;
-      case 2:
-        snprintf(buff, MQTT_BUFFER_SIZE, "=1,%d,\"%s\",\"%s\"", timezone, ts1, ts2);
-        break;
-      case 3:
-        snprintf(buff, MQTT_BUFFER_SIZE, "=1,%d,\"%s\",\"%s\",\"%s\"",
-                 timezone, ts1, ts2, ts3);
-        break;
+/*******************************************************************************
+ *
+ * Sets a callback that is called every time the connection changes state.
+ * See #mqtt_conn_state_t for the states.
+ *
+ * @param[in] - cb
+ *      The callback function or NULL to remove it.
+ *
+ ******************************************************************************/
+void EspATMQTT::setStateCallback(state_cb_t cb) {
+  state_cb = cb;
+}
+
+/*******************************************************************************
+ *
+ * Returns the current state of the connection of a link.
+ *
+ * @param[in] - linkID
+ *      The link to check, DEFAULT_LINK_ID if not specified.
+ *
+ * @return - The connection state, see #mqtt_conn_state_t.
+ *
+ ******************************************************************************/
+mqtt_conn_state_t EspATMQTT::getState(uint32_t linkID) {
+  if (linkID >= MQTT_MAX_LINKS)
+    return MQTT_STATE_DISCONNECTED;
+  return links[linkID].state;
+}
+
+/*******************************************************************************
+ *
+ * Enables or disables configuration diffing. With diffing enabled the
+ * library reads the configuration the ESP-AT device already holds, with
+ * AT+MQTTUSERCFG?, AT+MQTTCONNCFG? and AT+MQTTALPN?, the first time a link
+ * is configured. userConfig(), setClientID(), setUsername(), setPassword(),
+ * connectionConfig() and setALPN() then only send their command if the
+ * setting differs from what the device, or the last accepted command, has.
+ * This saves a lot of round trips when the host wakes up from sleep while
+ * the ESP-AT device has kept its configuration.
+ *
+ * Settings the ESP-AT firmware can not report are always sent.
+ *
+ * @param[in] - enable
+ *      true to skip settings that are already applied.
+ *
+ ******************************************************************************/
+void EspATMQTT::enableConfigDiffing(bool enable) {
+  cfgDiffing = enable;
+}
+
+/*******************************************************************************
+ *
+ * Sends the configuration command cfg with the parameters in buff and
+ * remembers them, if accepted, so they can be replayed after a reset of the
+ * ESP-AT device. With configuration diffing enabled the command is skipped
+ * if the setting is already applied.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::sendConfig(uint32_t linkID, uint8_t cfg) {
+  if (linkID >= MQTT_MAX_LINKS)
+    return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_LINK_ID_VALUE_IS_WRONG;
+
+  if (cfgDiffing) {
+    if (!links[linkID].cfgQueried)
+      queryConfig(linkID);
+    if (configApplied(linkID, cfg, buff)) {
+      dprintf("%s%s already applied, skipped\n", cfgCommand(cfg), buff);
+      return ESP_AT_SUB_OK;
     }
   }
-  return _at->sendCommand(AT_CMD_CIPSNTPCFG, buff, NULL);
+
+  mqtt_status_t status = _at->sendCommand(cfgCommand(cfg), buff, NULL);
+
+  if (status == ESP_AT_SUB_OK) {
+    if (cfg == MQTT_CFG_USERCFG) {
+      // A new user config replaces the individual settings.
+      forgetConfig(linkID, MQTT_CFG_CLIENTID);
+      forgetConfig(linkID, MQTT_CFG_USERNAME);
+      forgetConfig(linkID, MQTT_CFG_PASSWORD);
+    }
+    rememberConfig(linkID, cfg, buff);
+  }
+  return status;
 }
 
 /*******************************************************************************
  *
- * Get the current time from the ESP-AT internal NTP Client
+ * The configuration store holds one record per remembered command and link,
+ * each made of the link ID and the command index followed by the zero
+ * terminated parameter string.
  *
- * @param[out] - time
- *      The current time as reported by the ESP-AT internal NTP client. If the
- *      NTP client has not been enabled an error will be returned.
- *      The time is reported back as a character string (An Example:
- *      "Tue Oct 19 17:47:56 2021") and the caller need to decode it.
+ ******************************************************************************/
+void EspATMQTT::rememberConfig(uint32_t linkID, uint8_t cfg, const char *params) {
+  size_t len = strlen(params) + 1;
+
+  forgetConfig(linkID, cfg);
+  if (cfgUsed + 2 + len > MQTT_CFG_STORE_SIZE) {
+    dprintf("No room to remember %s, it will not be replayed\n", cfgCommand(cfg));
+    return;
+  }
+  cfgStore[cfgUsed++] = (char)linkID;
+  cfgStore[cfgUsed++] = (char)cfg;
+  memcpy(&cfgStore[cfgUsed], params, len);
+  cfgUsed += len;
+}
+
+void EspATMQTT::forgetConfig(uint32_t linkID, uint8_t cfg) {
+  const char *params = storedConfig(linkID, cfg);
+
+  if (params) {
+    size_t start = params - cfgStore - 2;
+    size_t end = params - cfgStore + strlen(params) + 1;
+    memmove(&cfgStore[start], &cfgStore[end], cfgUsed - end);
+    cfgUsed -= end - start;
+  }
+}
+
+const char *EspATMQTT::storedConfig(uint32_t linkID, uint8_t cfg) {
+  size_t ix = 0;
+
+  while (ix < cfgUsed) {
+    if ((uint8_t)cfgStore[ix] == linkID && (uint8_t)cfgStore[ix + 1] == cfg)
+      return &cfgStore[ix + 2];
+    ix += strlen(&cfgStore[ix + 2]) + 3;
+  }
+  return NULL;
+}
+
+// Finds quoted string n of a parameter string and returns a pointer to its
+// first character, or NULL if there is no such string.
+static const char *quotedField(const char *params, uint32_t n, size_t *len) {
+  const char *start;
+  const char *end;
+
+  for (;;) {
+    if (!(start = strchr(params, '"')))
+      return NULL;
+    start++;
+    if (!(end = strchr(start, '"')))
+      return NULL;
+    if (!n--)
+      break;
+    params = end + 1;
+  }
+  *len = end - start;
+  return start;
+}
+
+/*******************************************************************************
  *
- * @return - The status of the operation, See #mqtt_error_e and
- *      #status_code_e for more information.
+ * Reads the configuration the ESP-AT device holds for a link and stores it
+ * as if it had been sent, so that identical settings are not sent again.
+ * Settings already sent by the application are kept as they are. A query
+ * that the firmware does not support leaves the setting unknown.
  *
  ******************************************************************************/
-mqtt_status_t EspATMQTT::getNTPTime(char **time) {
-  return _at->sendCommand(AT_CMD_CIPSNTPTIME, "?", time);
+void EspATMQTT::queryConfig(uint32_t linkID) {
+  static const uint8_t queried[] = {
+    MQTT_CFG_USERCFG, MQTT_CFG_CONNCFG, MQTT_CFG_ALPN
+  };
+  char prefix[24];
+
+  links[linkID].cfgQueried = true;
+  for (size_t i = 0; i < sizeof(queried); i++) {
+    uint8_t cfg = queried[i];
+    const char *cmd = cfgCommand(cfg);
+
+    if (storedConfig(linkID, cfg))
+      continue;
+    if (_at->sendCommand(cmd, "?", NULL) != ESP_AT_SUB_OK)
+      continue;
+    // The reply has one "+CMD:<linkID>,..." line per configured link
+    snprintf(prefix, sizeof(prefix), "%s:%d,", cmd, linkID);
+    char *line = strstr(_at->getBuff(), prefix);
+    if (!line)
+      continue;
+    char *end = strchr(line, '|');
+    if (end)
+      *end = '\0';
+    // Turn the reply into the parameters of the set command
+    line += strlen(cmd);
+    *line = '=';
+    rememberConfig(linkID, cfg, line);
+  }
 }
 
 /*******************************************************************************
  *
- * Checks to see if the mqtt client is connected and returns true if it is.
+ * Checks if a configuration command with the given parameters would change
+ * anything. The client ID, user name and password can be set both on their
+ * own and as part of the user config, so they are compared with both.
  *
- * @return - true or false depending on the current connection status.
+ ******************************************************************************/
+bool EspATMQTT::configApplied(uint32_t linkID, uint8_t cfg, const char *params) {
+  const char *stored = storedConfig(linkID, cfg);
+  const char *user = storedConfig(linkID, MQTT_CFG_USERCFG);
+  const char *field;
+  const char *value;
+  size_t fieldLen;
+  size_t valueLen;
+
+  if (cfg == MQTT_CFG_USERCFG) {
+    // The individual settings sent after it must still match the user config.
+    if (!user || strcmp(user, params))
+      return false;
+    for (uint8_t c = MQTT_CFG_CLIENTID; c <= MQTT_CFG_PASSWORD; c++) {
+      const char *single = storedConfig(linkID, c);
+      if (!single)
+        continue;
+      field = quotedField(user, c - MQTT_CFG_CLIENTID, &fieldLen);
+      value = quotedField(single, 0, &valueLen);
+      if (!field || !value || fieldLen != valueLen ||
+          memcmp(field, value, fieldLen))
+        return false;
+    }
+    return true;
+  }
+
+  if (stored)
+    return !strcmp(stored, params);
+  if (cfg < MQTT_CFG_CLIENTID || cfg > MQTT_CFG_PASSWORD || !user)
+    return false;
+  field = quotedField(user, cfg - MQTT_CFG_CLIENTID, &fieldLen);
+  value = quotedField(params, 0, &valueLen);
+  return field && value && fieldLen == valueLen &&
+         !memcmp(field, value, fieldLen);
+}
+
+/*******************************************************************************
+ *
+ * Sends the remembered configuration of a link, except the connect, to the
+ * ESP-AT device in the order the device expects it.
+ *
+ ******************************************************************************/
+mqtt_status_t EspATMQTT::replayConfig(uint32_t linkID) {
+  mqtt_status_t status;
+
+  for (uint8_t cfg = 0; cfg < MQTT_CFG_CONN; cfg++) {
+    const char *params = storedConfig(linkID, cfg);
+    if (!params)
+      continue;
+    status = _at->sendCommand(cfgCommand(cfg), params, NULL);
+    if (status != ESP_AT_SUB_OK) {
+      dprintf("Failed to replay %s, error %08x\n", cfgCommand(cfg), status);
+      return status;
+    }
+  }
+  return ESP_AT_SUB_OK;
+}
+
+/*******************************************************************************
+ *
+ * Changes the connection state of a link and informs the application.
+ *
+ ******************************************************************************/
+void EspATMQTT::setState(uint32_t linkID, mqtt_conn_state_t state) {
+  mqtt_link_t *link = &links[linkID];
+  mqtt_conn_state_t oldState = link->state;
+
+  if (state == MQTT_STATE_CONNECTED)
+    link->reconnectAttempts = 0;
+  if (state == oldState)
+    return;
+  link->state = state;
+  if (state == MQTT_STATE_CONNECTED) {
+    for (uint32_t i = 0; i < subCount; i++) {
+      if (subs[i].linkID == linkID)
+        link->subRestore = true;
+    }
+  }
+  dprintf("Link %d state %d -> %d\n", linkID, oldState, state);
+  if (state_cb)
+    state_cb(linkID, oldState, state);
+}
+
+/*******************************************************************************
+ *
+ * Called when the connection, or a connection attempt, of a link has been
+ * lost. This can be called from within a command reply so it must not send
+ * anything to the ESP-AT device, the reconnect is made later by #process().
+ *
+ ******************************************************************************/
+void EspATMQTT::connectionLost(uint32_t linkID) {
+  mqtt_conn_state_t state = links[linkID].state;
+
+  if (state == MQTT_STATE_DISCONNECTED || state == MQTT_STATE_BACKOFF)
+    return;
+
+  // Replies to messages that timed out will not come now.
+  inflightLate = 0;
+
+  if (autoReconnect && storedConfig(linkID, MQTT_CFG_CONN))
+    scheduleReconnect(linkID);
+  else
+    setState(linkID, MQTT_STATE_DISCONNECTED);
+}
+
+/*******************************************************************************
+ *
+ * Checks the result of a command for signs of a lost connection.
+ *
+ ******************************************************************************/
+void EspATMQTT::checkLinkStatus(uint32_t linkID, mqtt_status_t status) {
+  if (isConnected(linkID) && status != ESP_AT_SUB_OK &&
+      MQTT_ERROR(status) == AT_MQTT_IN_DISCONNECTED_STATE) {
+    connectionLost(linkID);
+  }
+}
+
+/*******************************************************************************
+ *
+ * Schedules the next reconnect attempt of a link. The delay doubles for each
+ * failed attempt and a random part of up to half the delay is subtracted so
+ * that a fleet of devices does not hit a restarted broker at the same time.
+ *
+ ******************************************************************************/
+void EspATMQTT::scheduleReconnect(uint32_t linkID) {
+  mqtt_link_t *link = &links[linkID];
+  uint32_t delay = backoffMin;
+
+  for (uint32_t i = 0; i < link->reconnectAttempts && delay < backoffMax; i++)
+    delay <<= 1;
+  if (delay > backoffMax)
+    delay = backoffMax;
+  delay = delay / 2 + random(delay / 2 + 1);
+
+  link->reconnectAttempts++;
+  link->reconnectAt = millis() + delay;
+  setState(linkID, MQTT_STATE_BACKOFF);
+}
+
+/*******************************************************************************
+ *
+ * Runs the reconnect state machine of a link, called from #process().
  *
  ******************************************************************************/
-bool EspATMQTT::isConnected() {
-  return connected;
+void EspATMQTT::superviseConnection(uint32_t linkID) {
+  mqtt_link_t *link = &links[linkID];
+  mqtt_status_t status;
+  const char *params;
+  char *result;
+
+  if (!autoReconnect)
+    return;
+
+  if (link->state == MQTT_STATE_CONNECTING) {
+    if (millis() - link->connectStart >= MQTT_RECONNECT_TIMEOUT) {
+      dprintf("Connection attempt on link %d timed out\n", linkID);
+      scheduleReconnect(linkID);
+    }
+    return;
+  }
+
+  if (link->state != MQTT_STATE_BACKOFF ||
+      (int32_t)(millis() - link->reconnectAt) < 0)
+    return;
+
+  params = storedConfig(linkID, MQTT_CFG_CONN);
+  if (!params) {
+    setState(linkID, MQTT_STATE_DISCONNECTED);
+    return;
+  }
+
+  if (link->cfgReplay) {
+    if (replayConfig(linkID) != ESP_AT_SUB_OK) {
+      scheduleReconnect(linkID);
+      return;
+    }
+    link->cfgReplay = false;
+  }
+
+  // The ESP-AT device replies OK or ERROR when the broker has answered, so
+  // the reply is waited for here. If it was left for later it would be taken
+  // as the reply to the next command and a failed attempt would only be
+  // noticed when MQTT_RECONNECT_TIMEOUT has passed.
+  link->connectStart = millis();
+  setState(linkID, MQTT_STATE_CONNECTING);
+  status = _at->sendCommand(MQTT_CMD_CONN, params, &result, MQTT_RESP_CONNECTED,
+                            MQTT_RECONNECT_TIMEOUT);
+  if (status == ESP_AT_SUB_OK) {
+    if (strstr(result, MQTT_RESP_CONNECTED))
+      setState(linkID, MQTT_STATE_CONNECTED);
+    // Otherwise the +MQTTCONNECTED URC will complete the connection.
+  } else if (status != ESP_AT_SUB_CMD_TIMEOUT) {
+    switch (MQTT_ERROR(status)) {
+      case AT_MQTT_ALREADY_CONNECTED:
+        setState(linkID, MQTT_STATE_CONNECTED);
+        break;
+      case AT_MQTT_NO_CONFIGURED:
+      case AT_MQTT_NOT_IN_CONFIGURED_STATE:
+      case AT_MQTT_CLIENT_ID_IS_NULL:
+        // The ESP-AT device has lost the link configuration.
+        link->cfgReplay = true;
+        scheduleReconnect(linkID);
+        break;
+      default:
+        scheduleReconnect(linkID);
+        break;
+    }
+  }
 }
 
 /*******************************************************************************
@@ -1206,13 +3946,49 @@ void EspATMQTT::process() {
   static uint32_t ntpTimer = millis();
 
   // First do timers
-  if ((millis() - ntpTimer > 1000) && (ntpTimeValid == false)) {
+  if (ntpEnabled && (millis() - ntpTimer > MQTT_CLOCK_RETRY_TIME) &&
+      wallClock.syncDue(millis())) {
     ntpTimer = millis();
     // Trigger to the current time. Will later be caught in the URC handler.
     _at->sendString(MQTT_STRING_CIPSNTPTIME);
   }
 
-  // URC handler
+  processUrc();
+  for (uint32_t i = 0; i < MQTT_MAX_LINKS; i++) {
+    superviseConnection(i);
+    if (isConnected(i) && links[i].subRestore)
+      restoreSubscriptions(i);
+  }
+  serviceInflight();
+  notifyPublishes();
+  flushUrgent(UINT32_MAX);
+
+  // Publish the batches whose oldest record has waited long enough.
+  for (uint32_t i = 0; i < MQTT_MAX_BATCHES; i++) {
+    mqtt_batch_t *b = &batches[i];
+    if (b->topic && b->records && millis() - b->firstAt >= b->maxLatency)
+      sendBatch(b);
+  }
+
+  // Send anything left in the publish queues, for instance after a connect()
+  // that completed synchronously. The queues hold messages that are older
+  // than the ones in the journal so they go first.
+  for (uint32_t i = 0; i < MQTT_MAX_LINKS; i++) {
+    if (isConnected(i) && !links[i].queue.isEmpty())
+      flushQueue(i);
+  }
+  if (pubJournal) {
+    pubJournal->service(millis());
+    replayJournal();
+  }
+}
+
+/*******************************************************************************
+ *
+ * Reads and handles one URC from the ESP-AT device, if there is one.
+ *
+ ******************************************************************************/
+void EspATMQTT::processUrc() {
   if (_at->available()) {
   char ch;
     // The MQTTSUBRECV URC does not have a line ending which means we need to
@@ -1222,92 +3998,138 @@ void EspATMQTT::process() {
       int ptr = 0;
 
       buff[ptr++] = ch;
-      do {
-        ch = _at->read();
-        buff[ptr++] = ch;
-      } while (ch != ':');
+      if (!readUrc(&ptr, ':', false))
+        return;
       buff[ptr] = '\0';
       if (strstr(&buff[0], MQTT_RESP_SUBRECV)) {
         // We need to read each section of this line until we have read the
         // length of the data after which we can read the remainder of the line.
         // This is so dumb, it is a line based protocol and it should have had
         // cr/lf at the end of the line just like everything else.
-        do {
-          ch = _at->read();
-          buff[ptr++] = ch;
-        } while (ch != ',' && ch != -1);
-
-        // Read the topic
-        do {
-          ch = _at->read();
-          buff[ptr++] = ch;
-        } while (ch != ',' && ch != -1);
+        // Read the link ID and the topic
+        if (!readUrc(&ptr, ',', false) || !readUrc(&ptr, ',', false))
+          return;
 
         // And at last we get to the number of characters in the response
         int lenPtr = ptr;   // Save a pointer to the length
-        do {
-          ch = _at->read();
-          buff[ptr++] = ch;
-        } while (ch != ',' && ch != -1);
+        if (!readUrc(&ptr, ',', false))
+          return;
 
         // Read all the data
-        int len = strtol(&buff[lenPtr], NULL, 10);
-        while(len--) {
-          ch = _at->read();
-          buff[ptr++] = ch;
-        }
+        int dataLen = strtol(&buff[lenPtr], NULL, 10);
+        if (dataLen < 0 || !readUrcData(&ptr, dataLen))
+          return;
         buff[ptr] = '\0';
         dprintf("Received: '%s'\n", &buff[0]);
 
         // Tokenize the incoming data for processing
         const char s[2] = ",";
-        char *tok = strtok(&buff[0], s);      // First section with response and clientID
+        char *tok = strtok(&buff[0], s);      // First section with response and linkID
+        uint32_t linkID = strtol(tok + strlen(MQTT_RESP_SUBRECV), NULL, 10);
         char *topic = strtok(NULL, s) + 1;    // Second with topic minus first " character
-        *(topic + strlen(topic) - 1) = '\0';  // Remove last " character
+        size_t topicLen = strlen(topic) - 1;
+        topic[topicLen] = '\0';               // Remove last " character
         tok = strtok(NULL, s);                // Third field with data length
         // Can't tokenize the data segment as it will corrupt data if a comma
         // is found. Instead we look for a zero and point to the next character.
         while (*tok++ != '\0');
-        if (subscription_cb) {
-          subscription_cb(topic, tok);
-        }
+        deliverMessage(linkID, topic, topicLen, tok, dataLen);
       } else if (strstr(&buff[0], AT_RESP_CIPSNTPTIME)) {
         ptr = 0;
-        do {
-          ch = _at->read();
-          if (ch != '\r' && ch != '\n')
-            buff[ptr++] = ch;
-        } while (ch != '\n');
+        if (!readUrc(&ptr, '\n', true))
+          return;
         buff[ptr] = '\0';
         dprintf("Received URC: %s\n", &buff[0]);
-        // Now check the year  "Tue Jul  5 07:31:56 2022"
-        if (!strstr(&buff[20], "1970")) {
+        // A time in 1970 means that the NTP client is not synced yet
+        uint32_t epoch;
+        if (MqttClock::parseTime(&buff[0], &epoch)) {
+          bool first = !wallClock.isValid();
+          wallClock.sync(epoch - tzOffset, millis());
           // Inform client that a valid time/date has been received.
-          if (validDateTime_cb)
-            ntpTimeValid = true;
+          if (first && dateTimeHandler.fn)
+            dateTimeHandler.fn(dateTimeHandler.ctx, &buff[0], ptr);
+          else if (first && validDateTime_cb)
             validDateTime_cb(&buff[0]);
         }
       } else if (strstr(&buff[0], MQTT_RESP_CONNECTED)) {
         ptr = 0;
-        do {
-          ch = _at->read();
-          if (ch != '\r' && ch != '\n')
-            buff[ptr++] = ch;
-        } while (ch != '\n');
+        if (!readUrc(&ptr, '\n', true))
+          return;
         buff[ptr] = '\0';
         dprintf("Received URC: %s\n", &buff[0]);
-        connected = true;
-        if (connected_cb)
-          connected_cb(&buff[0]);
+        // The line starts with the link ID
+        uint32_t linkID = strtol(&buff[0], NULL, 10);
+        if (linkID < MQTT_MAX_LINKS) {
+          setState(linkID, MQTT_STATE_CONNECTED);
+          if (links[linkID].connected.fn)
+            links[linkID].connected.fn(links[linkID].connected.ctx, &buff[0], ptr);
+          else if (links[linkID].connected_cb)
+            links[linkID].connected_cb(&buff[0]);
+          flushQueue(linkID);
+        }
       } else {
-        do {
-          ch = _at->read();
-          if (ch != '\r' && ch != '\n')
-            buff[ptr++] = ch;
-        } while (ch != '\n');
+        if (!readUrc(&ptr, '\n', true))
+          return;
         buff[ptr] = '\0';
-        dprintf("Unhandled out of bound response: %s\n", &buff[0]);
+        if (!handleUrcLine(&buff[0]))
+          dprintf("Unhandled out of bound response: %s\n", &buff[0]);
       }
     }
   }
 }
+
+/*******************************************************************************
+ *
+ * Reads the next part of a URC into buff, from ptr up to and including the
+ * stop character. CR and LF are left out when stripEol is true. The bytes of
+ * a URC that has started to arrive are not cut short by a deadline.
+ *
+ * @return - false if the ESP-AT device stopped sending in the middle of the
+ *           URC or if the URC does not fit in buff, it is then dropped.
+ *
+ ******************************************************************************/
+bool EspATMQTT::readUrc(int *ptr, char stop, bool stripEol) {
+  int ch;
+
+  do {
+    ch = _at->readByte();
+    if (ch < 0) {
+      dprintf("URC cut short, dropped\n", NULL);
+      return false;
+    }
+    if (*ptr >= MQTT_BUFFER_SIZE - 1) {
+      dprintf("URC too long, dropped\n", NULL);
+      return false;
+    }
+    if (!stripEol || (ch != '\r' && ch != '\n'))
+      buff[(*ptr)++] = ch;
+  } while (ch != stop);
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Reads the len data bytes of a +MQTTSUBRECV into buff from ptr. Data that
+ * does not fit is read and thrown away so that it is not taken for the start
+ * of the next URC.
+ *
+ * @return - false if the data was cut short or did not fit in buff.
+ *
+ ******************************************************************************/
+bool EspATMQTT::readUrcData(int *ptr, int len) {
+  bool fits = *ptr + len < MQTT_BUFFER_SIZE;
+  int ch;
+
+  while (len-- > 0) {
+    ch = _at->readByte();
+    if (ch < 0) {
+      dprintf("Message cut short, dropped\n", NULL);
+      return false;
+    }
+    if (fits)
+      buff[(*ptr)++] = ch;
+  }
+  if (!fits)
+    dprintf("Message too long for MQTT_BUFFER_SIZE, dropped\n", NULL);
+  return fits;
+}
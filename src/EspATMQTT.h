@@ -37,8 +37,30 @@
 
 #include <inttypes.h>
 #include <AT.h>
+#include <MqttPubQueue.h>
+#include <MqttJournal.h>
+#include <MqttRateLimiter.h>
+#include <MqttClock.h>
+#include <MqttValueCache.h>
+#include <MqttDedup.h>
 
 #define MQTT_BUFFER_SIZE              1024
+#define MQTT_PUB_INLINE_THRESHOLD     128   /**< Default max payload size sent with +MQTTPUB by #EspATMQTT::publish() */
+#define MQTT_INFLIGHT_MAX             8     /**< Max number of raw publishes awaiting +MQTTPUB:OK/FAIL */
+#define MQTT_PUB_MAX_RETRIES          3     /**< Default number of resends of a failed QoS 1/2 publish */
+#define MQTT_PUB_TIMEOUT              5000  /**< Default time (ms) to wait for +MQTTPUB:OK/FAIL */
+#define MQTT_PUB_PROMPT_TIMEOUT       1000  /**< Default time (ms) to wait for the '>' prompt of +MQTTPUBRAW */
+#define MQTT_PUB_HANDLES              8     /**< Max number of publish handles in use at the same time */
+#define MQTT_RECONNECT_MIN_BACKOFF    1000  /**< Default delay (ms) before the first reconnect attempt */
+#define MQTT_RECONNECT_MAX_BACKOFF    60000 /**< Default max delay (ms) between reconnect attempts */
+#define MQTT_BEGIN_PROBE_TIME         250   /**< Time (ms) allowed for a reply to a probe in begin() */
+#define MQTT_RECONNECT_TIMEOUT        10000 /**< Time (ms) allowed for the reply to a reconnect attempt */
+#define MQTT_CFG_STORE_SIZE           768   /**< Space for the configuration that is replayed on reconnect */
+#define MQTT_LANE_WEIGHT              4     /**< Default number of urgent messages sent per bulk message */
+#define MQTT_MAX_BATCHES              4     /**< Max number of topics with a coalescing batch */
+#define MQTT_BATCH_LATENCY            1000  /**< Default max time (ms) a record waits in a batch */
+#define MQTT_MAX_SUBSCRIPTIONS        16    /**< Max number of subscriptions restored on reconnect */
+#define MQTT_SUB_TOPIC_POOL           512   /**< Space for the topic filters of the subscriptions */
 
 /**
  * MQTT configuration schemes
@@ -174,9 +196,50 @@ typedef enum mqtt_connectType_e {
   AT_CONN_ASYNCH                          = 0x1002  /**< MQTT server has not connected yet and is awaiting a connection callback */
 } mqtt_connectType_t;
 
+/**
+ * Priority of an outbound message, see #EspATMQTT::publish().
+ */
+enum mqtt_priority_e {
+  MQTT_PRIORITY_BULK                      = 0, /**< Normal traffic, sent in order */
+  MQTT_PRIORITY_URGENT                    = 1  /**< Control and alarm traffic, sent ahead of bulk messages */
+};
+typedef enum mqtt_priority_e mqtt_priority_t;
+
+/**
+ * How queued urgent and bulk messages share the link, see
+ * #EspATMQTT::setLaneScheduling().
+ */
+enum mqtt_sched_e {
+  MQTT_SCHED_STRICT                       = 0, /**< All urgent messages go before the next bulk message */
+  MQTT_SCHED_WEIGHTED                     = 1  /**< A fixed number of urgent messages per bulk message */
+};
+typedef enum mqtt_sched_e mqtt_sched_t;
+
+/**
+ * How the records of a coalescing batch are framed in the published message,
+ * see #EspATMQTT::enableBatch().
+ */
+enum mqtt_batch_format_e {
+  MQTT_BATCH_JSON_ARRAY                   = 0, /**< Records are JSON values joined into one JSON array */
+  MQTT_BATCH_LENGTH_PREFIXED              = 1  /**< Each record is preceded by its length as 2 bytes, MSB first */
+};
+typedef enum mqtt_batch_format_e mqtt_batch_format_t;
+
+/** @typedef mqtt_conn_state_t
+ * The states of the connection supervisor, see #EspATMQTT::enableAutoReconnect().
+ */
+typedef enum mqtt_conn_state_e {
+  MQTT_STATE_DISCONNECTED                 = 0, /**< Not connected and not trying to connect */
+  MQTT_STATE_CONNECTING                   = 1, /**< Waiting for the broker to accept the connection */
+  MQTT_STATE_CONNECTED                    = 2, /**< Connected to the broker */
+  MQTT_STATE_BACKOFF                      = 3  /**< Connection lost, waiting for the next reconnect attempt */
+} mqtt_conn_state_t;
+
 #define MQTT_ERROR(x)                     (x & 0xffff)
+#define MQTT_PUB_ACCEPTED(x)              ((x) == ESP_AT_SUB_OK || (x) == ESP_AT_SUB_CMD_QUEUED) /**< True if a publish was sent or queued */
 
-#define DEFAULT_LINK_ID                   0  /**< This is the only supported link ID as of version 2.4.0.0 of the ESP-AT firmware */
+#define DEFAULT_LINK_ID                   0  /**< Link ID used when none is given, the only one supported by ESP-AT firmware 2.4.0.0 and older */
+#define MQTT_MAX_LINKS                    2  /**< Number of link IDs handled by the library, newer ESP-AT firmware supports more than one */
 
 /**
  * @typedef subscription_cb_t
@@ -194,6 +257,185 @@ typedef void (*validDateTime_cb_t)(char *dateTime);
  */
 typedef void (*connected_cb_t)(char *connectionString);
 
+/**
+ * @typedef mqtt_message_fn_t
+ * Handler of received messages that carries a context pointer. The link,
+ * and the lengths of the topic and the data, are passed along so that the
+ * handler does not need to count them.
+ */
+typedef void (*mqtt_message_fn_t)(void *ctx, uint32_t linkID, char *topic,
+                                  size_t topicLen, char *data, size_t dataLen);
+/**
+ * @typedef mqtt_event_fn_t
+ * Handler of the connected and valid date/time events that carries a context
+ * pointer. The string is the same as the one given to #connected_cb_t and
+ * #validDateTime_cb_t.
+ */
+typedef void (*mqtt_event_fn_t)(void *ctx, char *str, size_t len);
+
+/**
+ * @typedef mqtt_message_handler_t
+ * A message handler function bound to a context, for instance an object.
+ * Create it with #mqttMessageHandler().
+ */
+typedef struct mqtt_message_handler_s {
+  mqtt_message_fn_t fn;   /**< The handler function, NULL if none */
+  void *ctx;              /**< Passed as the first argument to the function */
+} mqtt_message_handler_t;
+
+/**
+ * @typedef mqtt_event_handler_t
+ * An event handler function bound to a context, for instance an object.
+ * Create it with #mqttEventHandler().
+ */
+typedef struct mqtt_event_handler_s {
+  mqtt_event_fn_t fn;     /**< The handler function, NULL if none */
+  void *ctx;              /**< Passed as the first argument to the function */
+} mqtt_event_handler_t;
+
+/**
+ * Binds a message handler function to a context pointer.
+ */
+inline mqtt_message_handler_t mqttMessageHandler(mqtt_message_fn_t fn,
+                                                 void *ctx = NULL) {
+  mqtt_message_handler_t h = { fn, ctx };
+  return h;
+}
+
+/**
+ * Binds an event handler function to a context pointer.
+ */
+inline mqtt_event_handler_t mqttEventHandler(mqtt_event_fn_t fn,
+                                             void *ctx = NULL) {
+  mqtt_event_handler_t h = { fn, ctx };
+  return h;
+}
+
+/** @cond */
+template <class T, void (T::*M)(uint32_t, char *, size_t, char *, size_t)>
+void mqttMessageTrampoline(void *ctx, uint32_t linkID, char *topic,
+                           size_t topicLen, char *data, size_t dataLen) {
+  (static_cast<T *>(ctx)->*M)(linkID, topic, topicLen, data, dataLen);
+}
+
+template <class T, void (T::*M)(char *, size_t)>
+void mqttEventTrampoline(void *ctx, char *str, size_t len) {
+  (static_cast<T *>(ctx)->*M)(str, len);
+}
+/** @endcond */
+
+/**
+ * Binds a member function to an object, for instance
+ * mqttMessageHandler<Sensor, &Sensor::onMessage>(&sensor). The call goes
+ * through a small function made by the compiler, there is no heap
+ * allocation and no std::function.
+ */
+template <class T, void (T::*M)(uint32_t, char *, size_t, char *, size_t)>
+mqtt_message_handler_t mqttMessageHandler(T *obj) {
+  return mqttMessageHandler(&mqttMessageTrampoline<T, M>, obj);
+}
+
+/**
+ * Binds a member function to an object, see the member version of
+ * #mqttMessageHandler().
+ */
+template <class T, void (T::*M)(char *, size_t)>
+mqtt_event_handler_t mqttEventHandler(T *obj) {
+  return mqttEventHandler(&mqttEventTrampoline<T, M>, obj);
+}
+
+/**
+ * @typedef state_cb_t
+ * This is the callback function data type for connection state changes.
+ * The first parameter is the link that changed state.
+ */
+typedef void (*state_cb_t)(uint32_t linkID, mqtt_conn_state_t oldState,
+                           mqtt_conn_state_t newState);
+
+/**
+ * @typedef mqtt_pub_stats_t
+ * Statistics of the transport chosen by the #EspATMQTT::publish() method.
+ */
+typedef struct mqtt_pub_stats_s {
+  uint32_t inlineCount;   /**< Number of messages sent with +MQTTPUB */
+  uint32_t inlineBytes;   /**< Number of payload bytes sent with +MQTTPUB */
+  uint32_t rawCount;      /**< Number of messages sent with +MQTTPUBRAW */
+  uint32_t rawBytes;      /**< Number of payload bytes sent with +MQTTPUBRAW */
+  uint32_t ackCount;      /**< Number of tracked publishes confirmed with +MQTTPUB:OK */
+  uint32_t failCount;     /**< Number of tracked publishes that failed after all retries */
+  uint32_t retryCount;    /**< Number of resends of failed or timed out publishes */
+  uint32_t batchCount;    /**< Number of coalesced batches published */
+  uint32_t batchRecords;  /**< Number of records sent in coalesced batches */
+} mqtt_pub_stats_t;
+
+/**
+ * @typedef mqtt_batch_t
+ * A coalescing batch collecting records for one topic, see
+ * #EspATMQTT::enableBatch().
+ */
+typedef struct mqtt_batch_s {
+  const char *topic;      /**< The topic of the batch, NULL if the slot is free */
+  uint8_t *buffer;        /**< Caller provided buffer holding the framed records */
+  size_t size;            /**< Size of the buffer */
+  size_t fill;            /**< Number of bytes in the buffer */
+  uint32_t firstAt;       /**< Time the oldest record was added */
+  uint32_t maxLatency;    /**< Max time a record may wait in the batch */
+  uint16_t records;       /**< Number of records in the batch */
+  uint8_t linkID;         /**< The link the batch is published on */
+  uint8_t qos;            /**< Quality of Service of the batch */
+  uint8_t format;         /**< Framing of the records, see #mqtt_batch_format_e */
+} mqtt_batch_t;
+
+/**
+ * @typedef mqtt_subscription_t
+ * An entry in the subscription table. The topic filter itself is kept in a
+ * shared pool to keep the table compact.
+ */
+typedef struct mqtt_subscription_s {
+  subscription_cb_t cb;   /**< Handler of the messages that match the filter */
+  mqtt_message_handler_t handler; /**< Context carrying handler, used instead of cb if set */
+  uint16_t filter;        /**< Offset of the topic filter in the topic pool */
+  uint8_t linkID;         /**< The link the subscription was made on */
+  uint8_t qos;            /**< The QoS of the subscription */
+} mqtt_subscription_t;
+
+/**
+ * @typedef mqtt_link_t
+ * The state that is kept for each MQTT link of the ESP-AT device.
+ */
+typedef struct mqtt_link_s {
+  mqtt_conn_state_t state;      /**< Connection state of the link */
+  connected_cb_t connected_cb;  /**< Called when an asynchronous connect completes */
+  mqtt_event_handler_t connected; /**< Context carrying version of connected_cb */
+  MqttPubQueue queue;           /**< Messages waiting for the link to come up */
+  uint32_t reconnectAttempts;   /**< Failed reconnect attempts since the last connection */
+  uint32_t reconnectAt;         /**< Time of the next reconnect attempt */
+  uint32_t connectStart;        /**< Time the last connect attempt started */
+  bool cfgReplay;               /**< The configuration must be sent again before connecting */
+  bool cfgQueried;              /**< The configuration of the ESP-AT device has been read */
+  bool subRestore;              /**< The subscriptions must be restored */
+} mqtt_link_t;
+
+/**
+ * @typedef mqtt_pub_handle_t
+ * Refers to a publish started with #EspATMQTT::publishAsync(). A handle that
+ * has been released no longer refers to anything, even if its slot is used
+ * again. MQTT_PUB_HANDLE_NONE is never a valid handle.
+ */
+typedef uint16_t            mqtt_pub_handle_t;
+#define MQTT_PUB_HANDLE_NONE              0
+
+/**
+ * @typedef mqtt_inflight_t
+ * Book keeping of a raw publish that is waiting for its +MQTTPUB:OK/FAIL.
+ */
+typedef struct mqtt_inflight_s {
+  uint32_t sentAt;        /**< Time the message was sent */
+  uint8_t state;          /**< Sent, acknowledged or failed */
+  uint8_t retries;        /**< Number of times the message has been resent */
+  mqtt_pub_handle_t handle; /**< Handle completed by the reply, or MQTT_PUB_HANDLE_NONE */
+} mqtt_inflight_t;
+
 /**
  * The return value of an ESP-AT MQTT operation. This value is a combination of
  * the enums mqtt_error_e and mqtt_error_e. The caller should check for both to
@@ -201,6 +443,43 @@ typedef void (*connected_cb_t)(char *connectionString);
  */
 typedef uint32_t            mqtt_status_t;
 
+/**
+ * @typedef mqtt_pub_done_fn_t
+ * Called when a publish started with #EspATMQTT::publishAsync() has
+ * completed, with the status of the publish and the time in milliseconds
+ * from the moment it was sent until the +MQTTPUB:OK/FAIL reply arrived.
+ */
+typedef void (*mqtt_pub_done_fn_t)(void *ctx, mqtt_pub_handle_t handle,
+                                   mqtt_status_t status, uint32_t latency);
+
+/**
+ * @typedef mqtt_pub_slot_t
+ * The state behind a #mqtt_pub_handle_t.
+ */
+typedef struct mqtt_pub_slot_s {
+  mqtt_pub_done_fn_t fn;  /**< Completion callback, or NULL */
+  void *ctx;              /**< Context passed to the callback */
+  mqtt_status_t status;   /**< Status of the publish once it has completed */
+  uint32_t sentAt;        /**< Time the publish was sent */
+  uint32_t latency;       /**< Time (ms) until the publish completed */
+  uint8_t gen;            /**< Generation of the slot, part of the handle */
+  uint8_t state;          /**< Free, pending or done */
+} mqtt_pub_slot_t;
+
+/**
+ * @typedef mqtt_begin_result_t
+ * The outcome of #EspATMQTT::begin(), with the time each part took so that
+ * the start up time can be budgeted and measured.
+ */
+typedef struct mqtt_begin_result_s {
+  mqtt_status_t status;   /**< The status of begin(), also the return value */
+  uint32_t readyTime;     /**< Time (ms) until the ESP-AT device answered */
+  uint32_t totalTime;     /**< Total time (ms) spent in begin() */
+  uint32_t probes;        /**< Number of probes sent before the device answered */
+  bool readyBanner;       /**< The "ready" banner of a starting device was seen */
+  bool syslogSet;         /**< SYSLOG had to be enabled */
+} mqtt_begin_result_t;
+
 /*******************************************************************************
  * EspAT MQTT EspATMQTT class definition
  ******************************************************************************/
@@ -210,6 +489,7 @@ public:
   EspATMQTT(AT_Class* at);
 
   mqtt_status_t begin();
+  mqtt_status_t begin(uint32_t deadline, mqtt_begin_result_t *result = NULL);
   mqtt_status_t userConfig(uint32_t linkID, mqtt_scheme_t scheme, const char *clientID,
                            const char *userName="", const char *password="",
                            uint32_t certKeyID=0, uint32_t caID=0,
@@ -224,6 +504,9 @@ public:
   mqtt_status_t connect(uint32_t linkID, const char *host,
                            uint32_t port=1883, uint32_t reconnect=0,
                            uint32_t timeout = 5000, connected_cb_t cb = NULL);
+  mqtt_status_t connect(uint32_t linkID, const char *host, uint32_t port,
+                           uint32_t reconnect, uint32_t timeout,
+                           mqtt_event_handler_t handler);
   mqtt_status_t setClientID(uint32_t linkID, const char *clientID);
   mqtt_status_t setClientID(uint32_t linkID, char *clientID);
   mqtt_status_t setUsername(uint32_t linkID, const char *username);
@@ -247,29 +530,199 @@ public:
                            uint32_t qos=0, uint32_t retain=0);
   mqtt_status_t pubRaw(uint32_t linkID, const char *topic, char *data,
                            uint32_t qos=0, uint32_t retain=0);
+  mqtt_status_t pubRaw(uint32_t linkID, const char *topic, const uint8_t *data,
+                           size_t len, uint32_t qos=0, uint32_t retain=0);
+  mqtt_status_t pubRaw(uint32_t linkID, const char *topic,
+                           const mqtt_buffer_t *bufs, size_t count,
+                           uint32_t qos=0, uint32_t retain=0);
+  mqtt_status_t pubBinary(uint32_t linkID, const char *topic, const uint8_t *data,
+                           size_t len, uint32_t qos=0, uint32_t retain=0);
+  mqtt_status_t publish(uint32_t linkID, const char *topic, const char *data,
+                           uint32_t qos=0, uint32_t retain=0,
+                           mqtt_priority_t priority = MQTT_PRIORITY_BULK);
+  mqtt_status_t publish(uint32_t linkID, const char *topic, const uint8_t *data,
+                           size_t len, uint32_t qos=0, uint32_t retain=0,
+                           mqtt_priority_t priority = MQTT_PRIORITY_BULK);
+  mqtt_pub_handle_t publishAsync(uint32_t linkID, const char *topic,
+                           const char *data, uint32_t qos=0, uint32_t retain=0);
+  mqtt_pub_handle_t publishAsync(uint32_t linkID, const char *topic,
+                           const uint8_t *data, size_t len, uint32_t qos=0,
+                           uint32_t retain=0);
+  bool publishDone(mqtt_pub_handle_t handle, mqtt_status_t *status = NULL,
+                           uint32_t *latency = NULL);
+  mqtt_status_t waitPublish(mqtt_pub_handle_t handle, uint32_t timeout,
+                           uint32_t *latency = NULL);
+  bool onPublishDone(mqtt_pub_handle_t handle, mqtt_pub_done_fn_t fn,
+                           void *ctx);
+  void releasePublish(mqtt_pub_handle_t handle);
+  mqtt_status_t enablePublishQueue(uint8_t *arena, size_t size,
+                           mqtt_queue_policy_t policy = MQTT_QUEUE_DROP_OLDEST);
+  mqtt_status_t enablePublishQueue(uint32_t linkID, uint8_t *arena, size_t size,
+                           mqtt_queue_policy_t policy = MQTT_QUEUE_DROP_OLDEST);
+  mqtt_status_t enableJournal(MqttJournal *journal);
+  mqtt_status_t enableValueCache(MqttValueCache *cache);
+  mqtt_status_t enableDedup(MqttDedup *dedup);
+  mqtt_status_t enableUrgentLane(uint8_t *arena, size_t size,
+                           mqtt_queue_policy_t policy = MQTT_QUEUE_DROP_OLDEST);
+  void setLaneScheduling(mqtt_sched_t mode, uint32_t weight = MQTT_LANE_WEIGHT);
+  mqtt_status_t enableInflight(uint8_t *arena, size_t size,
+                           uint32_t window = MQTT_INFLIGHT_MAX,
+                           uint32_t retries = MQTT_PUB_MAX_RETRIES);
+  mqtt_status_t enableBatch(uint32_t linkID, const char *topic, uint8_t *buffer,
+                           size_t size,
+                           mqtt_batch_format_t format = MQTT_BATCH_JSON_ARRAY,
+                           uint32_t maxLatency = MQTT_BATCH_LATENCY,
+                           uint32_t qos = 0);
+  mqtt_status_t batch(uint32_t linkID, const char *topic, const char *data);
+  mqtt_status_t batch(uint32_t linkID, const char *topic, const uint8_t *data,
+                           size_t len);
+  mqtt_status_t flushBatch(uint32_t linkID, const char *topic);
+  void flushBatches();
+  size_t inflightPublishes();
+  void setPublishTimeout(uint32_t timeout);
+  void setPromptTimeout(uint32_t timeout);
+  mqtt_status_t setRateLimit(uint32_t msgsPerSecond, uint32_t bytesPerSecond,
+                           bool autoTune = false);
+  bool publishCredit(size_t len);
+  uint32_t publishWaitTime(size_t len);
+  size_t queuedPublishes();
+  uint32_t droppedPublishes();
+  void setPublishThreshold(size_t threshold);
+  const mqtt_pub_stats_t *getPublishStats();
   mqtt_status_t subscribeTopic(subscription_cb_t cb, uint32_t linkID, const char * topic, uint32_t qos=0);
   mqtt_status_t subscribeTopic(subscription_cb_t cb, uint32_t linkID, char * topic, uint32_t qos=0);
+  mqtt_status_t subscribeTopic(mqtt_message_handler_t handler, uint32_t linkID,
+                           const char *topic, uint32_t qos=0);
   mqtt_status_t unSubscribeTopic(uint32_t linkID, const char * topic);
   mqtt_status_t unSubscribeTopic(uint32_t linkID, char * topic);
+  size_t subscriptions();
   mqtt_status_t close(uint32_t linkID);
 
   // Non MQTT stuff but needed or usefull to get things going
   mqtt_status_t enableNTPTime(bool enable, validDateTime_cb_t cb, uint32_t timezone,
                            const char *ts1 = NULL, const char *ts2 = NULL,
                            const char *ts3 = NULL);
+  mqtt_status_t enableNTPTime(bool enable, mqtt_event_handler_t handler,
+                           uint32_t timezone, const char *ts1 = NULL,
+                           const char *ts2 = NULL, const char *ts3 = NULL);
   mqtt_status_t getNTPTime(char **time);
-  bool isConnected();
+  bool timeValid();
+  uint32_t getEpoch();
+  uint64_t getTimeMs();
+  bool getTime(uint32_t *epoch, uint16_t *ms);
+  size_t formatTime(char *buffer, size_t size, bool withMs = true);
+  void setTimeSyncInterval(uint32_t interval);
+  int32_t getClockDrift();
+  bool isConnected(uint32_t linkID = DEFAULT_LINK_ID);
+  mqtt_status_t enableAutoReconnect(bool enable,
+                           uint32_t minBackoff = MQTT_RECONNECT_MIN_BACKOFF,
+                           uint32_t maxBackoff = MQTT_RECONNECT_MAX_BACKOFF);
+  void setStateCallback(state_cb_t cb);
+  void enableConfigDiffing(bool enable);
+  AtDeadline *setDeadline(AtDeadline *deadline);
+  mqtt_conn_state_t getState(uint32_t linkID = DEFAULT_LINK_ID);
   void process();
 private:
+  mqtt_status_t sendConfig(uint32_t linkID, uint8_t cfg);
+  void rememberConfig(uint32_t linkID, uint8_t cfg, const char *params);
+  void forgetConfig(uint32_t linkID, uint8_t cfg);
+  const char *storedConfig(uint32_t linkID, uint8_t cfg);
+  mqtt_status_t replayConfig(uint32_t linkID);
+  void queryConfig(uint32_t linkID);
+  bool configApplied(uint32_t linkID, uint8_t cfg, const char *params);
+  void setState(uint32_t linkID, mqtt_conn_state_t state);
+  void connectionLost(uint32_t linkID);
+  void checkLinkStatus(uint32_t linkID, mqtt_status_t status);
+  void scheduleReconnect(uint32_t linkID);
+  void superviseConnection(uint32_t linkID);
+  int findSubscription(uint32_t linkID, const char *topic);
+  bool addSubscription(subscription_cb_t cb, mqtt_message_handler_t handler,
+                           uint32_t linkID, const char *topic, uint32_t qos);
+  void removeSubscription(int ix);
+  void restoreSubscriptions(uint32_t linkID);
+  bool deliverMessage(uint32_t linkID, char *topic, size_t topicLen,
+                           char *data, size_t dataLen);
+  mqtt_status_t submitPublish(uint8_t type, uint32_t linkID, const char *topic,
+                           const mqtt_buffer_t *bufs, size_t count,
+                           uint32_t qos, uint32_t retain,
+                           mqtt_priority_t priority = MQTT_PRIORITY_BULK);
+  mqtt_status_t sendPublish(uint8_t type, uint32_t linkID, const char *topic,
+                           const mqtt_buffer_t *bufs, size_t count,
+                           uint32_t qos, uint32_t retain);
+  mqtt_status_t transmitPublish(uint8_t type, uint32_t linkID, const char *topic,
+                           const mqtt_buffer_t *bufs, size_t count, size_t len,
+                           uint32_t qos, uint32_t retain);
+  mqtt_status_t waitPublishCredit(size_t len);
+  mqtt_status_t pubRawSegments(uint32_t linkID, const char *topic,
+                           const mqtt_buffer_t *bufs, size_t count, size_t len,
+                           uint32_t qos, uint32_t retain, uint8_t retries = 0);
+  void flushQueue(uint32_t linkID);
+  void flushUrgent(uint32_t max);
+  mqtt_batch_t *findBatch(uint32_t linkID, const char *topic);
+  mqtt_status_t sendBatch(mqtt_batch_t *b);
+  void replayJournal();
+  mqtt_status_t trackInflight(uint32_t linkID, const char *topic,
+                           const mqtt_buffer_t *bufs, size_t count,
+                           uint32_t qos, uint32_t retain, uint8_t retries);
+  mqtt_status_t waitInflightWindow(const char *topic, size_t dataLen);
+  void serviceInflight();
+  void pubAck(bool ok);
+  mqtt_pub_slot_t *findPubSlot(mqtt_pub_handle_t handle);
+  void completePublish(mqtt_pub_handle_t handle, mqtt_status_t status);
+  void notifyPublishes();
+  uint32_t budget(uint32_t timeout, at_phase_t phase);
+  static bool urcHandler(void *ctx, const char *line);
+  bool handleUrcLine(const char *line);
+  void processUrc();
+  bool readUrc(int *ptr, char stop, bool stripEol);
+  bool readUrcData(int *ptr, int len);
+
   AT_Class *_at;
   subscription_cb_t subscription_cb;
+  mqtt_message_handler_t subscriptionHandler;
   validDateTime_cb_t validDateTime_cb;
+  mqtt_event_handler_t dateTimeHandler;
   mqtt_connectType_t connType;
-  connected_cb_t connected_cb;
+  mqtt_link_t links[MQTT_MAX_LINKS];
+
+  size_t pubThreshold;
+  mqtt_pub_stats_t pubStats;
+  MqttJournal *pubJournal;
+  MqttValueCache *valueCache;
+  MqttDedup *dedup;
+  MqttPubQueue urgentLane;
+  mqtt_sched_t laneSched;
+  uint32_t laneWeight;
+  MqttPubQueue inflight;
+  mqtt_inflight_t inflightMeta[MQTT_INFLIGHT_MAX + 1];
+  uint32_t inflightHead;
+  uint32_t inflightWindow;
+  uint32_t inflightRetries;
+  bool inflightBusy;
+  uint32_t inflightLate;    /**< Replies still owed for messages that timed out */
+  uint32_t pubTimeout;
+  uint32_t promptTimeout;
+  mqtt_pub_slot_t pubSlots[MQTT_PUB_HANDLES];
+  mqtt_pub_handle_t pubHandle;  /**< Handle given to the next tracked publish */
+  MqttRateLimiter rateLimiter;
+  mqtt_batch_t batches[MQTT_MAX_BATCHES];
+
+  state_cb_t state_cb;
+  bool autoReconnect;
+  uint32_t backoffMin;
+  uint32_t backoffMax;
+  bool cfgDiffing;
+  size_t cfgUsed;
+  char cfgStore[MQTT_CFG_STORE_SIZE];
+
+  mqtt_subscription_t subs[MQTT_MAX_SUBSCRIPTIONS];
+  uint32_t subCount;
+  size_t subTopicsUsed;
+  char subTopics[MQTT_SUB_TOPIC_POOL];
 
-  int topicSubscriptions;
-  bool connected;
-  bool ntpTimeValid;
+  MqttClock wallClock;
+  int32_t tzOffset;
+  bool ntpEnabled;
 
   char buff[MQTT_BUFFER_SIZE];
 };
@@ -0,0 +1,78 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <EspATModule.h>
+
+/** @file */
+
+/*******************************************************************************
+ *
+ * Creates the AT_Class of the device and binds the EspATMQTT and
+ * MqttCertMgmt objects to it. The MqttCertMgmt borrows its buffers from the
+ * arena of the module.
+ *
+ * @param - serial The serial port that is connected to the ESP-AT module.
+ *
+ ******************************************************************************/
+EspATModule::EspATModule(HardwareSerial* serial)
+  : _at(serial), _mqtt(&_at), _certs(&_at) {
+  scratch.begin((uint8_t *)scratchMem, sizeof(scratchMem));
+  _certs.setScratch(&scratch);
+}
+
+/*******************************************************************************
+ *
+ * Returns the AT_Class of the device, for sending AT commands that the
+ * library has no method for.
+ *
+ ******************************************************************************/
+AT_Class &EspATModule::at() {
+  return _at;
+}
+
+/*******************************************************************************
+ *
+ * Returns the MQTT client of the device.
+ *
+ ******************************************************************************/
+EspATMQTT &EspATModule::mqtt() {
+  return _mqtt;
+}
+
+/*******************************************************************************
+ *
+ * Returns the certificate management of the device.
+ *
+ ******************************************************************************/
+MqttCertMgmt &EspATModule::certs() {
+  return _certs;
+}
@@ -0,0 +1,80 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_ESP_AT_MODULE_
+#define _H_ESP_AT_MODULE_
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <AT.h>
+#include <EspATMQTT.h>
+#include <MqttCertMgmt.h>
+
+/*******************************************************************************
+ * EspATModule class definition
+ *
+ * One ESP-AT device. The module owns the single AT_Class that talks to the
+ * device and the EspATMQTT and MqttCertMgmt objects bound to it, all as
+ * plain members so nothing is allocated from the heap and everything goes
+ * away with the module. Having one AT_Class means one set of AT buffers and
+ * one parser reading the serial port, so replies can not end up in the wrong
+ * object. The module also holds the scratch arena of the MqttCertMgmt, of
+ * MQTT_CERT_SCRATCH_SIZE bytes, so that it does not allocate one of its own.
+ * An arena given to certs().setScratch() replaces it.
+ *
+ * The EspATMQTT and MqttCertMgmt constructors that take a HardwareSerial each
+ * create an AT_Class of their own and should not be used for a device that
+ * is shared.
+ ******************************************************************************/
+class EspATModule {
+public:
+  EspATModule(HardwareSerial* = &ESP_SERIAL_PORT);
+
+  AT_Class &at();
+  EspATMQTT &mqtt();
+  MqttCertMgmt &certs();
+private:
+  EspATModule(const EspATModule &);
+  EspATModule &operator=(const EspATModule &);
+
+  // The AT_Class must come first, it is constructed before the objects that
+  // are bound to it.
+  AT_Class _at;
+  EspATMQTT _mqtt;
+  MqttCertMgmt _certs;
+  MqttScratch scratch;    /**< Arena of the certificate management */
+  uint32_t scratchMem[(MQTT_CERT_SCRATCH_SIZE + 3) / 4]; /**< Memory of the arena, word aligned */
+};
+
+#endif
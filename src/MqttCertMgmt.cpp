@@ -38,6 +38,15 @@
 
 /** @file */
 
+/*
+ * Borrows a buffer from the scratch arena for the rest of the scope.
+ */
+#define CERT_BORROW(name, size) \
+  MqttScratchLease name##Lease(arena(), size); \
+  char *name = (char *)name##Lease.data(); \
+  if (!name) \
+    return ESP_AT_SUB_CMD_NO_MEMORY
+
 /**
  * List of partition names that holds mqtt certificates.
  */
@@ -72,6 +81,8 @@ static const char *AT_CMD_SYSFLASH_RESP        = "+SYSFLASH:";
  ******************************************************************************/
 MqttCertMgmt::MqttCertMgmt(HardwareSerial* serial) {
   _at = new AT_Class(serial);
+  scratch = NULL;
+  ownMem = NULL;
 }
 
 /*******************************************************************************
@@ -81,6 +92,50 @@ MqttCertMgmt::MqttCertMgmt(HardwareSerial* serial) {
  ******************************************************************************/
 MqttCertMgmt::MqttCertMgmt(AT_Class* at) {
   _at = at;
+  scratch = NULL;
+  ownMem = NULL;
+}
+
+/*******************************************************************************
+ *
+ * Frees the arena of the class, if it was ever allocated.
+ *
+ ******************************************************************************/
+MqttCertMgmt::~MqttCertMgmt() {
+  delete[] ownMem;
+}
+
+/*******************************************************************************
+ *
+ * Sets the scratch arena the buffers are borrowed from. The operations need
+ * the size of the PKI item plus a few hundred bytes, see
+ * MqttScratch::highWater(). Without an arena the class allocates one of
+ * MQTT_CERT_SCRATCH_SIZE bytes from the heap the first time it needs a
+ * buffer, and keeps it until the class is destroyed.
+ *
+ * @param[in] - scratch
+ *    The arena, it must stay valid for as long as the class is used. NULL
+ *    goes back to the arena of the class.
+ *
+ ******************************************************************************/
+void MqttCertMgmt::setScratch(MqttScratch *scratch) {
+  this->scratch = scratch;
+}
+
+/*******************************************************************************
+ *
+ * Returns the arena to borrow buffers from, the one given to #setScratch()
+ * or else the own arena of the class.
+ *
+ ******************************************************************************/
+MqttScratch *MqttCertMgmt::arena() {
+  if (scratch)
+    return scratch;
+  if (!ownMem) {
+    ownMem = new uint8_t[MQTT_CERT_SCRATCH_SIZE];
+    ownScratch.begin(ownMem, MQTT_CERT_SCRATCH_SIZE);
+  }
+  return &ownScratch;
 }
 
 /*******************************************************************************
@@ -158,6 +213,7 @@ at_status_t MqttCertMgmt::comparePkiItem(uint32_t partition,
   }
 
   // All seems fine so far, lets get the certificate from FLASH to compare.
+  CERT_BORROW(certBuff, pki_item.len);
   status = readSysFlash(partition, &certBuff[0], 12, pki_item.len);
   if (status != ESP_AT_SUB_OK)
     return status;
@@ -453,6 +509,7 @@ at_status_t MqttCertMgmt::getPkiHeader(uint32_t partition, pki_item_t *pki_item,
  ******************************************************************************/
 at_status_t MqttCertMgmt::erasePartition(uint32_t partition) {
   at_status_t status;
+  CERT_BORROW(pBuff, MQTT_CERT_PARAM_BUFFER_LENGTH);
 
   snprintf(pBuff, 128, "=0,\"%s\"", mqtt_parts[partition]);
   status = _at->sendCommand(AT_CMD_SYSFLASH, pBuff, NULL);
@@ -489,6 +546,7 @@ at_status_t MqttCertMgmt::writeSysFlash(uint32_t partition, const char *buffer,
   at_status_t status;
   size_t len = length;
   const char *buf = buffer;
+  CERT_BORROW(pBuff, MQTT_CERT_PARAM_BUFFER_LENGTH);
 
   snprintf(pBuff, 128, "=1,\"%s\",%d,%d",
            mqtt_parts[partition], offset, length);
@@ -552,6 +610,7 @@ at_status_t MqttCertMgmt::writeSysFlash(uint32_t partition, char *buffer,
  ******************************************************************************/
 at_status_t MqttCertMgmt::readSysFlash(uint32_t partition, char *buffer,
             uint32_t offset, size_t length) {
+  CERT_BORROW(pBuff, MQTT_CERT_PARAM_BUFFER_LENGTH);
 
   snprintf(pBuff, 128, "=2,\"%s\",%d,%d",
            mqtt_parts[partition], offset, length);
@@ -585,16 +644,19 @@ at_status_t MqttCertMgmt::readSysFlash(uint32_t partition, char *buffer,
  ******************************************************************************/
 at_status_t MqttCertMgmt::getFlashData(const char *cmd, char *param,
                          char *retBuff, uint32_t timeout) {
+  CERT_BORROW(buff, MQTT_CERT_CMD_BUFFER_LENGTH);
 
-  snprintf(buff, MQTT_CERT_BUFFER_LENGTH, "AT%s%s\r\n", cmd, param);
+  snprintf(buff, MQTT_CERT_CMD_BUFFER_LENGTH, "AT%s%s\r\n", cmd, param);
   _at->sendString(buff);
 
-  snprintf(buff, MQTT_CERT_BUFFER_LENGTH, "AT%s%s", cmd, param);
+  snprintf(buff, MQTT_CERT_CMD_BUFFER_LENGTH, "AT%s%s", cmd, param);
   dprintf("S:\'%s\'\n", buff);
 
   // Ensure that we have received at least a start of the reply within the
   // given timeout.
   uint32_t to = millis();
+  if (_at->getDeadline())
+    timeout = _at->getDeadline()->limit(timeout, AT_PHASE_COMMAND);
   while (!_at->available() && (millis() - to < timeout))
     yield();
   if (millis() - to >= timeout)
@@ -603,6 +665,11 @@ at_status_t MqttCertMgmt::getFlashData(const char *cmd, char *param,
   // Make sure we read in the response identifier (+SYSFLASH:)
   int ix = 0;
   do {
+    // Keep the tail of what has been read if the buffer fills up
+    if (ix == MQTT_CERT_CMD_BUFFER_LENGTH - 1) {
+      memmove(&buff[0], &buff[ix - 16], 16);
+      ix = 16;
+    }
     buff[ix++] = _at->read();
     buff[ix] = 0;   // Always terminate the incoming string
   } while (!strstr(&buff[0], AT_CMD_SYSFLASH_RESP) && (millis() - to < timeout));
@@ -616,7 +683,7 @@ at_status_t MqttCertMgmt::getFlashData(const char *cmd, char *param,
   do {
     ch = _at->read();
     buff[ix++] = ch;
-  } while (isdigit(ch) && (millis() - to < timeout));
+  } while (isdigit(ch) && ix < MQTT_CERT_CMD_BUFFER_LENGTH - 1 && (millis() - to < timeout));
   buff[ix] = '\0';
   // Check for timeout
   if (millis() - to >= timeout)
@@ -30,13 +30,21 @@
  * ----------------------------------------------------------------------------
  */
 
-#include <AT.h>
-
 /** @file */
 
+#ifndef _H_MQTT_CERT_MGMT_
+#define _H_MQTT_CERT_MGMT_
+
+#include <AT.h>
+#include <MqttScratch.h>
+
 #define MQTT_MAX_CERTIFICATE_LENGTH     2048
 #define MQTT_CERT_BUFFER_LENGTH         MQTT_MAX_CERTIFICATE_LENGTH
 #define MQTT_CERT_PARAM_BUFFER_LENGTH   128
+#define MQTT_CERT_CMD_BUFFER_LENGTH     256   /**< Size of the command buffer borrowed for each command */
+#define MQTT_CERT_SCRATCH_SIZE          (MQTT_MAX_CERTIFICATE_LENGTH + \
+                                         MQTT_CERT_PARAM_BUFFER_LENGTH + \
+                                         MQTT_CERT_CMD_BUFFER_LENGTH + 32) /**< Size of the arena allocated when none is given to setScratch() */
 
 /*
  * Partition table from a ESP32C3 version 2.3.0<br>
@@ -119,11 +127,18 @@ typedef struct pki_item_s {
 
 /**
  * EspAT PKI item manager class definition
+ *
+ * The class keeps no buffers of its own. Each operation borrows what it
+ * needs from the scratch arena given to #setScratch() and returns it before
+ * the method returns, so the RAM can be shared with other code. Without an
+ * arena one of MQTT_CERT_SCRATCH_SIZE bytes is allocated from the heap the
+ * first time it is needed, and freed with the class.
  */
 class MqttCertMgmt {
 public:
   MqttCertMgmt(HardwareSerial* = &ESP_SERIAL_PORT);
   MqttCertMgmt(AT_Class* at);
+  ~MqttCertMgmt();
 
   at_status_t readPkiItem(uint32_t partition, char *pkiBuffer, size_t length,
               pki_item_t *pki_item, uint32_t index = 0);
@@ -141,6 +156,7 @@ public:
               size_t length);
   at_status_t erasePartition(uint32_t partition);
   const char *getPartitionName(uint32_t partition);
+  void setScratch(MqttScratch *scratch);
 private:
   at_status_t getPkiHeader(uint32_t partition, pki_item_t *pki_item,
               uint32_t index = 0);
@@ -153,9 +169,15 @@ private:
   at_status_t getFlashData(const char *cmd, char *parms, char *retBuff,
               uint32_t timeout=2000);
   at_status_t checkIfValid(uint32_t partition, bool *result);
+  MqttScratch *arena();
+
+  MqttCertMgmt(const MqttCertMgmt &);
+  MqttCertMgmt &operator=(const MqttCertMgmt &);
 
   AT_Class *_at;
-  char buff[MQTT_CERT_BUFFER_LENGTH];             // Output and input buffer
-  char pBuff[MQTT_CERT_PARAM_BUFFER_LENGTH];      // Parameter buffer
-  char certBuff[MQTT_MAX_CERTIFICATE_LENGTH];     // Temporary buffer for holding certificates
+  MqttScratch *scratch;                           // Arena the buffers are borrowed from
+  MqttScratch ownScratch;                         // Arena used when none is set
+  uint8_t *ownMem;                                // Memory of the own arena, allocated when first used
 };
+
+#endif
@@ -0,0 +1,359 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <MqttClock.h>
+
+/** @file */
+
+// An NTP reading of second S means that the time is somewhere within
+// [S, S + 1), the middle of it is the best guess.
+#define CLK_HALF_SECOND   500
+
+/*******************************************************************************
+ *
+ * The constructor leaves the clock unset with the default sync interval.
+ *
+ ******************************************************************************/
+MqttClock::MqttClock() {
+  interval = MQTT_CLOCK_SYNC_INTERVAL;
+  reset();
+}
+
+/*******************************************************************************
+ *
+ * Forgets the time and the drift estimate, the clock is invalid until the
+ * next #sync().
+ *
+ ******************************************************************************/
+void MqttClock::reset() {
+  baseMs = 0;
+  baseAt = 0;
+  refMs = 0;
+  refAt = 0;
+  driftErr = 0;
+  driftSpan = 0;
+  lastSync = 0;
+  driftPpm = 0;
+  syncs = 0;
+  valid = false;
+}
+
+/*******************************************************************************
+ *
+ * Syncs the clock with an NTP time reading.
+ *
+ * @param[in] - epoch
+ *      The NTP time in seconds since 1970-01-01 00:00:00 UTC.
+ *
+ * @param[in] - now
+ *      The millis() value when the time was read.
+ *
+ ******************************************************************************/
+void MqttClock::sync(uint32_t epoch, uint32_t now) {
+  uint64_t low = (uint64_t)epoch * 1000;
+  uint64_t ntpMs = low + CLK_HALF_SECOND;
+
+  if (!valid) {
+    baseMs = ntpMs;
+    refMs = ntpMs;
+    refAt = now;
+  } else {
+    uint64_t local = epochMs(now);
+    uint32_t elapsed = now - refAt;
+
+    // Compare the NTP time passed with the millis() passed since the last
+    // sync. The periods follow each other, so the rounding of the readings
+    // in between cancels out in the sums and only the first and the last
+    // reading count.
+    driftErr += (int64_t)(ntpMs - refMs) - elapsed;
+    driftSpan += elapsed;
+    refMs = ntpMs;
+    refAt = now;
+    if (driftSpan >= MQTT_CLOCK_MIN_DRIFT_TIME) {
+      int64_t ppm = driftErr * 1000000 / (int64_t)driftSpan;
+
+      if (ppm > MQTT_CLOCK_MAX_DRIFT)
+        ppm = MQTT_CLOCK_MAX_DRIFT;
+      else if (ppm < -MQTT_CLOCK_MAX_DRIFT)
+        ppm = -MQTT_CLOCK_MAX_DRIFT;
+      driftPpm = (int32_t)ppm;
+    }
+    while (driftSpan > MQTT_CLOCK_DRIFT_HORIZON) {
+      driftErr /= 2;
+      driftSpan /= 2;
+    }
+
+    // Only step the clock if it has left the reported second.
+    if (local < low)
+      baseMs = low;
+    else if (local > low + 999)
+      baseMs = low + 999;
+    else
+      baseMs = local;
+  }
+  baseAt = now;
+  lastSync = now;
+  syncs++;
+  valid = true;
+}
+
+/*******************************************************************************
+ *
+ * Returns true if the clock has been synced at least once.
+ *
+ ******************************************************************************/
+bool MqttClock::isValid() {
+  return valid;
+}
+
+/*******************************************************************************
+ *
+ * Returns true if the clock needs a new NTP time reading, because it has
+ * never been synced or the sync interval has passed.
+ *
+ * @param[in] - now
+ *      The current millis() value.
+ *
+ ******************************************************************************/
+bool MqttClock::syncDue(uint32_t now) {
+  return !valid || (interval && now - lastSync >= interval);
+}
+
+/*******************************************************************************
+ *
+ * Sets the time between two resyncs, 0 syncs only once.
+ *
+ ******************************************************************************/
+void MqttClock::setSyncInterval(uint32_t interval) {
+  this->interval = interval;
+}
+
+/*******************************************************************************
+ *
+ * Returns the current time.
+ *
+ * @param[in] - now
+ *      The current millis() value.
+ *
+ * @return - The time in milliseconds since 1970-01-01 00:00:00 UTC, 0 if
+ *      the clock has not been synced.
+ *
+ ******************************************************************************/
+uint64_t MqttClock::epochMs(uint32_t now) {
+  uint32_t elapsed = now - baseAt;
+
+  if (!valid)
+    return 0;
+  return baseMs + elapsed + (int64_t)elapsed * driftPpm / 1000000;
+}
+
+/*******************************************************************************
+ *
+ * Returns the current time in seconds since 1970-01-01 00:00:00 UTC, 0 if
+ * the clock has not been synced.
+ *
+ ******************************************************************************/
+uint32_t MqttClock::epoch(uint32_t now) {
+  return (uint32_t)(epochMs(now) / 1000);
+}
+
+/*******************************************************************************
+ *
+ * Returns the estimated drift of millis() in parts per million. A positive
+ * value means that millis() runs slow.
+ *
+ ******************************************************************************/
+int32_t MqttClock::drift() {
+  return driftPpm;
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of times the clock has been synced.
+ *
+ ******************************************************************************/
+uint32_t MqttClock::syncCount() {
+  return syncs;
+}
+
+// Reads a decimal number of at most max digits, skipping leading blanks.
+static const char *parseNumber(const char *p, uint32_t max, uint32_t *value) {
+  uint32_t n = 0;
+  uint32_t digits = 0;
+
+  while (*p == ' ')
+    p++;
+  while (*p >= '0' && *p <= '9' && digits < max) {
+    n = n * 10 + (*p++ - '0');
+    digits++;
+  }
+  *value = n;
+  return digits ? p : NULL;
+}
+
+/*******************************************************************************
+ *
+ * Converts a time string from the ESP-AT device, like
+ * "Tue Jul  5 07:31:56 2022", to seconds since 1970-01-01 00:00:00. The
+ * string is parsed in place in one pass, no library calls are made.
+ *
+ * @param[in] - str
+ *      The time string.
+ *
+ * @param[out] - epoch
+ *      The time in seconds.
+ *
+ * @return - true if the string holds a valid time. The ESP-AT device reports
+ *      a time in 1970 until it has been in contact with a time server, such
+ *      a time is not valid.
+ *
+ ******************************************************************************/
+bool MqttClock::parseTime(const char *str, uint32_t *epoch) {
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  uint32_t mon, day, hour, min, sec, year;
+  const char *p = str;
+
+  // Skip the week day
+  while (*p && *p != ' ')
+    p++;
+  while (*p == ' ')
+    p++;
+  for (mon = 0; mon < 12; mon++) {
+    if (p[0] == months[mon * 3] && p[1] == months[mon * 3 + 1] &&
+        p[2] == months[mon * 3 + 2])
+      break;
+  }
+  if (mon == 12)
+    return false;
+  p += 3;
+
+  if (!(p = parseNumber(p, 2, &day)) || *p++ != ' ' ||
+      !(p = parseNumber(p, 2, &hour)) || *p++ != ':' ||
+      !(p = parseNumber(p, 2, &min)) || *p++ != ':' ||
+      !(p = parseNumber(p, 2, &sec)) ||
+      !(p = parseNumber(p, 4, &year)))
+    return false;
+  if (year < 2000 || year > 2105 || !day || day > 31 || hour > 23 ||
+      min > 59 || sec > 60)
+    return false;
+
+  *epoch = daysFromCivil(year, mon + 1, day) * 86400 + hour * 3600 +
+           min * 60 + sec;
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of days from 1970-01-01 to a date. The year is counted
+ * from March so that the leap day is the last day of the year.
+ *
+ ******************************************************************************/
+uint32_t MqttClock::daysFromCivil(uint32_t year, uint32_t mon, uint32_t day) {
+  uint32_t y = year - (mon <= 2);
+  uint32_t era = y / 400;
+  uint32_t yoe = y - era * 400;
+  uint32_t doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+  uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+  return era * 146097 + doe - 719468;
+}
+
+// Writes a number with a fixed number of digits.
+static char *putNumber(char *p, uint32_t value, uint32_t digits) {
+  for (uint32_t i = digits; i > 0; i--) {
+    p[i - 1] = '0' + value % 10;
+    value /= 10;
+  }
+  return p + digits;
+}
+
+/*******************************************************************************
+ *
+ * Formats a time as ISO-8601 text in UTC, like "2022-07-05T07:31:56.123Z".
+ *
+ * @param[in] - epochMs
+ *      The time in milliseconds since 1970-01-01 00:00:00 UTC.
+ *
+ * @param[out] - buffer
+ *      The buffer the '\0' terminated text is written to.
+ *
+ * @param[in] - size
+ *      The size of the buffer. At least MQTT_ISO_TIME_SIZE bytes are needed
+ *      with milliseconds and 4 bytes less without.
+ *
+ * @param[in] - withMs
+ *      true to include the milliseconds.
+ *
+ * @return - The length of the text, 0 if the buffer is too small.
+ *
+ ******************************************************************************/
+size_t MqttClock::formatIso(uint64_t epochMs, char *buffer, size_t size,
+                            bool withMs) {
+  size_t len = withMs ? MQTT_ISO_TIME_SIZE - 1 : MQTT_ISO_TIME_SIZE - 5;
+  uint32_t secs = (uint32_t)(epochMs / 1000);
+  uint32_t days = secs / 86400;
+  uint32_t tod = secs % 86400;
+  char *p = buffer;
+
+  if (!buffer || size <= len)
+    return 0;
+
+  // The inverse of daysFromCivil()
+  uint32_t z = days + 719468;
+  uint32_t era = z / 146097;
+  uint32_t doe = z - era * 146097;
+  uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  uint32_t mp = (5 * doy + 2) / 153;
+  uint32_t day = doy - (153 * mp + 2) / 5 + 1;
+  uint32_t mon = mp < 10 ? mp + 3 : mp - 9;
+  uint32_t year = yoe + era * 400 + (mon <= 2);
+
+  p = putNumber(p, year, 4);
+  *p++ = '-';
+  p = putNumber(p, mon, 2);
+  *p++ = '-';
+  p = putNumber(p, day, 2);
+  *p++ = 'T';
+  p = putNumber(p, tod / 3600, 2);
+  *p++ = ':';
+  p = putNumber(p, (tod / 60) % 60, 2);
+  *p++ = ':';
+  p = putNumber(p, tod % 60, 2);
+  if (withMs) {
+    *p++ = '.';
+    p = putNumber(p, (uint32_t)(epochMs % 1000), 3);
+  }
+  *p++ = 'Z';
+  *p = '\0';
+  return len;
+}
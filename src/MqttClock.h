@@ -0,0 +1,98 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_MQTT_CLOCK_
+#define _H_MQTT_CLOCK_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define MQTT_CLOCK_SYNC_INTERVAL    3600000 /**< Default time (ms) between two clock resyncs */
+#define MQTT_CLOCK_RETRY_TIME       1000    /**< Time (ms) between two time queries while waiting for a sync */
+#define MQTT_CLOCK_MIN_DRIFT_TIME   21600000 /**< Min time (ms) the drift is measured over before it is corrected */
+#define MQTT_CLOCK_DRIFT_HORIZON    604800000 /**< Time (ms) of measurement after which older syncs count half */
+#define MQTT_CLOCK_MAX_DRIFT        200     /**< Max drift (ppm) that is corrected */
+#define MQTT_ISO_TIME_SIZE          25      /**< Buffer size for "YYYY-MM-DDThh:mm:ss.sssZ" */
+
+/*******************************************************************************
+ * MqttClock class definition
+ *
+ * A local wall clock. It is set from one NTP time reading and then runs from
+ * millis(), so reading the time costs no traffic to the ESP-AT device. Each
+ * resync compares the NTP time passed with the millis() passed since the
+ * previous one. The differences and the periods are summed up, so each
+ * period counts by its length, and the drift is the ratio of the two sums.
+ * The one second resolution of the NTP time then only matters once over the
+ * whole measurement, and no correction is made until it has lasted
+ * MQTT_CLOCK_MIN_DRIFT_TIME, when that second is below 50 ppm. Past
+ * MQTT_CLOCK_DRIFT_HORIZON the sums are halved, so the estimate follows a
+ * slow change of the oscillator, with temperature for instance.
+ *
+ * NTP readings have a resolution of one second, so a resync only moves the
+ * clock when it is outside the second reported by the ESP-AT device. The time
+ * never jumps by more than what is needed to get back within that second.
+ ******************************************************************************/
+class MqttClock {
+public:
+  MqttClock();
+
+  void reset();
+  void sync(uint32_t epoch, uint32_t now);
+  bool isValid();
+  bool syncDue(uint32_t now);
+  void setSyncInterval(uint32_t interval);
+  uint64_t epochMs(uint32_t now);
+  uint32_t epoch(uint32_t now);
+  int32_t drift();
+  uint32_t syncCount();
+
+  static bool parseTime(const char *str, uint32_t *epoch);
+  static uint32_t daysFromCivil(uint32_t year, uint32_t mon, uint32_t day);
+  static size_t formatIso(uint64_t epochMs, char *buffer, size_t size,
+                          bool withMs = true);
+private:
+  uint32_t interval;      /**< Time between two resyncs */
+  uint64_t baseMs;        /**< Epoch time in milliseconds at baseAt */
+  uint32_t baseAt;        /**< The millis() value the clock runs from */
+  uint64_t refMs;         /**< NTP time of the last sync */
+  uint32_t refAt;         /**< The millis() value of the last sync */
+  int64_t driftErr;       /**< Sum of the NTP time passed minus the millis() passed */
+  uint64_t driftSpan;     /**< Sum of the millis() passed, the time driftErr is measured over */
+  uint32_t lastSync;      /**< Time of the last sync */
+  int32_t driftPpm;       /**< Estimated drift of millis(), in parts per million */
+  uint32_t syncs;         /**< Number of syncs */
+  bool valid;
+};
+
+#endif
@@ -0,0 +1,243 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <MqttCoro.h>
+
+/** @file */
+
+#ifdef MQTT_HAS_COROUTINES
+
+/*******************************************************************************
+ *
+ * Creates the coroutine layer of an EspATMQTT object.
+ *
+ * @param[in] - mqtt
+ *      The MQTT object.
+ * @param[in] - certs
+ *      The certificate management of the same device, only needed for
+ *      #readPkiItem().
+ *
+ ******************************************************************************/
+MqttCoro::MqttCoro(EspATMQTT *mqtt, MqttCertMgmt *certs) {
+  this->mqtt = mqtt;
+  this->certs = certs;
+}
+
+/*******************************************************************************
+ *
+ * Returns the executor that runs the tasks.
+ *
+ ******************************************************************************/
+MqttExecutor &MqttCoro::executor() {
+  return exec;
+}
+
+/*******************************************************************************
+ *
+ * Starts a task, see MqttExecutor::spawn().
+ *
+ ******************************************************************************/
+bool MqttCoro::spawn(MqttTask task) {
+  return exec.spawn(static_cast<MqttTask &&>(task));
+}
+
+/*******************************************************************************
+ *
+ * Processes the ESP-AT device and then resumes the tasks whose operations
+ * have completed. Call it from the loop instead of EspATMQTT::process().
+ *
+ ******************************************************************************/
+void MqttCoro::process() {
+  mqtt->process();
+  exec.run(millis());
+}
+
+/*******************************************************************************
+ *
+ * Condition of #connect(), the link is up.
+ *
+ ******************************************************************************/
+bool MqttCoro::connected(MqttWait *wait, bool expired) {
+  MqttCoro *self = (MqttCoro *)wait->ctx;
+
+  if (self->mqtt->isConnected(wait->arg)) {
+    wait->status = ESP_AT_SUB_OK;
+    return true;
+  }
+  if (expired) {
+    wait->status = ESP_AT_SUB_CMD_TIMEOUT;
+    return true;
+  }
+  return false;
+}
+
+/*******************************************************************************
+ *
+ * Connects to a broker, see EspATMQTT::connect(). The task waits until the
+ * connection is made.
+ *
+ * @param[in] - timeout
+ *      The time, in milliseconds, allowed for the connection to be made.
+ *
+ * @return - The awaitable, its status is ESP_AT_SUB_OK when connected or
+ *           ESP_AT_SUB_CMD_TIMEOUT. See #mqtt_error_e and #status_code_e for
+ *           more information.
+ *
+ ******************************************************************************/
+MqttWait MqttCoro::connect(uint32_t linkID, const char *host, uint32_t port,
+                           uint32_t reconnect, uint32_t timeout) {
+  mqtt_status_t status;
+
+  status = mqtt->connect(linkID, host, port, reconnect, MQTT_CORO_CONNECT_TIME,
+                         (connected_cb_t)NULL);
+  if (status == ESP_AT_SUB_CMD_CONN_SYNCH)
+    return MqttWait(ESP_AT_SUB_OK);
+  if (status != ESP_AT_SUB_CMD_CONN_ASYNCH)
+    return MqttWait(status);
+  return MqttWait(&exec, connected, this, linkID, timeout, millis());
+}
+
+/*******************************************************************************
+ *
+ * Condition of #publish(), the handle of the publish has completed. The
+ * handle is given back when the wait is over.
+ *
+ ******************************************************************************/
+bool MqttCoro::published(MqttWait *wait, bool expired) {
+  MqttCoro *self = (MqttCoro *)wait->ctx;
+  mqtt_pub_handle_t handle = (mqtt_pub_handle_t)wait->arg;
+
+  if (self->mqtt->publishDone(handle, &wait->status)) {
+    self->mqtt->releasePublish(handle);
+    return true;
+  }
+  if (expired) {
+    self->mqtt->releasePublish(handle);
+    wait->status = ESP_AT_SUB_CMD_TIMEOUT;
+    return true;
+  }
+  return false;
+}
+
+/*******************************************************************************
+ *
+ * Publishes data, see EspATMQTT::publishAsync(). The task waits until the
+ * ESP-AT device has replied with +MQTTPUB:OK or FAIL.
+ *
+ * @param[in] - timeout
+ *      The time, in milliseconds, allowed for the reply.
+ *
+ * @return - The awaitable, its status is the outcome of the publish.
+ *
+ ******************************************************************************/
+MqttWait MqttCoro::publish(uint32_t linkID, const char *topic,
+                           const uint8_t *data, size_t len, uint32_t qos,
+                           uint32_t retain, uint32_t timeout) {
+  mqtt_pub_handle_t handle;
+
+  handle = mqtt->publishAsync(linkID, topic, data, len, qos, retain);
+  if (handle == MQTT_PUB_HANDLE_NONE)
+    return MqttWait(ESP_AT_SUB_CMD_QUEUE_FULL);
+  return MqttWait(&exec, published, this, handle, timeout, millis());
+}
+
+/*******************************************************************************
+ *
+ * Publishes a '\0' terminated string, see the binary version of #publish().
+ *
+ ******************************************************************************/
+MqttWait MqttCoro::publish(uint32_t linkID, const char *topic,
+                           const char *data, uint32_t qos, uint32_t retain,
+                           uint32_t timeout) {
+  return publish(linkID, topic, (const uint8_t *)data, strlen(data), qos,
+                 retain, timeout);
+}
+
+/*******************************************************************************
+ *
+ * Subscribes to a topic, see EspATMQTT::subscribeTopic(). The ESP-AT device
+ * answers the subscription directly so the awaitable is always complete.
+ *
+ ******************************************************************************/
+MqttWait MqttCoro::subscribe(mqtt_message_handler_t handler, uint32_t linkID,
+                             const char *topic, uint32_t qos) {
+  return MqttWait(mqtt->subscribeTopic(handler, linkID, topic, qos));
+}
+
+/*******************************************************************************
+ *
+ * Reads a PKI item, see MqttCertMgmt::readPkiItem(). The awaitable is always
+ * complete.
+ *
+ ******************************************************************************/
+MqttWait MqttCoro::readPkiItem(uint32_t partition, char *pkiBuffer,
+                               size_t length, pki_item_t *pki_item,
+                               uint32_t index) {
+  if (!certs)
+    return MqttWait(ESP_AT_SUB_CMD_ERROR);
+  return MqttWait(certs->readPkiItem(partition, pkiBuffer, length, pki_item,
+                                     index));
+}
+
+/*******************************************************************************
+ *
+ * Condition of #timeSync(), the time has been received from the ESP-AT device.
+ *
+ ******************************************************************************/
+bool MqttCoro::timeValid(MqttWait *wait, bool expired) {
+  MqttCoro *self = (MqttCoro *)wait->ctx;
+
+  if (self->mqtt->timeValid()) {
+    wait->status = ESP_AT_SUB_OK;
+    return true;
+  }
+  if (expired) {
+    wait->status = ESP_AT_SUB_CMD_TIMEOUT;
+    return true;
+  }
+  return false;
+}
+
+/*******************************************************************************
+ *
+ * Waits for the NTP time, EspATMQTT::enableNTPTime() must have been called.
+ *
+ * @param[in] - timeout
+ *      The time, in milliseconds, allowed for the time to become valid.
+ *
+ ******************************************************************************/
+MqttWait MqttCoro::timeSync(uint32_t timeout) {
+  return MqttWait(&exec, timeValid, this, 0, timeout, millis());
+}
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_MQTT_CORO_
+#define _H_MQTT_CORO_
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <EspATMQTT.h>
+#include <MqttCertMgmt.h>
+#include <MqttTask.h>
+
+#ifdef MQTT_HAS_COROUTINES
+
+#define MQTT_CORO_CONNECT_TIME    500   /**< Time (ms) connect() blocks before the wait is left to the executor */
+
+/*******************************************************************************
+ * MqttCoro class definition
+ *
+ * Awaitable versions of the slow EspATMQTT and MqttCertMgmt operations for
+ * tasks run by a #MqttExecutor, so a flow like connect, subscribe, publish
+ * and wait for the acknowledge can be written as one coroutine. Each AT
+ * command is still sent and answered in one bounded call, as the ESP-AT
+ * device handles one command at a time, but the waits that follow, for the
+ * connection, the +MQTTPUB:OK or a valid time, suspend the task instead of
+ * blocking, so many flows can share one loop.
+ *
+ * #process() replaces EspATMQTT::process() in the loop of the application.
+ ******************************************************************************/
+class MqttCoro {
+public:
+  MqttCoro(EspATMQTT *mqtt, MqttCertMgmt *certs = NULL);
+
+  MqttExecutor &executor();
+  bool spawn(MqttTask task);
+  void process();
+
+  MqttWait connect(uint32_t linkID, const char *host, uint32_t port = 1883,
+                   uint32_t reconnect = 0,
+                   uint32_t timeout = MQTT_RECONNECT_TIMEOUT);
+  MqttWait publish(uint32_t linkID, const char *topic, const uint8_t *data,
+                   size_t len, uint32_t qos = 0, uint32_t retain = 0,
+                   uint32_t timeout = MQTT_PUB_TIMEOUT);
+  MqttWait publish(uint32_t linkID, const char *topic, const char *data,
+                   uint32_t qos = 0, uint32_t retain = 0,
+                   uint32_t timeout = MQTT_PUB_TIMEOUT);
+  MqttWait subscribe(mqtt_message_handler_t handler, uint32_t linkID,
+                   const char *topic, uint32_t qos = 0);
+  MqttWait readPkiItem(uint32_t partition, char *pkiBuffer, size_t length,
+                   pki_item_t *pki_item, uint32_t index = 0);
+  MqttWait timeSync(uint32_t timeout);
+private:
+  static bool connected(MqttWait *wait, bool expired);
+  static bool published(MqttWait *wait, bool expired);
+  static bool timeValid(MqttWait *wait, bool expired);
+
+  EspATMQTT *mqtt;
+  MqttCertMgmt *certs;
+  MqttExecutor exec;
+};
+
+#endif
+#endif
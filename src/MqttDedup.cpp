@@ -0,0 +1,221 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <MqttDedup.h>
+
+/** @file */
+
+#define FNV_OFFSET        2166136261u
+#define FNV_PRIME         16777619u
+
+static uint32_t fnv(uint32_t hash, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+/*******************************************************************************
+ *
+ * The constructor creates an empty window that hashes the whole payload and
+ * remembers messages for MQTT_DEDUP_MAX_AGE milliseconds.
+ *
+ ******************************************************************************/
+MqttDedup::MqttDedup() {
+  keyFn = NULL;
+  keyCtx = NULL;
+  maxAge = MQTT_DEDUP_MAX_AGE;
+  reset();
+}
+
+/*******************************************************************************
+ *
+ * Sets a function that gives the key of a message, instead of hashing the
+ * whole payload. Use it when a message carries a sequence number or an ID,
+ * so that a new message with the same content is still delivered.
+ *
+ * @param[in] - fn
+ *      The key function, see #mqtt_dedup_key_fn_t. NULL to hash the payload.
+ * @param[in] - ctx
+ *      A pointer that is passed on to the key function.
+ *
+ ******************************************************************************/
+void MqttDedup::setKey(mqtt_dedup_key_fn_t fn, void *ctx) {
+  keyFn = fn;
+  keyCtx = ctx;
+}
+
+/*******************************************************************************
+ *
+ * Sets how long a message is remembered. When the payload is hashed this
+ * lets a value that really is sent again, like an unchanged setpoint, through
+ * after a while.
+ *
+ * @param[in] - maxAge
+ *      The time in milliseconds, 0 to remember messages until they are pushed
+ *      out of the window. 0 needs a key function, without one every repeat
+ *      of a payload within the window would be dropped, see
+ *      EspATMQTT::enableDedup().
+ *
+ ******************************************************************************/
+void MqttDedup::setMaxAge(uint32_t maxAge) {
+  this->maxAge = maxAge;
+}
+
+/*******************************************************************************
+ *
+ * Returns true if a key function is set, see #setKey().
+ *
+ ******************************************************************************/
+bool MqttDedup::hasKey() {
+  return keyFn != NULL;
+}
+
+/*******************************************************************************
+ *
+ * Returns the time, in milliseconds, a message is remembered, 0 for no limit.
+ *
+ ******************************************************************************/
+uint32_t MqttDedup::getMaxAge() {
+  return maxAge;
+}
+
+/*******************************************************************************
+ *
+ * Forgets all remembered messages and clears the counter.
+ *
+ ******************************************************************************/
+void MqttDedup::reset() {
+  head = 0;
+  count = 0;
+  dupCount = 0;
+}
+
+/*******************************************************************************
+ *
+ * Checks if a message is a duplicate of a recent one. A message that is not
+ * a duplicate is remembered.
+ *
+ * @param[in] - topic
+ *      The topic of the message, it does not have to be '\0' terminated.
+ * @param[in] - topicLen
+ *      The length of the topic.
+ * @param[in] - data
+ *      The payload.
+ * @param[in] - dataLen
+ *      The length of the payload.
+ * @param[in] - now
+ *      The current time in milliseconds, millis() on an Arduino.
+ *
+ * @return - true if the message should be dropped.
+ *
+ ******************************************************************************/
+bool MqttDedup::isDuplicate(const char *topic, size_t topicLen,
+                            const char *data, size_t dataLen, uint32_t now) {
+  uint32_t hash = fnv(FNV_OFFSET, topic, topicLen);
+  uint32_t key;
+
+  // A separator so that "a/b" + "c" and "a/" + "bc" differ.
+  hash = fnv(hash, "", 1);
+  if (keyFn) {
+    if (!keyFn(keyCtx, topic, topicLen, data, dataLen, &key))
+      return false;
+    hash = fnv(hash, &key, sizeof(key));
+  } else {
+    hash = fnv(hash, data, dataLen);
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t ix = (head + MQTT_DEDUP_WINDOW - 1 - i) % MQTT_DEDUP_WINDOW;
+
+    if (maxAge && now - seenAt[ix] > maxAge)
+      break;
+    if (keys[ix] == hash) {
+      dupCount++;
+      return true;
+    }
+  }
+
+  keys[head] = hash;
+  seenAt[head] = now;
+  head = (head + 1) % MQTT_DEDUP_WINDOW;
+  if (count < MQTT_DEDUP_WINDOW)
+    count++;
+  return false;
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of duplicates found since the last #reset().
+ *
+ ******************************************************************************/
+uint32_t MqttDedup::duplicates() {
+  return dupCount;
+}
+
+/*******************************************************************************
+ *
+ * A key function, see #mqtt_dedup_key_fn_t, that uses a number field of a
+ * JSON payload as the key, like {"seq":1234,"value":21.5}.
+ *
+ * @param[in] - ctx
+ *      The name of the field, for instance "seq", as a const char *.
+ *
+ * @return - false if the payload has no such field.
+ *
+ ******************************************************************************/
+bool MqttDedup::jsonSequence(void *ctx, const char * /* topic */,
+                             size_t /* topicLen */, const char *data,
+                             size_t dataLen, uint32_t *key) {
+  const char *name = (const char *)ctx;
+  size_t nameLen = strlen(name);
+  const char *end = data + dataLen;
+
+  for (const char *p = data; p + nameLen + 2 < end; p++) {
+    if (*p != '"' || strncmp(p + 1, name, nameLen) || p[nameLen + 1] != '"')
+      continue;
+    p += nameLen + 2;
+    while (p < end && (*p == ' ' || *p == ':'))
+      p++;
+    if (p == end || *p < '0' || *p > '9')
+      return false;
+    *key = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+      *key = *key * 10 + (*p++ - '0');
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,95 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_MQTT_DEDUP_
+#define _H_MQTT_DEDUP_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define MQTT_DEDUP_WINDOW         16    /**< Number of recent messages remembered */
+#define MQTT_DEDUP_MAX_AGE        10000 /**< Default time (ms) a message is remembered, see MqttDedup::setMaxAge() */
+
+/**
+ * @typedef mqtt_dedup_key_fn_t
+ * Gives the key that identifies a message, for instance a sequence number
+ * found in the payload. Messages with the same topic and key are duplicates.
+ * Returns false if the message has no key, it is then always delivered.
+ */
+typedef bool (*mqtt_dedup_key_fn_t)(void *ctx, const char *topic,
+                                    size_t topicLen, const char *data,
+                                    size_t dataLen, uint32_t *key);
+
+/*******************************************************************************
+ * MqttDedup class definition
+ *
+ * Drops messages that have already been delivered, like the copies a broker
+ * sends again of QoS 1 messages after a reconnect. The last
+ * MQTT_DEDUP_WINDOW messages are remembered as 32 bit hashes of the topic and
+ * either the whole payload or the key given by a key function. A message
+ * that matches one of them, and is not older than the max age, is a
+ * duplicate.
+ *
+ * Without a key function a message that really is sent again with the same
+ * payload, like a repeated command, is dropped as well if it arrives within
+ * the max age, MQTT_DEDUP_MAX_AGE unless changed with #setMaxAge().
+ ******************************************************************************/
+class MqttDedup {
+public:
+  MqttDedup();
+
+  void setKey(mqtt_dedup_key_fn_t fn, void *ctx);
+  void setMaxAge(uint32_t maxAge);
+  bool hasKey();
+  uint32_t getMaxAge();
+  void reset();
+
+  bool isDuplicate(const char *topic, size_t topicLen, const char *data,
+                   size_t dataLen, uint32_t now);
+  uint32_t duplicates();
+
+  static bool jsonSequence(void *ctx, const char *topic, size_t topicLen,
+                           const char *data, size_t dataLen, uint32_t *key);
+private:
+  mqtt_dedup_key_fn_t keyFn;    /**< Key function, NULL to hash the payload */
+  void *keyCtx;                 /**< Context passed to the key function */
+  uint32_t maxAge;              /**< Time (ms) a message is remembered, 0 for no limit */
+  uint32_t keys[MQTT_DEDUP_WINDOW]; /**< Hashes of the recent messages */
+  uint32_t seenAt[MQTT_DEDUP_WINDOW]; /**< Time each message was received */
+  uint32_t head;                /**< Where the next message is remembered */
+  uint32_t count;               /**< Number of remembered messages */
+  uint32_t dupCount;            /**< Number of duplicates dropped */
+};
+
+#endif
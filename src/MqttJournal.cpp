@@ -0,0 +1,756 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <MqttJournal.h>
+
+/** @file */
+
+#define JRN_SECTOR_MAGIC      0x314a514d  /* "MQJ1" */
+#define JRN_REC_MAGIC         0xa5
+#define JRN_STATE_PENDING     0xfe
+#define JRN_STATE_CONSUMED    0x00
+#define JRN_ALIGN(x)          (((x) + 3) & ~((uint32_t)3))
+
+/**
+ * Header found at the beginning of each sector of the journal.
+ */
+typedef struct jrn_sector_s {
+  uint32_t magic;
+  uint32_t seq;
+} jrn_sector_t;
+
+/**
+ * Header found in front of each message in the journal. The payload that
+ * follows is a #mqtt_pub_record_t, the topic and the message data.
+ */
+typedef struct jrn_rec_s {
+  uint16_t len;           /* Payload length, 0xffff means unwritten space */
+  uint8_t state;          /* JRN_STATE_PENDING or JRN_STATE_CONSUMED */
+  uint8_t magic;
+  uint32_t crc;           /* CRC32 of the payload */
+} jrn_rec_t;
+
+#define JRN_SEC_HDR           sizeof(jrn_sector_t)
+#define JRN_REC_HDR           sizeof(jrn_rec_t)
+#define JRN_REC_SIZE(len)     (JRN_REC_HDR + JRN_ALIGN(len))
+
+/*******************************************************************************
+ *
+ * Plain bitwise CRC32 (IEEE 802.3). Only used when writing a message and when
+ * loading it for replay, so a table driven version is not worth the memory.
+ *
+ ******************************************************************************/
+static uint32_t crc32(const uint8_t *data, size_t len) {
+  uint32_t crc = 0xffffffff;
+
+  while (len--) {
+    crc ^= *data++;
+    for (int i = 0; i < 8; i++)
+      crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
+
+/*******************************************************************************
+ *
+ * The constructor leaves the journal disabled until #begin() is called.
+ *
+ ******************************************************************************/
+MqttJournal::MqttJournal() {
+  _storage = NULL;
+  _policy = MQTT_QUEUE_DROP_NEWEST;
+  secSize = 0;
+  sectors = 0;
+  pendingCount = 0;
+  drops = 0;
+  flushInterval = MQTT_JOURNAL_FLUSH_INTERVAL;
+  dirtyTimed = false;
+  replayRate = 0;
+  credit = 0;
+  creditTime = 0;
+  hLoaded = false;
+}
+
+/*******************************************************************************
+ *
+ * Attaches the journal to a storage and recovers any messages left in it
+ * from before a reboot. The sectors are put in order using their sequence
+ * numbers and every message is verified. A message with a bad CRC is marked
+ * as consumed and counted as dropped, the same way #peek() skips a message
+ * that is found damaged later, and the scan continues after it. A header
+ * that is not valid ends the sector it is in.
+ *
+ * @param[in] - storage
+ *      The storage holding the journal. It must have at least two sectors.
+ *
+ * @param[in] - buffer
+ *      A caller provided work buffer of at least two sectors. The first
+ *      sector is used to collect appended messages and the second to load
+ *      the message being replayed.
+ *
+ * @param[in] - bufferSize
+ *      The size of the work buffer in bytes.
+ *
+ * @param[in] - policy
+ *      What to do when the journal is full, see #mqtt_queue_policy_e. With
+ *      MQTT_QUEUE_DROP_OLDEST a whole sector of the oldest messages is
+ *      dropped to make room.
+ *
+ * @return - true if the journal is ready to be used.
+ *
+ ******************************************************************************/
+bool MqttJournal::begin(MqttStorage *storage, uint8_t *buffer,
+                        size_t bufferSize, mqtt_queue_policy_t policy) {
+  jrn_sector_t sh;
+  jrn_rec_t rh;
+  bool found = false;
+  bool headSet = false;
+  bool torn = false;
+
+  _storage = NULL;
+  pendingCount = 0;
+  drops = 0;
+  hLoaded = false;
+  dirtyTimed = false;
+  if (!storage)
+    return false;
+
+  secSize = storage->sectorSize();
+  sectors = secSize ? storage->size() / secSize : 0;
+  if (sectors < 2 || secSize < 64 || secSize > 0xffff || bufferSize < 2 * secSize)
+    return false;
+
+  _storage = storage;
+  _policy = policy;
+  wBuff = buffer;
+  rBuff = buffer + secSize;
+  wSector = sectors;    // No sector loaded in the write buffer yet
+
+  // Find the most recently written sector
+  for (uint32_t s = 0; s < sectors; s++) {
+    if (!_storage->read(sectorBase(s), &sh, sizeof(sh)))
+      continue;
+    if (sh.magic == JRN_SECTOR_MAGIC && (!found || sh.seq > wSeq)) {
+      found = true;
+      wSeq = sh.seq;
+      hSector = s;
+    }
+  }
+
+  if (!found) {
+    if (!startSector(0, 1)) {
+      _storage = NULL;
+      return false;
+    }
+    hSector = 0;
+    hOffset = JRN_SEC_HDR;
+    return true;
+  }
+
+  // Walk backwards to the oldest sector of the journal
+  uint32_t last = hSector;
+  uint32_t seq = wSeq;
+  for (uint32_t i = 1; i < sectors; i++) {
+    uint32_t prev = (hSector + sectors - 1) % sectors;
+    if (!_storage->read(sectorBase(prev), &sh, sizeof(sh)) ||
+        sh.magic != JRN_SECTOR_MAGIC || sh.seq != seq - 1)
+      break;
+    hSector = prev;
+    seq--;
+  }
+
+  // Now scan all messages from the oldest sector to the last one
+  for (uint32_t s = hSector; ; s = (s + 1) % sectors) {
+    uint32_t off = JRN_SEC_HDR;
+
+    while (off + JRN_REC_HDR <= secSize) {
+      if (!readHeader(s, off, &rh) || rh.len == 0xffff)
+        break;
+      if (!validHeader(&rh, off)) {
+        torn = torn || (s == last);
+        break;
+      }
+      if (rh.state == JRN_STATE_PENDING && !loadRecord(s, off, true)) {
+        // Damaged, most likely torn by a power loss. Retire it for good.
+        markConsumed(s, off);
+        torn = torn || (s == last);
+        drops++;
+      } else if (rh.state == JRN_STATE_PENDING) {
+        pendingCount++;
+        if (!headSet) {
+          headSet = true;
+          hSector = s;
+          hOffset = off;
+        }
+      }
+      off += JRN_REC_SIZE(rh.len);
+    }
+    if (s == last) {
+      wFill = off;
+      break;
+    }
+  }
+
+  wSector = last;
+  if (!_storage->read(sectorBase(wSector), wBuff, secSize)) {
+    _storage = NULL;
+    return false;
+  }
+  if (torn) {
+    // Never write after a damaged message, continue in the next sector.
+    wFill = secSize;
+  }
+  wFlushed = wFill;
+  if (!headSet) {
+    hSector = wSector;
+    hOffset = wFill;
+  }
+
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * @return - true if the journal has been attached to a storage.
+ *
+ ******************************************************************************/
+bool MqttJournal::isEnabled() {
+  return _storage != NULL;
+}
+
+/*******************************************************************************
+ *
+ * Appends a message to the journal. The message is collected in RAM and
+ * written to the storage when the sector is full, when #sync() is called or
+ * when the flush interval has elapsed (see #service()).
+ *
+ * @param[in] - rec
+ *      The message header, topicLen and dataLen are filled in by the journal.
+ *
+ * @param[in] - topic
+ *      The '\0' terminated topic of the message.
+ *
+ * @param[in] - bufs
+ *      The segments making up the message data.
+ *
+ * @param[in] - count
+ *      The number of segments.
+ *
+ * @return - true if the message was stored, false if it was dropped.
+ *
+ ******************************************************************************/
+bool MqttJournal::append(const mqtt_pub_record_t *rec, const char *topic,
+                         const mqtt_buffer_t *bufs, size_t count) {
+  mqtt_pub_record_t hdr = *rec;
+  jrn_rec_t rh;
+  size_t topicLen = strlen(topic) + 1;
+  size_t dataLen = 0;
+
+  if (!_storage)
+    return false;
+
+  for (size_t i = 0; i < count; i++)
+    dataLen += bufs[i].len;
+
+  size_t len = sizeof(hdr) + topicLen + dataLen;
+  if (len > secSize - JRN_SEC_HDR - JRN_REC_HDR) {
+    drops++;
+    return false;
+  }
+  if (wFill + JRN_REC_SIZE(len) > secSize && !nextSector()) {
+    drops++;
+    return false;
+  }
+  if (!pendingCount) {
+    hSector = wSector;
+    hOffset = wFill;
+    hLoaded = false;
+  }
+
+  hdr.topicLen = topicLen;
+  hdr.dataLen = dataLen;
+  uint8_t *ptr = &wBuff[wFill + JRN_REC_HDR];
+  memcpy(ptr, &hdr, sizeof(hdr));
+  ptr += sizeof(hdr);
+  memcpy(ptr, topic, topicLen);
+  ptr += topicLen;
+  for (size_t i = 0; i < count; i++) {
+    memcpy(ptr, bufs[i].data, bufs[i].len);
+    ptr += bufs[i].len;
+  }
+
+  rh.len = len;
+  rh.state = JRN_STATE_PENDING;
+  rh.magic = JRN_REC_MAGIC;
+  rh.crc = crc32(&wBuff[wFill + JRN_REC_HDR], len);
+  memcpy(&wBuff[wFill], &rh, sizeof(rh));
+
+  wFill += JRN_REC_SIZE(len);
+  pendingCount++;
+
+  // Write the sector as soon as no more messages fits in it.
+  if (wFill + JRN_REC_SIZE(sizeof(hdr) + 2) > secSize)
+    sync();
+
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Returns the oldest pending message without removing it. The returned
+ * pointers point into the work buffer and are valid until #pop() is called.
+ *
+ * @param[out] - rec
+ *      The header of the message.
+ *
+ * @param[out] - topic
+ *      A pointer to the '\0' terminated topic of the message.
+ *
+ * @param[out] - data
+ *      A pointer to the message data, rec->dataLen bytes long.
+ *
+ * @return - true if a message was returned, false if the journal is empty.
+ *
+ ******************************************************************************/
+bool MqttJournal::peek(mqtt_pub_record_t *rec, const char **topic,
+                       const uint8_t **data) {
+  jrn_rec_t rh;
+
+  while (!hLoaded && pendingCount) {
+    if (hSector == wSector && hOffset >= wFill) {
+      // Nothing more has been written, the counter is out of sync.
+      pendingCount = 0;
+      break;
+    }
+    if (hOffset + JRN_REC_HDR > secSize || !readHeader(hSector, hOffset, &rh) ||
+        rh.len == 0xffff || !validHeader(&rh, hOffset)) {
+      // End of this sector, continue with the next one
+      hSector = (hSector + 1) % sectors;
+      hOffset = JRN_SEC_HDR;
+      continue;
+    }
+    if (rh.state != JRN_STATE_PENDING) {
+      hOffset += JRN_REC_SIZE(rh.len);
+      continue;
+    }
+    if (!loadRecord(hSector, hOffset, true)) {
+      // The message is damaged and can't be sent, skip it.
+      markConsumed(hSector, hOffset);
+      hOffset += JRN_REC_SIZE(rh.len);
+      pendingCount--;
+      drops++;
+      continue;
+    }
+    hLoaded = true;
+  }
+  if (!hLoaded)
+    return false;
+
+  memcpy(rec, rBuff, sizeof(*rec));
+  *topic = (const char *)&rBuff[sizeof(*rec)];
+  *data = &rBuff[sizeof(*rec) + rec->topicLen];
+
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Marks the oldest pending message as consumed. The state byte of the
+ * message is cleared in place, the message is not erased until its sector is
+ * reused or compacted.
+ *
+ * @return - true if a message was removed.
+ *
+ ******************************************************************************/
+bool MqttJournal::pop() {
+  mqtt_pub_record_t rec;
+  const char *topic;
+  const uint8_t *data;
+  jrn_rec_t rh;
+
+  if (!peek(&rec, &topic, &data))
+    return false;
+
+  readHeader(hSector, hOffset, &rh);
+  markConsumed(hSector, hOffset);
+
+  hOffset += JRN_REC_SIZE(rh.len);
+  hLoaded = false;
+  pendingCount--;
+
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Writes the messages collected in RAM to the storage.
+ *
+ * @return - true if the storage is up to date.
+ *
+ ******************************************************************************/
+bool MqttJournal::sync() {
+  bool ok = true;
+
+  if (!_storage)
+    return false;
+
+  if (wFlushed < wFill) {
+    ok = _storage->write(sectorBase(wSector) + wFlushed, &wBuff[wFlushed],
+                         wFill - wFlushed);
+    if (ok)
+      wFlushed = wFill;
+  }
+  dirtyTimed = false;
+
+  return _storage->sync() && ok;
+}
+
+/*******************************************************************************
+ *
+ * Erases all sectors that only hold consumed messages. This is otherwise done
+ * when the writer needs a sector again, calling this method when the link is
+ * idle moves the erase time away from the publish path.
+ *
+ * @return - The number of sectors that were erased.
+ *
+ ******************************************************************************/
+size_t MqttJournal::compact() {
+  size_t erased = 0;
+
+  if (!_storage)
+    return 0;
+
+  uint32_t first = pendingCount ? hSector : wSector;
+  for (uint32_t s = (wSector + 1) % sectors; s != first; s = (s + 1) % sectors) {
+    if (!isErased(s) && _storage->erase(s))
+      erased++;
+  }
+  return erased;
+}
+
+/*******************************************************************************
+ *
+ * Must be called regularly. Writes the messages collected in RAM to the
+ * storage once the oldest of them has waited for the flush interval.
+ *
+ * @param[in] - now
+ *      The current time in milliseconds.
+ *
+ ******************************************************************************/
+void MqttJournal::service(uint32_t now) {
+  if (!_storage || wFlushed >= wFill)
+    return;
+
+  if (!dirtyTimed) {
+    dirtyTimed = true;
+    dirtySince = now;
+  } else if (now - dirtySince >= flushInterval) {
+    sync();
+  }
+}
+
+/*******************************************************************************
+ *
+ * Sets the max time a message is kept in RAM only before it is written to
+ * the storage. A longer time means fewer writes but more messages lost on a
+ * power failure.
+ *
+ * @param[in] - ms
+ *      The flush interval in milliseconds, 0 writes at every #service() call.
+ *
+ ******************************************************************************/
+void MqttJournal::setFlushInterval(uint32_t ms) {
+  flushInterval = ms;
+}
+
+/*******************************************************************************
+ *
+ * Limits the rate at which the journal is replayed so that a long backlog
+ * does not monopolise the link after a reconnect.
+ *
+ * @param[in] - bytesPerSecond
+ *      The max replay rate in payload bytes per second, 0 means unlimited.
+ *
+ ******************************************************************************/
+void MqttJournal::setReplayRate(uint32_t bytesPerSecond) {
+  replayRate = bytesPerSecond;
+  credit = 0;
+  creditTime = 0;
+}
+
+/*******************************************************************************
+ *
+ * Checks if a message of len bytes may be replayed now. Credit is earned at
+ * the replay rate and is capped to one second worth of data. The credit is
+ * not withdrawn until the message has been sent, see #replayed().
+ *
+ * @param[in] - len
+ *      The size of the message.
+ *
+ * @param[in] - now
+ *      The current time in milliseconds.
+ *
+ * @return - true if the message may be sent.
+ *
+ ******************************************************************************/
+bool MqttJournal::replayCredit(size_t len, uint32_t now) {
+  if (!replayRate)
+    return true;
+
+  uint32_t elapsed = now - creditTime;
+  uint32_t cap = replayRate > secSize ? replayRate : secSize;
+  creditTime = now;
+  if (elapsed > 1000)
+    elapsed = 1000;
+  credit += (uint32_t)(((uint64_t)elapsed * replayRate) / 1000);
+  if (credit > cap)
+    credit = cap;
+
+  return credit >= len || credit >= cap;
+}
+
+/*******************************************************************************
+ *
+ * Withdraws the replay credit for a message that has been sent. Messages that
+ * could not be sent are not charged.
+ *
+ * @param[in] - len
+ *      The size of the message.
+ *
+ ******************************************************************************/
+void MqttJournal::replayed(size_t len) {
+  if (replayRate)
+    credit = credit > len ? credit - len : 0;
+}
+
+/*******************************************************************************
+ *
+ * @return - true if there are no pending messages in the journal.
+ *
+ ******************************************************************************/
+bool MqttJournal::isEmpty() {
+  return pendingCount == 0;
+}
+
+/*******************************************************************************
+ *
+ * @return - The number of pending messages in the journal.
+ *
+ ******************************************************************************/
+uint32_t MqttJournal::pending() {
+  return pendingCount;
+}
+
+/*******************************************************************************
+ *
+ * @return - The number of messages dropped because the journal was full or
+ *      because they were damaged.
+ *
+ ******************************************************************************/
+uint32_t MqttJournal::dropped() {
+  return drops;
+}
+
+/*******************************************************************************
+ *
+ * Loads the payload of the message at the given position into the read
+ * buffer and optionally verifies its CRC.
+ *
+ ******************************************************************************/
+bool MqttJournal::loadRecord(uint32_t sector, uint32_t offset, bool verify) {
+  jrn_rec_t rh;
+
+  if (!readHeader(sector, offset, &rh))
+    return false;
+  if (rh.len > secSize - JRN_SEC_HDR - JRN_REC_HDR || rh.len < sizeof(mqtt_pub_record_t))
+    return false;
+
+  if (sector == wSector) {
+    memcpy(rBuff, &wBuff[offset + JRN_REC_HDR], rh.len);
+  } else if (!_storage->read(sectorBase(sector) + offset + JRN_REC_HDR, rBuff,
+                             rh.len)) {
+    return false;
+  }
+  if (verify && crc32(rBuff, rh.len) != rh.crc)
+    return false;
+
+  mqtt_pub_record_t rec;
+  memcpy(&rec, rBuff, sizeof(rec));
+  return sizeof(rec) + rec.topicLen + rec.dataLen == rh.len;
+}
+
+/*******************************************************************************
+ *
+ * Clears the state byte of a message in place, in the write buffer as well if
+ * the message is in the sector being written.
+ *
+ ******************************************************************************/
+void MqttJournal::markConsumed(uint32_t sector, uint32_t offset) {
+  uint8_t state = JRN_STATE_CONSUMED;
+  uint32_t stateOffset = offset + offsetof(jrn_rec_t, state);
+
+  if (sector == wSector) {
+    wBuff[stateOffset] = state;
+    if (stateOffset < wFlushed)
+      _storage->write(sectorBase(sector) + stateOffset, &state, 1);
+  } else {
+    _storage->write(sectorBase(sector) + stateOffset, &state, 1);
+  }
+}
+
+/*******************************************************************************
+ *
+ * Checks that a message header belongs to the journal and that the message
+ * fits in the sector. Both #begin() and #peek() end a sector at a header that
+ * fails this check.
+ *
+ ******************************************************************************/
+bool MqttJournal::validHeader(const void *hdr, uint32_t offset) {
+  const jrn_rec_t *rh = (const jrn_rec_t *)hdr;
+
+  return rh->magic == JRN_REC_MAGIC && offset + JRN_REC_SIZE(rh->len) <= secSize;
+}
+
+/*******************************************************************************
+ *
+ * Reads a message header, from the write buffer if the sector is the one
+ * being written and otherwise from the storage.
+ *
+ ******************************************************************************/
+bool MqttJournal::readHeader(uint32_t sector, uint32_t offset, void *hdr) {
+  if (sector == wSector) {
+    memcpy(hdr, &wBuff[offset], JRN_REC_HDR);
+    return true;
+  }
+  return _storage->read(sectorBase(sector) + offset, hdr, JRN_REC_HDR);
+}
+
+/*******************************************************************************
+ *
+ * Closes the current sector and moves the writer to the next one. If the next
+ * sector still holds pending messages the journal is full and the policy
+ * decides if the new message or the oldest sector is dropped.
+ *
+ ******************************************************************************/
+bool MqttJournal::nextSector() {
+  uint32_t next = (wSector + 1) % sectors;
+
+  if (pendingCount && hSector == next) {
+    if (_policy == MQTT_QUEUE_DROP_NEWEST)
+      return false;
+    dropSector(next);
+  }
+  sync();
+  return startSector(next, wSeq + 1);
+}
+
+/*******************************************************************************
+ *
+ * Makes sure the sector is erased and prepares the write buffer for it.
+ *
+ ******************************************************************************/
+bool MqttJournal::startSector(uint32_t sector, uint32_t seq) {
+  jrn_sector_t sh;
+
+  if (!isErased(sector) && !_storage->erase(sector))
+    return false;
+
+  memset(wBuff, 0xff, secSize);
+  sh.magic = JRN_SECTOR_MAGIC;
+  sh.seq = seq;
+  memcpy(wBuff, &sh, sizeof(sh));
+  wSector = sector;
+  wSeq = seq;
+  wFill = JRN_SEC_HDR;
+  wFlushed = 0;
+  dirtyTimed = false;
+  if (!pendingCount) {
+    hSector = sector;
+    hOffset = JRN_SEC_HDR;
+    hLoaded = false;
+  }
+
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Drops all pending messages in the given sector, which must be the oldest
+ * one, and moves the head to the following sector.
+ *
+ ******************************************************************************/
+void MqttJournal::dropSector(uint32_t sector) {
+  jrn_rec_t rh;
+  uint32_t off = JRN_SEC_HDR;
+
+  while (off + JRN_REC_HDR <= secSize && readHeader(sector, off, &rh) &&
+         rh.len != 0xffff && validHeader(&rh, off)) {
+    if (rh.state == JRN_STATE_PENDING && pendingCount) {
+      pendingCount--;
+      drops++;
+    }
+    off += JRN_REC_SIZE(rh.len);
+  }
+  hSector = (sector + 1) % sectors;
+  hOffset = JRN_SEC_HDR;
+  hLoaded = false;
+}
+
+/*******************************************************************************
+ *
+ * Checks if all bytes of a sector reads as erased.
+ *
+ ******************************************************************************/
+bool MqttJournal::isErased(uint32_t sector) {
+  uint32_t chunk[16];
+
+  for (uint32_t off = 0; off < secSize; off += sizeof(chunk)) {
+    size_t len = secSize - off < sizeof(chunk) ? secSize - off : sizeof(chunk);
+    if (!_storage->read(sectorBase(sector) + off, chunk, len))
+      return false;
+    for (size_t i = 0; i < len / sizeof(chunk[0]); i++) {
+      if (chunk[i] != 0xffffffff)
+        return false;
+    }
+  }
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * @return - The storage offset of a sector.
+ *
+ ******************************************************************************/
+uint32_t MqttJournal::sectorBase(uint32_t sector) {
+  return sector * secSize;
+}
@@ -0,0 +1,120 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_MQTT_JOURNAL_
+#define _H_MQTT_JOURNAL_
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <MqttStorage.h>
+#include <MqttPubQueue.h>
+
+#define MQTT_JOURNAL_FLUSH_INTERVAL   1000  /**< Default max time (ms) an appended message stays in RAM only */
+
+/*******************************************************************************
+ * MqttJournal class definition
+ *
+ * A persistent store-and-forward journal for publish messages. Messages are
+ * appended to a log in a #MqttStorage that is used as a ring of sectors. Each
+ * sector starts with a header holding a sequence number so the order of the
+ * sectors can be found after a reboot, and each message is protected by a
+ * CRC so a message that was torn by a power loss is detected and skipped.
+ *
+ * Appended messages are collected in RAM and written one sector at a time,
+ * or when the flush interval has elapsed, to keep the number of flash writes
+ * low. A message that has been sent is marked as consumed by clearing its
+ * state byte in place, which is a legal flash operation without an erase.
+ * Sectors that only hold consumed messages are erased by #compact(), or when
+ * the writer needs the sector again.
+ ******************************************************************************/
+class MqttJournal {
+public:
+  MqttJournal();
+
+  bool begin(MqttStorage *storage, uint8_t *buffer, size_t bufferSize,
+             mqtt_queue_policy_t policy = MQTT_QUEUE_DROP_NEWEST);
+  bool isEnabled();
+  bool append(const mqtt_pub_record_t *rec, const char *topic,
+              const mqtt_buffer_t *bufs, size_t count);
+  bool peek(mqtt_pub_record_t *rec, const char **topic, const uint8_t **data);
+  bool pop();
+  bool sync();
+  size_t compact();
+  void service(uint32_t now);
+  void setFlushInterval(uint32_t ms);
+  void setReplayRate(uint32_t bytesPerSecond);
+  bool replayCredit(size_t len, uint32_t now);
+  void replayed(size_t len);
+  bool isEmpty();
+  uint32_t pending();
+  uint32_t dropped();
+private:
+  bool loadRecord(uint32_t sector, uint32_t offset, bool verify);
+  bool readHeader(uint32_t sector, uint32_t offset, void *hdr);
+  bool validHeader(const void *hdr, uint32_t offset);
+  void markConsumed(uint32_t sector, uint32_t offset);
+  bool nextSector();
+  bool startSector(uint32_t sector, uint32_t seq);
+  void dropSector(uint32_t sector);
+  bool isErased(uint32_t sector);
+  uint32_t sectorBase(uint32_t sector);
+
+  MqttStorage *_storage;
+  mqtt_queue_policy_t _policy;
+  uint8_t *wBuff;         /**< RAM mirror of the sector being written */
+  uint8_t *rBuff;         /**< Buffer holding the message returned by peek() */
+  size_t secSize;
+  uint32_t sectors;
+
+  uint32_t wSector;       /**< Sector currently being written */
+  uint32_t wSeq;          /**< Sequence number of the sector being written */
+  uint32_t wFill;         /**< Write offset within the current sector */
+  uint32_t wFlushed;      /**< Bytes of the current sector written to storage */
+  uint32_t dirtySince;    /**< Time the unflushed data was first seen by service() */
+  bool dirtyTimed;        /**< dirtySince holds a valid time */
+  uint32_t flushInterval;
+
+  uint32_t hSector;       /**< Sector holding the oldest pending message */
+  uint32_t hOffset;       /**< Offset of the oldest pending message */
+  bool hLoaded;           /**< The message at the head is loaded in rBuff */
+
+  uint32_t pendingCount;
+  uint32_t drops;
+
+  uint32_t replayRate;    /**< Max replay rate in bytes/s, 0 = unlimited */
+  uint32_t credit;
+  uint32_t creditTime;
+};
+
+#endif
@@ -0,0 +1,334 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <MqttOffload.h>
+
+/** @file */
+
+/*******************************************************************************
+ *
+ * Creates the offload queues of an EspATMQTT object. The object must only be
+ * used through this class once the engine has started calling #service().
+ *
+ * @param[in] - mqtt
+ *      The MQTT engine.
+ *
+ ******************************************************************************/
+MqttOffload::MqttOffload(EspATMQTT *mqtt) {
+  this->mqtt = mqtt;
+  for (int i = 0; i < MQTT_MAX_LINKS; i++)
+    states[i] = MQTT_STATE_DISCONNECTED;
+  oversize = 0;
+}
+
+/*******************************************************************************
+ *
+ * Puts a command in the command queue.
+ *
+ ******************************************************************************/
+mqtt_status_t MqttOffload::post(uint8_t type, uint32_t linkID,
+                                const char *topic, const uint8_t *data,
+                                size_t len, uint32_t qos, uint32_t retain,
+                                uint32_t tag) {
+  mqtt_offload_msg_t *cmd;
+  size_t topicLen = strlen(topic);
+
+  if (linkID >= MQTT_MAX_LINKS)
+    return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_LINK_ID_VALUE_IS_WRONG;
+  if (topicLen >= MQTT_OFFLOAD_TOPIC_SIZE)
+    return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_TOPIC_IS_OVERLENGTH;
+  if (len > MQTT_OFFLOAD_DATA_SIZE)
+    return ESP_AT_SUB_CMD_PROCESSING | AT_MQTT_DATA_IS_OVERLENGTH;
+
+  cmd = commands.reserve();
+  if (!cmd)
+    return ESP_AT_SUB_CMD_QUEUE_FULL;
+  cmd->type = type;
+  cmd->linkID = (uint8_t)linkID;
+  cmd->qos = (uint8_t)qos;
+  cmd->retain = (uint8_t)retain;
+  cmd->status = ESP_AT_SUB_OK;
+  cmd->tag = tag;
+  cmd->dataLen = (uint16_t)len;
+  memcpy(cmd->topic, topic, topicLen + 1);
+  if (len)
+    memcpy(cmd->data, data, len);
+  commands.commit();
+
+  return ESP_AT_SUB_CMD_QUEUED;
+}
+
+/*******************************************************************************
+ *
+ * Asks the engine to publish a '\0' terminated string. Application side.
+ *
+ * @param[in] - linkID
+ *      The link the message should be published on.
+ * @param[in] - topic
+ *      The topic, at most MQTT_OFFLOAD_TOPIC_SIZE - 1 characters.
+ * @param[in] - data
+ *      The message, at most MQTT_OFFLOAD_DATA_SIZE characters.
+ * @param[in] - qos
+ *      Quality of Service of the message.
+ * @param[in] - retain
+ *      Retain flag of the message.
+ * @param[in] - tag
+ *      If not 0, a #MQTT_OFFLOAD_RESULT event with this tag and the status of
+ *      the publish is posted when the engine has sent the message.
+ *
+ * @return - ESP_AT_SUB_CMD_QUEUED when the command was queued and
+ *           ESP_AT_SUB_CMD_QUEUE_FULL if the command queue was full. See
+ *           #mqtt_error_e and #status_code_e for more information.
+ *
+ ******************************************************************************/
+mqtt_status_t MqttOffload::publish(uint32_t linkID, const char *topic,
+                                   const char *data, uint32_t qos,
+                                   uint32_t retain, uint32_t tag) {
+  return post(MQTT_OFFLOAD_PUBLISH, linkID, topic, (const uint8_t *)data,
+              strlen(data), qos, retain, tag);
+}
+
+/*******************************************************************************
+ *
+ * Asks the engine to publish binary data. Application side, see the string
+ * version of #publish() for the parameters.
+ *
+ * @param[in] - len
+ *      The number of bytes in data, at most MQTT_OFFLOAD_DATA_SIZE.
+ *
+ ******************************************************************************/
+mqtt_status_t MqttOffload::publish(uint32_t linkID, const char *topic,
+                                   const uint8_t *data, size_t len,
+                                   uint32_t qos, uint32_t retain,
+                                   uint32_t tag) {
+  return post(MQTT_OFFLOAD_PUBLISH, linkID, topic, data, len, qos, retain,
+              tag);
+}
+
+/*******************************************************************************
+ *
+ * Asks the engine to subscribe to a topic. Messages that arrive on it are
+ * posted as #MQTT_OFFLOAD_MESSAGE events. Application side.
+ *
+ * @param[in] - linkID
+ *      The link to subscribe on.
+ * @param[in] - topic
+ *      The topic filter, at most MQTT_OFFLOAD_TOPIC_SIZE - 1 characters.
+ * @param[in] - qos
+ *      Quality of Service of the subscription.
+ * @param[in] - tag
+ *      If not 0, a #MQTT_OFFLOAD_RESULT event with this tag is posted.
+ *
+ * @return - See #publish().
+ *
+ ******************************************************************************/
+mqtt_status_t MqttOffload::subscribe(uint32_t linkID, const char *topic,
+                                     uint32_t qos, uint32_t tag) {
+  return post(MQTT_OFFLOAD_SUBSCRIBE, linkID, topic, NULL, 0, qos, 0, tag);
+}
+
+/*******************************************************************************
+ *
+ * Asks the engine to unsubscribe from a topic. Application side.
+ *
+ * @param[in] - linkID
+ *      The link the subscription was made on.
+ * @param[in] - topic
+ *      The topic filter.
+ * @param[in] - tag
+ *      If not 0, a #MQTT_OFFLOAD_RESULT event with this tag is posted.
+ *
+ * @return - See #publish().
+ *
+ ******************************************************************************/
+mqtt_status_t MqttOffload::unsubscribe(uint32_t linkID, const char *topic,
+                                       uint32_t tag) {
+  return post(MQTT_OFFLOAD_UNSUBSCRIBE, linkID, topic, NULL, 0, 0, 0, tag);
+}
+
+/*******************************************************************************
+ *
+ * Returns the oldest event from the engine. Application side. The event is
+ * read in place and stays valid until #releaseEvent() is called.
+ *
+ * @return - The event, or NULL if there is none.
+ *
+ ******************************************************************************/
+const mqtt_offload_msg_t *MqttOffload::getEvent() {
+  return events.front();
+}
+
+/*******************************************************************************
+ *
+ * Frees the event returned by #getEvent(). Application side.
+ *
+ ******************************************************************************/
+void MqttOffload::releaseEvent() {
+  events.pop();
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of events lost, either because the event queue was full
+ * or because a received message did not fit in a slot.
+ *
+ ******************************************************************************/
+uint32_t MqttOffload::droppedEvents() {
+  return events.drops() + __atomic_load_n(&oversize, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************
+ *
+ * Carries out one command on the engine side and posts its result.
+ *
+ ******************************************************************************/
+void MqttOffload::execute(mqtt_offload_msg_t *cmd) {
+  mqtt_offload_msg_t *ev;
+  mqtt_status_t status;
+
+  switch (cmd->type) {
+    case MQTT_OFFLOAD_PUBLISH:
+      status = mqtt->publish(cmd->linkID, cmd->topic, cmd->data, cmd->dataLen,
+                             cmd->qos, cmd->retain);
+      break;
+    case MQTT_OFFLOAD_SUBSCRIBE:
+      status = mqtt->subscribeTopic(mqttMessageHandler(onMessage, this),
+                                    cmd->linkID, cmd->topic, cmd->qos);
+      break;
+    case MQTT_OFFLOAD_UNSUBSCRIBE:
+      status = mqtt->unSubscribeTopic(cmd->linkID, cmd->topic);
+      break;
+    default:
+      status = ESP_AT_SUB_CMD_ERROR;
+      break;
+  }
+
+  if (!cmd->tag)
+    return;
+  ev = events.reserve();
+  if (!ev)
+    return;
+  ev->type = MQTT_OFFLOAD_RESULT;
+  ev->linkID = cmd->linkID;
+  ev->qos = cmd->qos;
+  ev->retain = cmd->retain;
+  ev->status = status;
+  ev->tag = cmd->tag;
+  ev->dataLen = 0;
+  memcpy(ev->topic, cmd->topic, strlen(cmd->topic) + 1);
+  events.commit();
+}
+
+/*******************************************************************************
+ *
+ * Message handler of the subscriptions made by the engine. Copies the message
+ * into the event queue.
+ *
+ ******************************************************************************/
+void MqttOffload::onMessage(void *ctx, uint32_t linkID, char *topic,
+                            size_t topicLen, char *data, size_t dataLen) {
+  MqttOffload *self = (MqttOffload *)ctx;
+  mqtt_offload_msg_t *ev;
+
+  if (topicLen >= MQTT_OFFLOAD_TOPIC_SIZE || dataLen > MQTT_OFFLOAD_DATA_SIZE) {
+    __atomic_store_n(&self->oversize, self->oversize + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  ev = self->events.reserve();
+  if (!ev)
+    return;
+  ev->type = MQTT_OFFLOAD_MESSAGE;
+  ev->linkID = (uint8_t)linkID;
+  ev->qos = 0;
+  ev->retain = 0;
+  ev->status = ESP_AT_SUB_OK;
+  ev->tag = 0;
+  ev->dataLen = (uint16_t)dataLen;
+  memcpy(ev->topic, topic, topicLen);
+  ev->topic[topicLen] = '\0';
+  memcpy(ev->data, data, dataLen);
+  self->events.commit();
+}
+
+/*******************************************************************************
+ *
+ * Posts a #MQTT_OFFLOAD_STATE event for each link whose connection state has
+ * changed since the last call. A change that can not be posted because the
+ * event queue is full is posted on a later call.
+ *
+ ******************************************************************************/
+void MqttOffload::checkStates() {
+  mqtt_offload_msg_t *ev;
+  mqtt_conn_state_t state;
+
+  for (int i = 0; i < MQTT_MAX_LINKS; i++) {
+    state = mqtt->getState(i);
+    if (state == states[i])
+      continue;
+    ev = events.reserve();
+    if (!ev)
+      return;
+    ev->type = MQTT_OFFLOAD_STATE;
+    ev->linkID = (uint8_t)i;
+    ev->qos = 0;
+    ev->retain = 0;
+    ev->status = state;
+    ev->tag = 0;
+    ev->dataLen = 0;
+    ev->topic[0] = '\0';
+    events.commit();
+    states[i] = state;
+  }
+}
+
+/*******************************************************************************
+ *
+ * Runs the engine once. Engine side, call it from the loop of the engine
+ * context instead of EspATMQTT::process(). It carries out queued commands,
+ * processes the ESP-AT device and posts the resulting events.
+ *
+ * @param[in] - maxCommands
+ *      The max number of commands carried out in one call, so that received
+ *      messages are processed in between a burst of publishes.
+ *
+ ******************************************************************************/
+void MqttOffload::service(uint32_t maxCommands) {
+  mqtt_offload_msg_t *cmd;
+
+  while (maxCommands-- && (cmd = commands.front()) != NULL) {
+    execute(cmd);
+    commands.pop();
+  }
+  mqtt->process();
+  checkStates();
+}
@@ -0,0 +1,92 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_MQTT_OFFLOAD_
+#define _H_MQTT_OFFLOAD_
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <EspATMQTT.h>
+#include <MqttOffloadQueue.h>
+
+/*******************************************************************************
+ * MqttOffload class definition
+ *
+ * Runs the AT and MQTT engine in a context of its own, typically the second
+ * core of an RP2040, so the timing of the application is not affected by the
+ * UART or by the broker. The engine context sets up the EspATMQTT (begin(),
+ * configuration and connect) and then calls #service() in its loop, which is
+ * the only place the EspATMQTT is used from. The application publishes and
+ * subscribes through the command queue and reads messages, results and link
+ * state changes from the event queue.
+ *
+ * Both queues are lock free with one producer and one consumer, so commands
+ * must be posted from one application context only.
+ ******************************************************************************/
+class MqttOffload {
+public:
+  MqttOffload(EspATMQTT *mqtt);
+
+  // Application side
+  mqtt_status_t publish(uint32_t linkID, const char *topic, const char *data,
+                           uint32_t qos=0, uint32_t retain=0, uint32_t tag=0);
+  mqtt_status_t publish(uint32_t linkID, const char *topic, const uint8_t *data,
+                           size_t len, uint32_t qos=0, uint32_t retain=0,
+                           uint32_t tag=0);
+  mqtt_status_t subscribe(uint32_t linkID, const char *topic, uint32_t qos=0,
+                           uint32_t tag=0);
+  mqtt_status_t unsubscribe(uint32_t linkID, const char *topic, uint32_t tag=0);
+  const mqtt_offload_msg_t *getEvent();
+  void releaseEvent();
+  uint32_t droppedEvents();
+
+  // Engine side
+  void service(uint32_t maxCommands = MQTT_OFFLOAD_SLOTS);
+private:
+  mqtt_status_t post(uint8_t type, uint32_t linkID, const char *topic,
+                           const uint8_t *data, size_t len, uint32_t qos,
+                           uint32_t retain, uint32_t tag);
+  void execute(mqtt_offload_msg_t *cmd);
+  void checkStates();
+  static void onMessage(void *ctx, uint32_t linkID, char *topic,
+                           size_t topicLen, char *data, size_t dataLen);
+
+  EspATMQTT *mqtt;
+  MqttOffloadQueue commands;    /**< Application to engine */
+  MqttOffloadQueue events;      /**< Engine to application */
+  mqtt_conn_state_t states[MQTT_MAX_LINKS]; /**< Last link states reported */
+  uint32_t oversize;            /**< Messages dropped because they did not fit in a slot */
+};
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <MqttOffloadQueue.h>
+
+/** @file */
+
+#define SLOT_MASK         (MQTT_OFFLOAD_SLOTS - 1)
+#define LOAD(x)           __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v)       __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define PEEK(x)           __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/*******************************************************************************
+ *
+ * The constructor leaves the queue empty.
+ *
+ ******************************************************************************/
+MqttOffloadQueue::MqttOffloadQueue() {
+  head = 0;
+  tail = 0;
+  dropCount = 0;
+}
+
+/*******************************************************************************
+ *
+ * Returns the next free slot for the producer to fill in. The slot is not
+ * seen by the consumer until #commit() is called. Calling reserve() again
+ * before commit() returns the same slot.
+ *
+ * @return - The slot, or NULL if the queue is full. A full queue is counted
+ *           by #drops().
+ *
+ ******************************************************************************/
+mqtt_offload_msg_t *MqttOffloadQueue::reserve() {
+  size_t h = PEEK(head);
+
+  if (h - LOAD(tail) >= MQTT_OFFLOAD_SLOTS) {
+    STORE(dropCount, PEEK(dropCount) + 1);
+    return NULL;
+  }
+  return &slots[h & SLOT_MASK];
+}
+
+/*******************************************************************************
+ *
+ * Hands the slot returned by #reserve() over to the consumer.
+ *
+ ******************************************************************************/
+void MqttOffloadQueue::commit() {
+  STORE(head, PEEK(head) + 1);
+}
+
+/*******************************************************************************
+ *
+ * Returns the oldest message in the queue. It stays valid until #pop().
+ *
+ * @return - The message, or NULL if the queue is empty.
+ *
+ ******************************************************************************/
+mqtt_offload_msg_t *MqttOffloadQueue::front() {
+  size_t t = PEEK(tail);
+
+  if (LOAD(head) == t)
+    return NULL;
+  return &slots[t & SLOT_MASK];
+}
+
+/*******************************************************************************
+ *
+ * Frees the message returned by #front() so the producer can use the slot.
+ *
+ ******************************************************************************/
+void MqttOffloadQueue::pop() {
+  size_t t = PEEK(tail);
+
+  if (LOAD(head) != t)
+    STORE(tail, t + 1);
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of messages in the queue.
+ *
+ ******************************************************************************/
+size_t MqttOffloadQueue::count() {
+  return LOAD(head) - LOAD(tail);
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of messages that could not be queued because the
+ * queue was full.
+ *
+ ******************************************************************************/
+uint32_t MqttOffloadQueue::drops() {
+  return LOAD(dropCount);
+}
@@ -0,0 +1,108 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_MQTT_OFFLOAD_QUEUE_
+#define _H_MQTT_OFFLOAD_QUEUE_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define MQTT_OFFLOAD_SLOTS        8     /**< Number of messages in each offload queue, must be a power of two */
+#define MQTT_OFFLOAD_TOPIC_SIZE   64    /**< Max topic length, including the '\0' terminator */
+#define MQTT_OFFLOAD_DATA_SIZE    256   /**< Max payload length of a message */
+
+#if (MQTT_OFFLOAD_SLOTS & (MQTT_OFFLOAD_SLOTS - 1)) != 0
+#error "MQTT_OFFLOAD_SLOTS must be a power of two"
+#endif
+
+/**
+ * The kind of a message passed between the application and the I/O engine.
+ * Commands go from the application to the engine and events the other way.
+ */
+enum mqtt_offload_type_e {
+  MQTT_OFFLOAD_PUBLISH            = 0, /**< Command: publish data on a topic */
+  MQTT_OFFLOAD_SUBSCRIBE          = 1, /**< Command: subscribe to a topic */
+  MQTT_OFFLOAD_UNSUBSCRIBE        = 2, /**< Command: unsubscribe from a topic */
+  MQTT_OFFLOAD_RESULT             = 3, /**< Event: the status of a command, see tag */
+  MQTT_OFFLOAD_MESSAGE            = 4, /**< Event: a message arrived on a subscribed topic */
+  MQTT_OFFLOAD_STATE              = 5  /**< Event: the connection state of a link changed */
+};
+
+/**
+ * @typedef mqtt_offload_msg_t
+ * A command or an event. The topic is '\0' terminated, the data is not.
+ */
+typedef struct mqtt_offload_msg_s {
+  uint8_t type;           /**< The kind of message, see #mqtt_offload_type_e */
+  uint8_t linkID;         /**< The link the message is about */
+  uint8_t qos;            /**< Quality of Service */
+  uint8_t retain;         /**< Retain flag of a publish */
+  uint32_t status;        /**< Status of a command, or the new state of a link */
+  uint32_t tag;           /**< Chosen by the application, returned in the result */
+  uint16_t dataLen;       /**< Number of bytes in data */
+  char topic[MQTT_OFFLOAD_TOPIC_SIZE];   /**< The topic */
+  uint8_t data[MQTT_OFFLOAD_DATA_SIZE];  /**< The payload */
+} mqtt_offload_msg_t;
+
+/*******************************************************************************
+ * MqttOffloadQueue class definition
+ *
+ * A lock free queue of #mqtt_offload_msg_t with one producer and one
+ * consumer, which may run on different cores or threads. Messages are built
+ * and read in place in the slots, the producer gets a free slot with
+ * #reserve() and hands it over with #commit(), the consumer reads the oldest
+ * one with #front() and frees it with #pop().
+ ******************************************************************************/
+class MqttOffloadQueue {
+public:
+  MqttOffloadQueue();
+
+  // Producer side
+  mqtt_offload_msg_t *reserve();
+  void commit();
+
+  // Consumer side
+  mqtt_offload_msg_t *front();
+  void pop();
+
+  size_t count();
+  uint32_t drops();
+private:
+  mqtt_offload_msg_t slots[MQTT_OFFLOAD_SLOTS]; /**< The messages */
+  size_t head;            /**< Free running write index, only written by the producer */
+  size_t tail;            /**< Free running read index, only written by the consumer */
+  uint32_t dropCount;     /**< Number of times reserve() found the queue full */
+};
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <MqttPubQueue.h>
+
+/** @file */
+
+#define PQ_ALIGN(x)       (((x) + 3) & ~((size_t)3))
+#define PQ_HDR_SIZE       PQ_ALIGN(sizeof(mqtt_pub_record_t))
+#define PQ_WRAP_MARKER    0xffff
+
+/*******************************************************************************
+ *
+ * The constructor leaves the queue disabled, #begin() must be called with a
+ * memory area before any messages can be stored.
+ *
+ ******************************************************************************/
+MqttPubQueue::MqttPubQueue() {
+  _arena = NULL;
+  _size = 0;
+  _policy = MQTT_QUEUE_DROP_OLDEST;
+  drops = 0;
+  clear();
+}
+
+/*******************************************************************************
+ *
+ * Assigns the memory area used to store the queued messages. Any messages
+ * already in the queue are discarded.
+ *
+ * @param[in] - arena
+ *      The memory area used by the queue. It must stay valid for as long as
+ *      the queue is in use. Passing NULL disables the queue.
+ *
+ * @param[in] - size
+ *      The size of the memory area in bytes.
+ *
+ * @param[in] - policy
+ *      What to do when a new message does not fit, see #mqtt_queue_policy_e.
+ *
+ ******************************************************************************/
+void MqttPubQueue::begin(uint8_t *arena, size_t size,
+                         mqtt_queue_policy_t policy) {
+  _arena = arena;
+  _size = arena ? size : 0;
+  _policy = policy;
+  drops = 0;
+  clear();
+}
+
+/*******************************************************************************
+ *
+ * Checks if the queue has been given a memory area to work with.
+ *
+ * @return - true if the queue can store messages.
+ *
+ ******************************************************************************/
+bool MqttPubQueue::isEnabled() {
+  return _arena != NULL && _size > PQ_HDR_SIZE;
+}
+
+/*******************************************************************************
+ *
+ * Adds a message to the end of the queue. The message data can be given as
+ * several segments which are stored as one continuous message.
+ *
+ * @param[in] - rec
+ *      The message header. The topicLen and dataLen fields are filled in by
+ *      the queue from the topic and the segments.
+ *
+ * @param[in] - topic
+ *      The '\0' terminated topic of the message.
+ *
+ * @param[in] - bufs
+ *      The segments making up the message data.
+ *
+ * @param[in] - count
+ *      The number of segments.
+ *
+ * @return - true if the message was stored, false if it was dropped.
+ *
+ ******************************************************************************/
+bool MqttPubQueue::push(const mqtt_pub_record_t *rec, const char *topic,
+                        const mqtt_buffer_t *bufs, size_t count) {
+  mqtt_pub_record_t hdr = *rec;
+  size_t dataLen = 0;
+  size_t topicLen = strlen(topic) + 1;
+
+  for (size_t i = 0; i < count; i++)
+    dataLen += bufs[i].len;
+
+  if (!isEnabled() || topicLen >= PQ_WRAP_MARKER || dataLen > 0xffff) {
+    drops++;
+    return false;
+  }
+  hdr.topicLen = topicLen;
+  hdr.dataLen = dataLen;
+
+  size_t len = entrySize(&hdr);
+  if (len > _size) {
+    drops++;
+    return false;
+  }
+
+  size_t pos;
+  while ((pos = reserve(len)) == _size) {
+    if (_policy == MQTT_QUEUE_DROP_NEWEST || !entries) {
+      drops++;
+      return false;
+    }
+    pop();
+    drops++;
+  }
+
+  memcpy(&_arena[pos], &hdr, sizeof(hdr));
+  pos += PQ_HDR_SIZE;
+  memcpy(&_arena[pos], topic, topicLen);
+  pos += topicLen;
+  for (size_t i = 0; i < count; i++) {
+    memcpy(&_arena[pos], bufs[i].data, bufs[i].len);
+    pos += bufs[i].len;
+  }
+  entries++;
+
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Checks if a message would be stored by #push() without dropping any other
+ * message. Nothing is changed in the queue.
+ *
+ * @param[in] - topic
+ *      The '\0' terminated topic of the message.
+ *
+ * @param[in] - dataLen
+ *      The total length of the message data.
+ *
+ * @return - true if there is room for the message.
+ *
+ ******************************************************************************/
+bool MqttPubQueue::fits(const char *topic, size_t dataLen) {
+  size_t topicLen = strlen(topic) + 1;
+
+  if (!isEnabled() || topicLen >= PQ_WRAP_MARKER || dataLen > 0xffff)
+    return false;
+
+  size_t len = PQ_HDR_SIZE + PQ_ALIGN(topicLen + dataLen);
+  if (len > _size)
+    return false;
+  if (!entries)
+    return true;
+  // The same checks as reserve() does.
+  if (tail == head)
+    return false;
+  if (tail >= head)
+    return _size - tail >= len || head >= len;
+  return head - tail >= len;
+}
+
+/*******************************************************************************
+ *
+ * Returns the oldest message in the queue without removing it. The returned
+ * pointers point into the queue memory and are valid until the message is
+ * removed with #pop().
+ *
+ * @param[out] - rec
+ *      The header of the message.
+ *
+ * @param[out] - topic
+ *      A pointer to the '\0' terminated topic of the message.
+ *
+ * @param[out] - data
+ *      A pointer to the message data, rec->dataLen bytes long.
+ *
+ * @return - true if a message was returned, false if the queue is empty.
+ *
+ ******************************************************************************/
+bool MqttPubQueue::peek(mqtt_pub_record_t *rec, const char **topic,
+                        const uint8_t **data) {
+  if (!entries)
+    return false;
+
+  skipWrap();
+  memcpy(rec, &_arena[head], sizeof(*rec));
+  *topic = (const char *)&_arena[head + PQ_HDR_SIZE];
+  *data = &_arena[head + PQ_HDR_SIZE + rec->topicLen];
+
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Removes the oldest message from the queue.
+ *
+ ******************************************************************************/
+void MqttPubQueue::pop() {
+  mqtt_pub_record_t rec;
+
+  if (!entries)
+    return;
+
+  skipWrap();
+  memcpy(&rec, &_arena[head], sizeof(rec));
+  size_t len = entrySize(&rec);
+  head += len;
+  used -= len;
+  if (head == _size)
+    head = 0;
+  if (!--entries) {
+    // Start over from the beginning to get the largest possible free area.
+    head = tail = used = 0;
+  }
+}
+
+/*******************************************************************************
+ *
+ * Discards all messages in the queue.
+ *
+ ******************************************************************************/
+void MqttPubQueue::clear() {
+  head = tail = used = 0;
+  entries = 0;
+}
+
+/*******************************************************************************
+ *
+ * @return - true if there are no messages in the queue.
+ *
+ ******************************************************************************/
+bool MqttPubQueue::isEmpty() {
+  return entries == 0;
+}
+
+/*******************************************************************************
+ *
+ * @return - The number of messages in the queue.
+ *
+ ******************************************************************************/
+size_t MqttPubQueue::count() {
+  return entries;
+}
+
+/*******************************************************************************
+ *
+ * @return - The number of bytes of the memory area currently in use.
+ *
+ ******************************************************************************/
+size_t MqttPubQueue::bytesUsed() {
+  return used;
+}
+
+/*******************************************************************************
+ *
+ * @return - The number of messages dropped since #begin() was called.
+ *
+ ******************************************************************************/
+uint32_t MqttPubQueue::dropped() {
+  return drops;
+}
+
+/*******************************************************************************
+ *
+ * Calculates the number of bytes a message occupies in the memory area.
+ *
+ ******************************************************************************/
+size_t MqttPubQueue::entrySize(const mqtt_pub_record_t *rec) {
+  return PQ_HDR_SIZE + PQ_ALIGN((size_t)rec->topicLen + rec->dataLen);
+}
+
+/*******************************************************************************
+ *
+ * Finds a continuous free area of len bytes at the end of the queue and
+ * marks it as used. If there is not enough room before the end of the memory
+ * area the message is placed at the beginning instead and the unused end is
+ * accounted for as a wrap gap.
+ *
+ * @return - The offset of the reserved area or _size if there is no room.
+ *
+ ******************************************************************************/
+size_t MqttPubQueue::reserve(size_t len) {
+  size_t pos;
+
+  if (!entries) {
+    head = tail = used = 0;
+  } else if (tail == head) {
+    // The queue is completely full.
+    return _size;
+  }
+
+  if (tail >= head) {
+    if (_size - tail >= len) {
+      pos = tail;
+    } else if (head >= len) {
+      size_t gap = _size - tail;
+      if (gap >= PQ_HDR_SIZE) {
+        mqtt_pub_record_t marker;
+        memset(&marker, 0, sizeof(marker));
+        marker.topicLen = PQ_WRAP_MARKER;
+        memcpy(&_arena[tail], &marker, sizeof(marker));
+      }
+      used += gap;
+      pos = 0;
+    } else {
+      return _size;
+    }
+  } else {
+    if (head - tail < len)
+      return _size;
+    pos = tail;
+  }
+
+  tail = pos + len;
+  if (tail == _size)
+    tail = 0;
+  used += len;
+
+  return pos;
+}
+
+/*******************************************************************************
+ *
+ * Moves the head to the beginning of the memory area if the writer wrapped
+ * around at this point.
+ *
+ ******************************************************************************/
+void MqttPubQueue::skipWrap() {
+  mqtt_pub_record_t rec;
+  size_t gap = _size - head;
+
+  if (gap >= PQ_HDR_SIZE) {
+    memcpy(&rec, &_arena[head], sizeof(rec));
+    if (rec.topicLen != PQ_WRAP_MARKER)
+      return;
+  }
+  used -= gap;
+  head = 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_MQTT_PUB_QUEUE_
+#define _H_MQTT_PUB_QUEUE_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/**
+ * @typedef mqtt_buffer_t
+ * Describes one segment of a scatter/gather publication. The segments are sent
+ * back to back after the publish prompt so a pre framed record (header, body
+ * and trailer) can be published without first copying it into one buffer.
+ */
+typedef struct mqtt_buffer_s {
+  const uint8_t *data;    /**< Pointer to the segment data, may contain '\0' */
+  size_t len;             /**< Number of bytes in the segment */
+} mqtt_buffer_t;
+
+/**
+ * Policies used by the publish queue when a new message does not fit in the
+ * arena.
+ */
+enum mqtt_queue_policy_e {
+  MQTT_QUEUE_DROP_OLDEST          = 0, /**< Discard the oldest messages until the new one fits */
+  MQTT_QUEUE_DROP_NEWEST          = 1  /**< Keep the queued messages and discard the new one */
+};
+typedef enum mqtt_queue_policy_e mqtt_queue_policy_t;
+
+/**
+ * Tells how a queued message should be sent once it is taken off the queue.
+ */
+enum mqtt_pub_type_e {
+  MQTT_PUB_TYPE_INLINE            = 0, /**< Pre escaped data, sent as is with +MQTTPUB */
+  MQTT_PUB_TYPE_RAW               = 1, /**< Sent with +MQTTPUBRAW */
+  MQTT_PUB_TYPE_AUTO              = 2  /**< Transport selected when sent, see EspATMQTT::publish() */
+};
+
+/**
+ * @typedef mqtt_pub_record_t
+ * Header of a message stored in the publish queue. In the arena the header is
+ * followed by the '\0' terminated topic and then the message data, padded to
+ * a multiple of 4 bytes.
+ */
+typedef struct mqtt_pub_record_s {
+  uint16_t topicLen;      /**< Length of the topic including the '\0' terminator */
+  uint16_t dataLen;       /**< Length of the message data */
+  uint8_t linkID;         /**< The link the message should be published on */
+  uint8_t qos;            /**< Quality of Service of the message */
+  uint8_t retain;         /**< Retain flag of the message */
+  uint8_t type;           /**< How the message is sent, see #mqtt_pub_type_e */
+} mqtt_pub_record_t;
+
+/*******************************************************************************
+ * MqttPubQueue class definition
+ *
+ * A bounded FIFO of publish messages stored in a caller provided memory area.
+ * Messages are stored back to back in the area which is used as a ring, so no
+ * heap memory is ever allocated and no memory is lost to fixed size slots.
+ ******************************************************************************/
+class MqttPubQueue {
+public:
+  MqttPubQueue();
+
+  void begin(uint8_t *arena, size_t size,
+             mqtt_queue_policy_t policy = MQTT_QUEUE_DROP_OLDEST);
+  bool isEnabled();
+  bool push(const mqtt_pub_record_t *rec, const char *topic,
+            const mqtt_buffer_t *bufs, size_t count);
+  bool fits(const char *topic, size_t dataLen);
+  bool peek(mqtt_pub_record_t *rec, const char **topic, const uint8_t **data);
+  void pop();
+  void clear();
+  bool isEmpty();
+  size_t count();
+  size_t bytesUsed();
+  uint32_t dropped();
+private:
+  size_t entrySize(const mqtt_pub_record_t *rec);
+  size_t reserve(size_t len);
+  void skipWrap();
+
+  uint8_t *_arena;
+  size_t _size;
+  mqtt_queue_policy_t _policy;
+  size_t head;            /**< Offset of the oldest message in the arena */
+  size_t tail;            /**< Offset where the next message will be written */
+  size_t used;            /**< Bytes in use, including padding and wrap gaps */
+  size_t entries;         /**< Number of messages in the queue */
+  uint32_t drops;         /**< Number of messages dropped because of lack of space */
+};
+
+#endif
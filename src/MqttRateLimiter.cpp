@@ -0,0 +1,255 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <MqttRateLimiter.h>
+
+/** @file */
+
+// Tokens are kept in 1/1000 units so that low rates refill smoothly.
+#define RL_MILLI          1000
+
+/*******************************************************************************
+ *
+ * The constructor leaves the limiter disabled, all traffic passes until
+ * #begin() is called with a rate.
+ *
+ ******************************************************************************/
+MqttRateLimiter::MqttRateLimiter() {
+  autoTune = false;
+  begin(0, 0);
+}
+
+/*******************************************************************************
+ *
+ * Sets the rates of the limiter and fills both buckets.
+ *
+ * @param[in] - msgsPerSecond
+ *      The max number of messages per second, 0 for no limit.
+ *
+ * @param[in] - bytesPerSecond
+ *      The max number of payload bytes per second, 0 for no limit.
+ *
+ * @param[in] - msgBurst
+ *      The number of messages that can be sent back to back after an idle
+ *      period. 0 gives a burst of one second worth of messages.
+ *
+ * @param[in] - byteBurst
+ *      The number of bytes that can be sent back to back after an idle
+ *      period. 0 gives a burst of one second worth of bytes.
+ *
+ ******************************************************************************/
+void MqttRateLimiter::begin(uint32_t msgsPerSecond, uint32_t bytesPerSecond,
+                            uint32_t msgBurst, uint32_t byteBurst) {
+  msgsPerSec = msgsPerSecond;
+  bytesPerSec = bytesPerSecond;
+  msgCap = (msgBurst ? msgBurst : msgsPerSecond) * RL_MILLI;
+  byteCap = (byteBurst ? byteBurst : bytesPerSecond) * RL_MILLI;
+  msgTokens = msgCap;
+  byteTokens = byteCap;
+  lastRefill = 0;
+  scale = MQTT_RATE_SCALE_ONE;
+  lastBackoff = 0;
+}
+
+/*******************************************************************************
+ *
+ * Returns true if at least one of the rates is limited.
+ *
+ ******************************************************************************/
+bool MqttRateLimiter::isEnabled() {
+  return msgsPerSec || bytesPerSec;
+}
+
+/*******************************************************************************
+ *
+ * Enables or disables auto tuning of the rate, see #feedback().
+ *
+ ******************************************************************************/
+void MqttRateLimiter::setAutoTune(bool enable) {
+  autoTune = enable;
+  scale = MQTT_RATE_SCALE_ONE;
+}
+
+void MqttRateLimiter::refill(uint32_t now) {
+  uint32_t elapsed = now - lastRefill;
+
+  lastRefill = now;
+  if (!elapsed)
+    return;
+  // A bucket never holds more than its size so there is no point in
+  // counting more than a few seconds, and it keeps the math in range.
+  if (elapsed > 60000)
+    elapsed = 60000;
+
+  if (msgsPerSec) {
+    uint64_t add = (uint64_t)elapsed * msgsPerSec * scale / MQTT_RATE_SCALE_ONE;
+    msgTokens = (msgTokens + add > msgCap) ? msgCap : msgTokens + (uint32_t)add;
+  }
+  if (bytesPerSec) {
+    uint64_t add = (uint64_t)elapsed * bytesPerSec * scale / MQTT_RATE_SCALE_ONE;
+    byteTokens = (byteTokens + add > byteCap) ? byteCap : byteTokens + (uint32_t)add;
+  }
+}
+
+// A message larger than the bucket can never be paid in full, it is let
+// through when the bucket is full instead.
+uint32_t MqttRateLimiter::msgCost() {
+  return RL_MILLI > msgCap ? msgCap : RL_MILLI;
+}
+
+uint32_t MqttRateLimiter::byteCost(size_t len) {
+  uint64_t cost = (uint64_t)len * RL_MILLI;
+  return cost > byteCap ? byteCap : (uint32_t)cost;
+}
+
+/*******************************************************************************
+ *
+ * Checks if a message can be sent right now without using any credit.
+ *
+ * @param[in] - len
+ *      The payload length of the message.
+ *
+ * @param[in] - now
+ *      The current time in milliseconds.
+ *
+ * @return - true if there is credit for the message.
+ *
+ ******************************************************************************/
+bool MqttRateLimiter::available(size_t len, uint32_t now) {
+  refill(now);
+  return (!msgsPerSec || msgTokens >= msgCost()) &&
+         (!bytesPerSec || byteTokens >= byteCost(len));
+}
+
+/*******************************************************************************
+ *
+ * Takes the credit for a message if there is enough of it.
+ *
+ * @param[in] - len
+ *      The payload length of the message.
+ *
+ * @param[in] - now
+ *      The current time in milliseconds.
+ *
+ * @return - true if the message can be sent, false if it has to wait.
+ *
+ ******************************************************************************/
+bool MqttRateLimiter::consume(size_t len, uint32_t now) {
+  if (!available(len, now))
+    return false;
+  if (msgsPerSec)
+    msgTokens -= msgCost();
+  if (bytesPerSec)
+    byteTokens -= byteCost(len);
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Returns the time until there is credit for a message.
+ *
+ * @param[in] - len
+ *      The payload length of the message.
+ *
+ * @param[in] - now
+ *      The current time in milliseconds.
+ *
+ * @return - The time to wait in milliseconds, 0 if the message can be sent.
+ *
+ ******************************************************************************/
+uint32_t MqttRateLimiter::waitTime(size_t len, uint32_t now) {
+  uint32_t wait = 0;
+
+  refill(now);
+  if (msgsPerSec && msgTokens < msgCost()) {
+    uint32_t rate = msgRate() ? msgRate() : 1;
+    wait = ((msgCost() - msgTokens) + rate - 1) / rate;
+  }
+  if (bytesPerSec && byteTokens < byteCost(len)) {
+    uint32_t rate = byteRate() ? byteRate() : 1;
+    uint32_t w = ((byteCost(len) - byteTokens) + rate - 1) / rate;
+    if (w > wait)
+      wait = w;
+  }
+  return wait;
+}
+
+/*******************************************************************************
+ *
+ * Reports the outcome of a sent message to the auto tuning. A congested
+ * message, busy replies or a timeout, cuts the rate by a quarter but at most
+ * once per MQTT_RATE_BACKOFF_TIME so that one burst of busy replies is not
+ * counted many times. Each message without problems raises the rate a little.
+ *
+ * @param[in] - congested
+ *      true if the ESP-AT device was busy or did not reply in time.
+ *
+ * @param[in] - now
+ *      The current time in milliseconds.
+ *
+ ******************************************************************************/
+void MqttRateLimiter::feedback(bool congested, uint32_t now) {
+  if (!autoTune)
+    return;
+
+  refill(now);
+  if (congested) {
+    if (now - lastBackoff >= MQTT_RATE_BACKOFF_TIME) {
+      lastBackoff = now;
+      scale = scale * 3 / 4;
+      if (scale < MQTT_RATE_SCALE_MIN)
+        scale = MQTT_RATE_SCALE_MIN;
+    }
+  } else if (scale < MQTT_RATE_SCALE_ONE) {
+    scale += 2;
+    if (scale > MQTT_RATE_SCALE_ONE)
+      scale = MQTT_RATE_SCALE_ONE;
+  }
+}
+
+/*******************************************************************************
+ *
+ * Returns the message rate in use, after auto tuning.
+ *
+ ******************************************************************************/
+uint32_t MqttRateLimiter::msgRate() {
+  return msgsPerSec * scale / MQTT_RATE_SCALE_ONE;
+}
+
+/*******************************************************************************
+ *
+ * Returns the byte rate in use, after auto tuning.
+ *
+ ******************************************************************************/
+uint32_t MqttRateLimiter::byteRate() {
+  return (uint64_t)bytesPerSec * scale / MQTT_RATE_SCALE_ONE;
+}
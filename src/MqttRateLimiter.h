@@ -0,0 +1,88 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_MQTT_RATE_LIMITER_
+#define _H_MQTT_RATE_LIMITER_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define MQTT_RATE_SCALE_ONE     256   /**< Auto tune scale factor of the full configured rate */
+#define MQTT_RATE_SCALE_MIN     32    /**< Auto tune never goes below 1/8 of the configured rate */
+#define MQTT_RATE_BACKOFF_TIME  250   /**< Min time (ms) between two auto tune rate reductions */
+
+/*******************************************************************************
+ * MqttRateLimiter class definition
+ *
+ * A pair of token buckets, one counting messages and one counting bytes, that
+ * shape the outbound traffic to the ESP-AT device. The buckets are refilled
+ * from the elapsed time when they are used so no timer is needed.
+ *
+ * With auto tuning enabled the rate is lowered each time the ESP-AT device
+ * reports that it is busy, or a command times out, and then slowly raised
+ * back towards the configured rate for each message that goes through
+ * without problems.
+ ******************************************************************************/
+class MqttRateLimiter {
+public:
+  MqttRateLimiter();
+
+  void begin(uint32_t msgsPerSecond, uint32_t bytesPerSecond,
+             uint32_t msgBurst = 0, uint32_t byteBurst = 0);
+  bool isEnabled();
+  void setAutoTune(bool enable);
+  bool available(size_t len, uint32_t now);
+  bool consume(size_t len, uint32_t now);
+  uint32_t waitTime(size_t len, uint32_t now);
+  void feedback(bool congested, uint32_t now);
+  uint32_t msgRate();
+  uint32_t byteRate();
+private:
+  void refill(uint32_t now);
+  uint32_t msgCost();
+  uint32_t byteCost(size_t len);
+
+  uint32_t msgsPerSec;    /**< Configured message rate, 0 = unlimited */
+  uint32_t bytesPerSec;   /**< Configured byte rate, 0 = unlimited */
+  uint32_t msgCap;        /**< Message bucket size in milli tokens */
+  uint32_t byteCap;       /**< Byte bucket size in milli tokens */
+  uint32_t msgTokens;     /**< Message tokens available, in milli tokens */
+  uint32_t byteTokens;    /**< Byte tokens available, in milli tokens */
+  uint32_t lastRefill;    /**< Time of the last refill */
+  uint32_t scale;         /**< Auto tune factor, MQTT_RATE_SCALE_ONE = configured rate */
+  uint32_t lastBackoff;   /**< Time of the last auto tune rate reduction */
+  bool autoTune;
+};
+
+#endif
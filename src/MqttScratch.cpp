@@ -0,0 +1,205 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <MqttScratch.h>
+
+/** @file */
+
+#define SCR_ALIGN(x)      (((x) + 3) & ~((size_t)3))
+#define SCR_GUARD_BYTE    0xa5
+
+/*******************************************************************************
+ *
+ * The constructor leaves the arena empty, every borrow fails until #begin()
+ * is called with a memory area.
+ *
+ ******************************************************************************/
+MqttScratch::MqttScratch() {
+  begin(NULL, 0);
+}
+
+/*******************************************************************************
+ *
+ * Sets the memory area of the arena. Must not be called while any buffers
+ * are borrowed.
+ *
+ * @param[in] - region
+ *      The memory area, it must stay valid for as long as the arena is used.
+ *
+ * @param[in] - size
+ *      The size of the memory area in bytes.
+ *
+ ******************************************************************************/
+void MqttScratch::begin(uint8_t *region, size_t size) {
+  base = region;
+  this->size = region ? size : 0;
+  used = 0;
+  high = 0;
+  faultCount = 0;
+  depth = 0;
+}
+
+/*******************************************************************************
+ *
+ * Borrows a buffer from the arena. Prefer a #MqttScratchLease, which returns
+ * the buffer automatically.
+ *
+ * @param[in] - size
+ *      The size of the buffer in bytes.
+ *
+ * @return - A pointer to the buffer, 4 byte aligned, or NULL if there is not
+ *      enough room left.
+ *
+ ******************************************************************************/
+void *MqttScratch::borrow(size_t size) {
+  size_t need = SCR_ALIGN(size + MQTT_SCRATCH_GUARD);
+  uint8_t *ptr;
+
+  if (depth >= MQTT_SCRATCH_MAX_LEASES || need > this->size - used)
+    return NULL;
+
+  ptr = &base[used];
+#ifdef MQTT_SCRATCH_DEBUG
+  // The guard goes right after the buffer so that any overrun is caught
+  guards[depth] = used + size;
+  memset(&base[used + size], SCR_GUARD_BYTE, MQTT_SCRATCH_GUARD);
+#endif
+  leases[depth++] = used;
+  used += need;
+  if (used > high)
+    high = used;
+  return ptr;
+}
+
+/*******************************************************************************
+ *
+ * Returns a borrowed buffer. Buffers must be returned in the reverse order
+ * they were borrowed in, a buffer returned out of order is counted as a fault
+ * and releases the buffers borrowed after it as well.
+ *
+ * @param[in] - ptr
+ *      The buffer returned by #borrow(), NULL is ignored.
+ *
+ ******************************************************************************/
+void MqttScratch::release(void *ptr) {
+  size_t offset;
+  uint8_t ix;
+
+  if (!ptr)
+    return;
+  offset = (uint8_t *)ptr - base;
+  for (ix = depth; ix > 0 && leases[ix - 1] != offset; ix--);
+  if (!ix) {
+    // Not borrowed from this arena, or already returned.
+    faultCount++;
+    return;
+  }
+  if (ix != depth)
+    faultCount++;
+
+#ifdef MQTT_SCRATCH_DEBUG
+  // Check the guard of every lease that goes away
+  for (uint8_t i = ix - 1; i < depth; i++) {
+    for (size_t j = guards[i]; j < guards[i] + MQTT_SCRATCH_GUARD; j++) {
+      if (base[j] != SCR_GUARD_BYTE) {
+        faultCount++;
+        break;
+      }
+    }
+  }
+#endif
+  depth = ix - 1;
+  used = offset;
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of bytes that can still be borrowed.
+ *
+ ******************************************************************************/
+size_t MqttScratch::available() {
+  size_t left = size - used;
+
+  return left > MQTT_SCRATCH_GUARD ? (left - MQTT_SCRATCH_GUARD) & ~((size_t)3) : 0;
+}
+
+/*******************************************************************************
+ *
+ * Returns the max number of bytes that have been borrowed at the same time,
+ * useful when sizing the arena.
+ *
+ ******************************************************************************/
+size_t MqttScratch::highWater() {
+  return high;
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of leases that were returned out of order, that were
+ * not borrowed from this arena or, with MQTT_SCRATCH_DEBUG, that had been
+ * written past their end.
+ *
+ ******************************************************************************/
+uint32_t MqttScratch::faults() {
+  return faultCount;
+}
+
+/*******************************************************************************
+ *
+ * Borrows a buffer from the arena for the lifetime of the lease.
+ *
+ * @param[in] - scratch
+ *      The arena to borrow from, may be NULL.
+ *
+ * @param[in] - size
+ *      The size of the buffer in bytes.
+ *
+ ******************************************************************************/
+MqttScratchLease::MqttScratchLease(MqttScratch *scratch, size_t size) {
+  this->scratch = scratch;
+  ptr = scratch ? scratch->borrow(size) : NULL;
+}
+
+MqttScratchLease::~MqttScratchLease() {
+  if (scratch)
+    scratch->release(ptr);
+}
+
+/*******************************************************************************
+ *
+ * Returns the borrowed buffer, NULL if the borrow failed.
+ *
+ ******************************************************************************/
+void *MqttScratchLease::data() {
+  return ptr;
+}
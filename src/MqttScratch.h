@@ -0,0 +1,103 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_MQTT_SCRATCH_
+#define _H_MQTT_SCRATCH_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define MQTT_SCRATCH_MAX_LEASES   8   /**< Max number of buffers borrowed at the same time */
+#ifdef MQTT_SCRATCH_DEBUG
+#define MQTT_SCRATCH_GUARD        4   /**< Guard bytes after each lease, checked when it is returned */
+#else
+#define MQTT_SCRATCH_GUARD        0
+#endif
+
+/*******************************************************************************
+ * MqttScratch class definition
+ *
+ * A scratch arena in a caller provided memory area. Buffers are borrowed for
+ * the duration of one operation and must be returned in the reverse order,
+ * which is what a #MqttScratchLease does when it goes out of scope. Code that
+ * only needs large buffers now and then, like the certificate management,
+ * can then share one area with the application instead of keeping its own.
+ *
+ * With MQTT_SCRATCH_DEBUG defined each lease is followed by guard bytes that
+ * are checked when the lease is returned, so a write past the end of a
+ * buffer into the next one is caught. Leases returned out of order are
+ * reported as well. All such problems are counted by #faults().
+ ******************************************************************************/
+class MqttScratch {
+public:
+  MqttScratch();
+
+  void begin(uint8_t *region, size_t size);
+  void *borrow(size_t size);
+  void release(void *ptr);
+  size_t available();
+  size_t highWater();
+  uint32_t faults();
+private:
+  uint8_t *base;          /**< The memory area */
+  size_t size;            /**< Size of the memory area */
+  size_t used;            /**< Number of bytes borrowed */
+  size_t high;            /**< Max number of bytes borrowed at the same time */
+  uint32_t faultCount;    /**< Number of borrow discipline violations */
+  size_t leases[MQTT_SCRATCH_MAX_LEASES]; /**< Start of each active lease */
+  size_t guards[MQTT_SCRATCH_MAX_LEASES]; /**< Start of the guard of each active lease, MQTT_SCRATCH_DEBUG only */
+  uint8_t depth;          /**< Number of active leases */
+};
+
+/*******************************************************************************
+ * MqttScratchLease class definition
+ *
+ * Borrows a buffer from a scratch arena for as long as the lease is in scope.
+ * The buffer is NULL if the arena is missing or does not have enough room.
+ ******************************************************************************/
+class MqttScratchLease {
+public:
+  MqttScratchLease(MqttScratch *scratch, size_t size);
+  ~MqttScratchLease();
+
+  void *data();
+private:
+  MqttScratchLease(const MqttScratchLease &);
+  MqttScratchLease &operator=(const MqttScratchLease &);
+
+  MqttScratch *scratch;
+  void *ptr;
+};
+
+#endif
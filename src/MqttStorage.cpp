@@ -0,0 +1,212 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <MqttStorage.h>
+
+/** @file */
+
+/*******************************************************************************
+ *
+ * Creates a file based storage. Nothing is done with the file until #begin()
+ * is called.
+ *
+ * @param[in] - path
+ *      The path of the file. The string must stay valid for the lifetime of
+ *      the object.
+ *
+ * @param[in] - size
+ *      The size of the storage in bytes. Should be a multiple of sectorSize.
+ *
+ * @param[in] - sectorSize
+ *      The size of one sector. Should match the erase size of the underlying
+ *      flash for the best performance.
+ *
+ ******************************************************************************/
+MqttFileStorage::MqttFileStorage(const char *path, size_t size,
+                                 size_t sectorSize) {
+  _path = path;
+  _sectorSize = sectorSize;
+  _size = size - size % sectorSize;
+  fp = NULL;
+}
+
+/*******************************************************************************
+ *
+ * Closes the file if it is open.
+ *
+ ******************************************************************************/
+MqttFileStorage::~MqttFileStorage() {
+  end();
+}
+
+/*******************************************************************************
+ *
+ * Opens the file, creating it if it does not exist. A new file, or the part
+ * of an existing file that is shorter than the requested size, is filled with
+ * 0xff so that it looks like erased flash.
+ *
+ * @return - true if the file could be opened.
+ *
+ ******************************************************************************/
+bool MqttFileStorage::begin() {
+  uint8_t erased[64];
+
+  end();
+  fp = fopen(_path, "r+b");
+  if (!fp)
+    fp = fopen(_path, "w+b");
+  if (!fp)
+    return false;
+
+  if (fseek(fp, 0, SEEK_END) != 0) {
+    end();
+    return false;
+  }
+  long pos = ftell(fp);
+  if (pos < 0) {
+    end();
+    return false;
+  }
+
+  memset(erased, 0xff, sizeof(erased));
+  for (size_t len = pos; len < _size; ) {
+    size_t chunk = _size - len < sizeof(erased) ? _size - len : sizeof(erased);
+    if (fwrite(erased, 1, chunk, fp) != chunk) {
+      end();
+      return false;
+    }
+    len += chunk;
+  }
+  fflush(fp);
+
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Closes the file.
+ *
+ ******************************************************************************/
+void MqttFileStorage::end() {
+  if (fp) {
+    fclose(fp);
+    fp = NULL;
+  }
+}
+
+/*******************************************************************************
+ *
+ * @return - The size of the storage in bytes.
+ *
+ ******************************************************************************/
+size_t MqttFileStorage::size() {
+  return _size;
+}
+
+/*******************************************************************************
+ *
+ * @return - The size of one sector in bytes.
+ *
+ ******************************************************************************/
+size_t MqttFileStorage::sectorSize() {
+  return _sectorSize;
+}
+
+/*******************************************************************************
+ *
+ * Reads length bytes from the given offset.
+ *
+ * @return - true if all bytes could be read.
+ *
+ ******************************************************************************/
+bool MqttFileStorage::read(uint32_t offset, void *buffer, size_t length) {
+  if (!fp || offset + length > _size)
+    return false;
+  if (fseek(fp, offset, SEEK_SET) != 0)
+    return false;
+  return fread(buffer, 1, length, fp) == length;
+}
+
+/*******************************************************************************
+ *
+ * Writes length bytes to the given offset.
+ *
+ * @return - true if all bytes could be written.
+ *
+ ******************************************************************************/
+bool MqttFileStorage::write(uint32_t offset, const void *buffer, size_t length) {
+  if (!fp || offset + length > _size)
+    return false;
+  if (fseek(fp, offset, SEEK_SET) != 0)
+    return false;
+  return fwrite(buffer, 1, length, fp) == length;
+}
+
+/*******************************************************************************
+ *
+ * Erases one sector by filling it with 0xff.
+ *
+ * @return - true if the sector was erased.
+ *
+ ******************************************************************************/
+bool MqttFileStorage::erase(uint32_t sector) {
+  uint8_t erased[64];
+  uint32_t offset = sector * _sectorSize;
+
+  if (!fp || offset + _sectorSize > _size)
+    return false;
+  if (fseek(fp, offset, SEEK_SET) != 0)
+    return false;
+
+  memset(erased, 0xff, sizeof(erased));
+  for (size_t len = 0; len < _sectorSize; ) {
+    size_t chunk = _sectorSize - len < sizeof(erased) ? _sectorSize - len : sizeof(erased);
+    if (fwrite(erased, 1, chunk, fp) != chunk)
+      return false;
+    len += chunk;
+  }
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Flushes the stdio buffers of the file.
+ *
+ * @return - true if the data was flushed.
+ *
+ ******************************************************************************/
+bool MqttFileStorage::sync() {
+  if (!fp)
+    return false;
+  return fflush(fp) == 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_MQTT_STORAGE_
+#define _H_MQTT_STORAGE_
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*******************************************************************************
+ * MqttStorage class definition
+ *
+ * A minimal interface to a block of non volatile storage with flash like
+ * semantics. The storage is divided in sectors that are erased as a whole,
+ * an erased byte reads as 0xff and written bytes must only ever have bits
+ * cleared until the sector is erased again. Used by #MqttJournal.
+ ******************************************************************************/
+class MqttStorage {
+public:
+  virtual ~MqttStorage() {}
+
+  virtual size_t size() = 0;                  /**< Total size of the storage in bytes */
+  virtual size_t sectorSize() = 0;            /**< Size of one erasable sector in bytes */
+  virtual bool read(uint32_t offset, void *buffer, size_t length) = 0;
+  virtual bool write(uint32_t offset, const void *buffer, size_t length) = 0;
+  virtual bool erase(uint32_t sector) = 0;    /**< Erase one sector, set all bytes to 0xff */
+  virtual bool sync() { return true; }        /**< Make sure all written data is persistent */
+};
+
+/*******************************************************************************
+ * MqttFileStorage class definition
+ *
+ * A storage backend that keeps the data in a plain file using the C stdio
+ * functions. On Linux this is used for testing, on targets where stdio is
+ * mapped to a file system (for instance LittleFS through the VFS layer of the
+ * RP2040 core) it can be used as is.
+ ******************************************************************************/
+class MqttFileStorage : public MqttStorage {
+public:
+  MqttFileStorage(const char *path, size_t size, size_t sectorSize = 4096);
+  ~MqttFileStorage();
+
+  bool begin();
+  void end();
+
+  size_t size();
+  size_t sectorSize();
+  bool read(uint32_t offset, void *buffer, size_t length);
+  bool write(uint32_t offset, const void *buffer, size_t length);
+  bool erase(uint32_t sector);
+  bool sync();
+private:
+  const char *_path;
+  size_t _size;
+  size_t _sectorSize;
+  FILE *fp;
+};
+
+#endif
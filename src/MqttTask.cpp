@@ -0,0 +1,302 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <MqttTask.h>
+
+/** @file */
+
+#ifdef MQTT_HAS_COROUTINES
+
+/*******************************************************************************
+ *
+ * Creates the task object of a new coroutine, called by the compiler.
+ *
+ ******************************************************************************/
+MqttTask::MqttTask(std::coroutine_handle<promise_type> h) {
+  handle = h;
+}
+
+/*******************************************************************************
+ *
+ * Moves the coroutine to a new task object.
+ *
+ ******************************************************************************/
+MqttTask::MqttTask(MqttTask &&other) {
+  handle = other.handle;
+  other.handle = nullptr;
+}
+
+/*******************************************************************************
+ *
+ * Destroys a coroutine that was never given to an executor.
+ *
+ ******************************************************************************/
+MqttTask::~MqttTask() {
+  if (handle)
+    handle.destroy();
+}
+
+/*******************************************************************************
+ *
+ * Hands the coroutine over to the caller, the task object no longer owns it.
+ *
+ ******************************************************************************/
+std::coroutine_handle<> MqttTask::release() {
+  std::coroutine_handle<> h = handle;
+
+  handle = nullptr;
+  return h;
+}
+
+/*******************************************************************************
+ *
+ * Creates an executor without any tasks.
+ *
+ ******************************************************************************/
+MqttExecutor::MqttExecutor() {
+  for (int i = 0; i < MQTT_TASK_MAX_TASKS; i++) {
+    owned[i] = nullptr;
+    parked[i] = nullptr;
+    waits[i] = NULL;
+  }
+  time = 0;
+}
+
+/*******************************************************************************
+ *
+ * Destroys the tasks that have not finished.
+ *
+ ******************************************************************************/
+MqttExecutor::~MqttExecutor() {
+  for (int i = 0; i < MQTT_TASK_MAX_TASKS; i++) {
+    if (owned[i])
+      owned[i].destroy();
+  }
+}
+
+/*******************************************************************************
+ *
+ * Starts a task. It runs right away until it first has to wait.
+ *
+ * @param[in] - task
+ *      The task, the value returned by calling the coroutine.
+ *
+ * @return - true if the task was started, false if the executor already runs
+ *           MQTT_TASK_MAX_TASKS tasks. The task is then destroyed.
+ *
+ ******************************************************************************/
+bool MqttExecutor::spawn(MqttTask task) {
+  for (int i = 0; i < MQTT_TASK_MAX_TASKS; i++) {
+    if (!owned[i]) {
+      owned[i] = task.release();
+      owned[i].resume();
+      if (owned[i].done()) {
+        owned[i].destroy();
+        owned[i] = nullptr;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+/*******************************************************************************
+ *
+ * Parks a task until the operation it waits for completes. Called by
+ * MqttWait::await_suspend().
+ *
+ * @return - false if there is no room, the task should then not suspend.
+ *
+ ******************************************************************************/
+bool MqttExecutor::park(std::coroutine_handle<> handle, MqttWait *wait) {
+  for (int i = 0; i < MQTT_TASK_MAX_TASKS; i++) {
+    if (!parked[i]) {
+      parked[i] = handle;
+      waits[i] = wait;
+      return true;
+    }
+  }
+  return false;
+}
+
+/*******************************************************************************
+ *
+ * Resumes the tasks whose operations have completed or timed out and
+ * destroys the tasks that have finished. Normally called from the same loop
+ * as EspATMQTT::process().
+ *
+ * @param[in] - now
+ *      The current time in milliseconds, millis() on an Arduino.
+ *
+ ******************************************************************************/
+void MqttExecutor::run(uint32_t now) {
+  time = now;
+  for (int i = 0; i < MQTT_TASK_MAX_TASKS; i++) {
+    if (parked[i] && waits[i]->check()) {
+      std::coroutine_handle<> h = parked[i];
+
+      parked[i] = nullptr;
+      waits[i] = NULL;
+      h.resume();
+    }
+  }
+  for (int i = 0; i < MQTT_TASK_MAX_TASKS; i++) {
+    if (owned[i] && owned[i].done()) {
+      owned[i].destroy();
+      owned[i] = nullptr;
+    }
+  }
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of tasks that have not finished.
+ *
+ ******************************************************************************/
+size_t MqttExecutor::tasks() {
+  size_t cnt = 0;
+
+  for (int i = 0; i < MQTT_TASK_MAX_TASKS; i++) {
+    if (owned[i])
+      cnt++;
+  }
+  return cnt;
+}
+
+/*******************************************************************************
+ *
+ * Returns the time given to the last call of #run(), used for deadlines.
+ *
+ ******************************************************************************/
+uint32_t MqttExecutor::now() {
+  return time;
+}
+
+/*******************************************************************************
+ *
+ * Creates an operation that is already complete.
+ *
+ * @param[in] - status
+ *      The result of the operation.
+ *
+ ******************************************************************************/
+MqttWait::MqttWait(uint32_t status) {
+  ctx = NULL;
+  arg = 0;
+  mark = 0;
+  this->status = status;
+  exec = NULL;
+  cond = NULL;
+  deadline = 0;
+}
+
+/*******************************************************************************
+ *
+ * Creates an operation that completes when the condition says so.
+ *
+ * @param[in] - exec
+ *      The executor that checks the condition.
+ * @param[in] - cond
+ *      The condition, see #mqtt_wait_cond_t.
+ * @param[in] - ctx
+ *      Stored in the ctx member for the condition.
+ * @param[in] - arg
+ *      Stored in the arg member for the condition.
+ * @param[in] - timeout
+ *      Time in milliseconds, counted from now, before the condition is told
+ *      that the deadline has passed.
+ * @param[in] - now
+ *      The current time in milliseconds, millis() on an Arduino. The time
+ *      of the last run of the executor will not do, it can be long ago or,
+ *      before the first run, 0.
+ *
+ ******************************************************************************/
+MqttWait::MqttWait(MqttExecutor *exec, mqtt_wait_cond_t cond, void *ctx,
+                   uint32_t arg, uint32_t timeout, uint32_t now) {
+  this->ctx = ctx;
+  this->arg = arg;
+  mark = 0;
+  status = 0;
+  this->exec = exec;
+  this->cond = cond;
+  deadline = now + timeout;
+}
+
+/*******************************************************************************
+ *
+ * Checks the condition, the operation is complete when it returns true.
+ *
+ ******************************************************************************/
+bool MqttWait::check() {
+  if (!cond)
+    return true;
+  if (cond(this, (int32_t)(exec->now() - deadline) >= 0)) {
+    cond = NULL;
+    return true;
+  }
+  return false;
+}
+
+/*******************************************************************************
+ *
+ * Called by co_await, the task is not suspended if the operation is complete.
+ *
+ ******************************************************************************/
+bool MqttWait::await_ready() {
+  return check();
+}
+
+/*******************************************************************************
+ *
+ * Called by co_await when the task is suspended. If the executor has no room
+ * for the task the operation is completed as if its deadline had passed.
+ *
+ ******************************************************************************/
+bool MqttWait::await_suspend(std::coroutine_handle<> handle) {
+  if (exec->park(handle, this))
+    return true;
+  cond(this, true);
+  cond = NULL;
+  return false;
+}
+
+/*******************************************************************************
+ *
+ * Called by co_await when the task continues, returns the status of the
+ * operation.
+ *
+ ******************************************************************************/
+uint32_t MqttWait::await_resume() {
+  return status;
+}
+
+#endif
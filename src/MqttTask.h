@@ -0,0 +1,154 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_MQTT_TASK_
+#define _H_MQTT_TASK_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define MQTT_HAS_COROUTINES       1     /**< Defined when the C++20 coroutine layer is available */
+#endif
+#endif
+
+#ifdef MQTT_HAS_COROUTINES
+
+#define MQTT_TASK_MAX_TASKS       8     /**< Max number of tasks run by one executor */
+
+class MqttWait;
+
+/**
+ * @typedef mqtt_wait_cond_t
+ * Checks if the operation a #MqttWait is waiting for has completed. It sets
+ * the status of the wait and returns true when the operation is done. When
+ * expired is true the deadline has passed and the function must complete the
+ * wait, normally with a timeout status.
+ */
+typedef bool (*mqtt_wait_cond_t)(MqttWait *wait, bool expired);
+
+/*******************************************************************************
+ * MqttTask class definition
+ *
+ * The return type of a coroutine run by a #MqttExecutor. The coroutine does
+ * not start until it is given to MqttExecutor::spawn(), which then owns it
+ * and destroys its frame when it has finished.
+ ******************************************************************************/
+class MqttTask {
+public:
+  struct promise_type {
+    MqttTask get_return_object() {
+      return MqttTask(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() {}
+  };
+
+  MqttTask(MqttTask &&other);
+  ~MqttTask();
+
+  std::coroutine_handle<> release();
+private:
+  explicit MqttTask(std::coroutine_handle<promise_type> h);
+  MqttTask(const MqttTask &);
+  MqttTask &operator=(const MqttTask &);
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+/*******************************************************************************
+ * MqttExecutor class definition
+ *
+ * A single threaded executor of #MqttTask coroutines. A task runs until it
+ * awaits a #MqttWait that is not complete, it is then parked until #run()
+ * finds that the operation has completed or its deadline has passed. Every
+ * task only costs its coroutine frame, there is no stack per task.
+ ******************************************************************************/
+class MqttExecutor {
+public:
+  MqttExecutor();
+  ~MqttExecutor();
+
+  bool spawn(MqttTask task);
+  void run(uint32_t now);
+  size_t tasks();
+  uint32_t now();
+
+  bool park(std::coroutine_handle<> handle, MqttWait *wait);
+private:
+  MqttExecutor(const MqttExecutor &);
+  MqttExecutor &operator=(const MqttExecutor &);
+
+  std::coroutine_handle<> owned[MQTT_TASK_MAX_TASKS]; /**< The tasks, NULL when the slot is free */
+  std::coroutine_handle<> parked[MQTT_TASK_MAX_TASKS]; /**< Tasks waiting for an operation */
+  MqttWait *waits[MQTT_TASK_MAX_TASKS]; /**< What each parked task is waiting for */
+  uint32_t time;          /**< The time given to the last call of run() */
+};
+
+/*******************************************************************************
+ * MqttWait class definition
+ *
+ * An awaitable operation. It is either complete when it is created, or it
+ * has a condition that the executor checks until it returns true or the
+ * deadline passes. The result of co_await is the status of the operation.
+ * The ctx, arg and mark members are free for the condition to use.
+ ******************************************************************************/
+class MqttWait {
+public:
+  MqttWait(uint32_t status);
+  MqttWait(MqttExecutor *exec, mqtt_wait_cond_t cond, void *ctx,
+           uint32_t arg, uint32_t timeout, uint32_t now);
+
+  bool await_ready();
+  bool await_suspend(std::coroutine_handle<> handle);
+  uint32_t await_resume();
+
+  bool check();
+
+  void *ctx;              /**< Context of the condition */
+  uint32_t arg;           /**< Argument of the condition */
+  uint32_t mark;          /**< State kept by the condition between checks */
+  uint32_t status;        /**< The status of the operation once it is complete */
+private:
+  MqttExecutor *exec;
+  mqtt_wait_cond_t cond;  /**< NULL if the operation is complete */
+  uint32_t deadline;      /**< Time the operation must be complete */
+};
+
+#endif
+#endif
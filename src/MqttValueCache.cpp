@@ -0,0 +1,350 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <MqttValueCache.h>
+
+/** @file */
+
+#define CACHE_ALIGN(x)    (((x) + 3) & ~((size_t)3))
+#define LOAD(x)           __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v)       __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define PEEK(x)           __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define POKE(x, v)        __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+/*******************************************************************************
+ *
+ * The constructor leaves the cache without memory, nothing is cached until
+ * #begin() is called.
+ *
+ ******************************************************************************/
+MqttValueCache::MqttValueCache() {
+  arena = NULL;
+  slotCount = 0;
+  slotSize = 0;
+  valueSize = 0;
+  usedCount = 0;
+  dropCount = 0;
+  autoTrack = true;
+}
+
+/*******************************************************************************
+ *
+ * Sets the memory area of the cache and clears it. Must not be called while
+ * the cache is read.
+ *
+ * @param[in] - arena
+ *      The memory area, 4 byte aligned. It must stay valid for as long as the
+ *      cache is used.
+ * @param[in] - size
+ *      The size of the memory area in bytes.
+ * @param[in] - valueSize
+ *      The max length of a value. Longer messages are not cached.
+ *
+ * @return - false if the area can not hold a single slot.
+ *
+ ******************************************************************************/
+bool MqttValueCache::begin(uint8_t *arena, size_t size, size_t valueSize) {
+  this->arena = arena;
+  this->valueSize = valueSize;
+  slotSize = sizeof(mqtt_cache_slot_t) + CACHE_ALIGN(MQTT_CACHE_TOPIC_SIZE) +
+             CACHE_ALIGN(valueSize);
+  slotCount = arena ? size / slotSize : 0;
+  usedCount = 0;
+  dropCount = 0;
+  if (slotCount)
+    memset(arena, 0, slotCount * slotSize);
+  return slotCount != 0;
+}
+
+/*******************************************************************************
+ *
+ * Selects if every topic that receives a message gets a slot, the default,
+ * or only the topics given to #track().
+ *
+ ******************************************************************************/
+void MqttValueCache::setAutoTrack(bool enable) {
+  autoTrack = enable;
+}
+
+/*******************************************************************************
+ *
+ * Returns the ID of a topic, a 32 bit FNV-1a hash. Compute it once and keep
+ * it, reads are then a direct lookup.
+ *
+ ******************************************************************************/
+uint32_t MqttValueCache::topicId(const char *topic) {
+  return topicId(topic, strlen(topic));
+}
+
+/*******************************************************************************
+ *
+ * Returns the ID of a topic that is not '\0' terminated.
+ *
+ ******************************************************************************/
+uint32_t MqttValueCache::topicId(const char *topic, size_t len) {
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)topic[i];
+    hash *= 16777619u;
+  }
+  // 0 marks a free slot.
+  return hash ? hash : 1;
+}
+
+/*******************************************************************************
+ *
+ * Returns the slot with the given index.
+ *
+ ******************************************************************************/
+mqtt_cache_slot_t *MqttValueCache::slotAt(size_t ix) {
+  return (mqtt_cache_slot_t *)(arena + ix * slotSize);
+}
+
+/*******************************************************************************
+ *
+ * Finds the slot of a topic ID. The slots are an open addressed hash table
+ * and slots are never freed, so the search ends at the first free slot.
+ *
+ ******************************************************************************/
+mqtt_cache_slot_t *MqttValueCache::find(uint32_t id) {
+  for (size_t n = 0; n < slotCount; n++) {
+    mqtt_cache_slot_t *slot = slotAt((id + n) % slotCount);
+    uint32_t slotId = LOAD(slot->id);
+
+    if (slotId == id)
+      return slot;
+    if (!slotId)
+      break;
+  }
+  return NULL;
+}
+
+/*******************************************************************************
+ *
+ * Gives a topic a slot. Writer side. The topic is written before the ID is
+ * published so a reader never sees a half written slot.
+ *
+ ******************************************************************************/
+mqtt_cache_slot_t *MqttValueCache::claim(const char *topic, size_t topicLen,
+                                         uint32_t id) {
+  if (topicLen >= MQTT_CACHE_TOPIC_SIZE)
+    return NULL;
+
+  for (size_t n = 0; n < slotCount; n++) {
+    mqtt_cache_slot_t *slot = slotAt((id + n) % slotCount);
+
+    if (!slot->id) {
+      char *slotTopic = (char *)(slot + 1);
+
+      memcpy(slotTopic, topic, topicLen);
+      slotTopic[topicLen] = '\0';
+      slot->topicLen = (uint16_t)topicLen;
+      slot->dataLen = 0;
+      slot->seq = 0;
+      STORE(slot->id, id);
+      usedCount++;
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+/*******************************************************************************
+ *
+ * Gives a topic a slot before any message has arrived on it. Writer side,
+ * call it before the messages start to arrive or from the same context as
+ * EspATMQTT::process().
+ *
+ * @param[in] - topic
+ *      The topic, not a filter with wildcards.
+ *
+ * @return - The ID of the topic, or 0 if the topic is too long, the cache is
+ *           full or a different topic already has the same ID.
+ *
+ ******************************************************************************/
+uint32_t MqttValueCache::track(const char *topic) {
+  size_t topicLen = strlen(topic);
+  uint32_t id = topicId(topic, topicLen);
+  mqtt_cache_slot_t *slot = find(id);
+
+  if (slot)
+    return strcmp((char *)(slot + 1), topic) ? 0 : id;
+  return claim(topic, topicLen, id) ? id : 0;
+}
+
+/*******************************************************************************
+ *
+ * Stores the value received on a topic. Writer side, called by EspATMQTT.
+ *
+ * @param[in] - topic
+ *      The topic, it does not have to be '\0' terminated.
+ * @param[in] - topicLen
+ *      The length of the topic.
+ * @param[in] - data
+ *      The value.
+ * @param[in] - len
+ *      The length of the value.
+ *
+ * @return - true if the value was stored. A value that is too long, or a
+ *           topic that has no slot and can not get one, is counted by
+ *           #drops(). Untracked topics are ignored when auto tracking is off.
+ *
+ ******************************************************************************/
+bool MqttValueCache::update(const char *topic, size_t topicLen,
+                            const void *data, size_t len) {
+  uint32_t id = topicId(topic, topicLen);
+  mqtt_cache_slot_t *slot = find(id);
+  uint32_t seq;
+
+  if (!slotCount)
+    return false;
+  if (slot && (slot->topicLen != topicLen ||
+               memcmp((char *)(slot + 1), topic, topicLen))) {
+    // Another topic with the same ID owns the slot.
+    dropCount++;
+    return false;
+  }
+  if (!slot) {
+    if (!autoTrack)
+      return false;
+    slot = claim(topic, topicLen, id);
+  }
+  if (!slot || len > valueSize) {
+    dropCount++;
+    return false;
+  }
+
+  seq = PEEK(slot->seq);
+  POKE(slot->seq, seq + 1);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy((uint8_t *)(slot + 1) + CACHE_ALIGN(MQTT_CACHE_TOPIC_SIZE), data, len);
+  POKE(slot->dataLen, (uint16_t)len);
+  STORE(slot->seq, seq + 2);
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Copies the last value of a topic. Reader side, never waits for the writer.
+ *
+ * @param[in] - id
+ *      The ID of the topic, see #topicId().
+ * @param[out] - buffer
+ *      Where the value is copied.
+ * @param[in] - size
+ *      The size of the buffer.
+ * @param[out] - len
+ *      If not NULL, set to the length of the value.
+ * @param[out] - version
+ *      If not NULL, set to the version of the value. It counts the values
+ *      received on the topic, so a change means there is a new value.
+ *
+ * @return - true if a value was copied. false if no value has been received
+ *           on the topic, the buffer is too small, or a new value was being
+ *           written on every one of MQTT_CACHE_READ_RETRIES attempts.
+ *
+ ******************************************************************************/
+bool MqttValueCache::read(uint32_t id, void *buffer, size_t size, size_t *len,
+                          uint32_t *version) {
+  mqtt_cache_slot_t *slot = find(id);
+
+  if (!slot)
+    return false;
+
+  for (int i = 0; i < MQTT_CACHE_READ_RETRIES; i++) {
+    uint32_t seq = LOAD(slot->seq);
+    size_t dataLen;
+    bool fits;
+
+    if (!seq)
+      return false;
+    if (seq & 1)
+      continue;
+    dataLen = PEEK(slot->dataLen);
+    fits = dataLen <= size;
+    if (fits)
+      memcpy(buffer, (uint8_t *)(slot + 1) + CACHE_ALIGN(MQTT_CACHE_TOPIC_SIZE),
+             dataLen);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (PEEK(slot->seq) != seq)
+      continue;
+    if (!fits)
+      return false;
+    if (len)
+      *len = dataLen;
+    if (version)
+      *version = seq / 2;
+    return true;
+  }
+  return false;
+}
+
+/*******************************************************************************
+ *
+ * Returns the version of the value of a topic, 0 if no value has been
+ * received. Reader side, cheap enough to poll for a new value.
+ *
+ ******************************************************************************/
+uint32_t MqttValueCache::version(uint32_t id) {
+  mqtt_cache_slot_t *slot = find(id);
+
+  return slot ? LOAD(slot->seq) / 2 : 0;
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of slots in the cache.
+ *
+ ******************************************************************************/
+size_t MqttValueCache::slots() {
+  return slotCount;
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of slots that have a topic.
+ *
+ ******************************************************************************/
+size_t MqttValueCache::used() {
+  return usedCount;
+}
+
+/*******************************************************************************
+ *
+ * Returns the number of values that could not be stored.
+ *
+ ******************************************************************************/
+uint32_t MqttValueCache::drops() {
+  return dropCount;
+}
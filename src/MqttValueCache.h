@@ -0,0 +1,107 @@
+/*
+ * ----------------------------------------------------------------------------
+ *                        _ _           _
+ *                       (_) |         | |
+ *                        _| |     __ _| |__  ___
+ *                       | | |    / _` | '_ \/ __|
+ *                       | | |___| (_| | |_) \__ \
+ *                       |_|______\__,_|_.__/|___/
+ *
+ * ----------------------------------------------------------------------------
+  Copyright (c) 2022 iLabs - Pontus Oldberg
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ * ----------------------------------------------------------------------------
+ */
+
+/** @file */
+
+#ifndef _H_MQTT_VALUE_CACHE_
+#define _H_MQTT_VALUE_CACHE_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define MQTT_CACHE_TOPIC_SIZE     64    /**< Max topic length in the cache, including the '\0' terminator */
+#define MQTT_CACHE_READ_RETRIES   8     /**< Times a read is retried while the value is being written */
+
+/**
+ * @typedef mqtt_cache_slot_t
+ * Header of a slot in the value cache. In the arena the header is followed
+ * by the topic, MQTT_CACHE_TOPIC_SIZE bytes, and then the value.
+ */
+typedef struct mqtt_cache_slot_s {
+  uint32_t id;            /**< Topic ID, 0 while the slot is free */
+  uint32_t seq;           /**< Sequence counter, odd while the value is written */
+  uint16_t dataLen;       /**< Length of the value */
+  uint16_t topicLen;      /**< Length of the topic */
+} mqtt_cache_slot_t;
+
+/*******************************************************************************
+ * MqttValueCache class definition
+ *
+ * Keeps the last value received on each topic in fixed size slots of a
+ * caller provided memory area, so the latest setpoint can be read at any time
+ * instead of only inside the message callback. A topic is known by its
+ * #topicId(), a hash of the topic that is computed once, after which a read
+ * is a direct lookup.
+ *
+ * There is one writer, the EspATMQTT object that receives the messages, and
+ * any number of readers, which may run on another core or in an interrupt.
+ * Each slot is a sequence lock: the writer makes the sequence counter odd
+ * while it copies a new value and readers retry if the counter was odd or
+ * changed during their copy, so neither side ever waits for a lock. The
+ * counter also serves as the version of the value.
+ ******************************************************************************/
+class MqttValueCache {
+public:
+  MqttValueCache();
+
+  bool begin(uint8_t *arena, size_t size, size_t valueSize);
+  void setAutoTrack(bool enable);
+  static uint32_t topicId(const char *topic);
+  static uint32_t topicId(const char *topic, size_t len);
+
+  // Writer side
+  uint32_t track(const char *topic);
+  bool update(const char *topic, size_t topicLen, const void *data, size_t len);
+
+  // Reader side
+  bool read(uint32_t id, void *buffer, size_t size, size_t *len = NULL,
+            uint32_t *version = NULL);
+  uint32_t version(uint32_t id);
+
+  size_t slots();
+  size_t used();
+  uint32_t drops();
+private:
+  mqtt_cache_slot_t *slotAt(size_t ix);
+  mqtt_cache_slot_t *find(uint32_t id);
+  mqtt_cache_slot_t *claim(const char *topic, size_t topicLen, uint32_t id);
+
+  uint8_t *arena;         /**< The memory area */
+  size_t slotCount;       /**< Number of slots in the area */
+  size_t slotSize;        /**< Size of one slot, header included */
+  size_t valueSize;       /**< Max length of a value */
+  size_t usedCount;       /**< Number of slots with a topic */
+  uint32_t dropCount;     /**< Values that did not fit or found no free slot */
+  bool autoTrack;         /**< Every received topic gets a slot, not only tracked ones */
+};
+
+#endif